@@ -90,7 +90,7 @@ public:
 		if (!_capacity) { _records = nullptr; return; }
 
 		T *tmp = new T[_capacity];
-		std::copy(_records, _records + _size, tmp);
+		std::move(_records, _records + _size, tmp);
 		delete[] _records;
 		_records = tmp;
 	//	ZAMAN_END(Realloc);
@@ -170,7 +170,7 @@ public:
 	{
 		ZAMAN_START(RemoveFirstK);
 		if (k < _size) {
-			std::copy(_records + k, _records + _size, _records);
+			std::move(_records + k, _records + _size, _records);
 			_size -= k;
 		} else {
 			_size = 0;
@@ -0,0 +1,120 @@
+#include "BlockCache.h"
+using namespace std;
+
+void BlockCache::Block::strings (const Record &r, const char *s[6]) const
+{
+	s[0] = text.c_str() + r.text;
+	for (int j = 1; j < 6; j++)
+		s[j] = s[j - 1] + strlen(s[j - 1]) + 1;
+}
+
+void BlockCache::Block::add (const Record &r, const string &rname, const string &cigar, const string &rnext,
+	const string &seq, const string &qual, const string &optional)
+{
+	records.push_back(r);
+	records.back().text = text.size();
+	for (auto s: { &rname, &cigar, &rnext, &seq, &qual, &optional }) {
+		text += *s;
+		text += '\0';
+	}
+}
+
+void BlockCache::Block::add (const Record &r, const char *const s[6])
+{
+	records.push_back(r);
+	records.back().text = text.size();
+	for (int j = 0; j < 6; j++) {
+		text += s[j];
+		text += '\0';
+	}
+}
+
+void BlockCache::Block::append (const Block &b)
+{
+	size_t offset = text.size();
+	text += b.text;
+	for (auto r: b.records) {
+		r.text += offset;
+		records.push_back(r);
+	}
+}
+
+size_t BlockCache::Block::memory (void) const
+{
+	return sizeof(Block) + records.capacity() * sizeof(Record) + text.capacity();
+}
+
+BlockCache::BlockCache (size_t capacity):
+	capacity(capacity), used(0), hits(0), misses(0), evictions(0)
+{
+}
+
+shared_ptr<BlockCache::Block> BlockCache::find (int f, const string &chr, size_t start, size_t block, int fields)
+{
+	lock_guard<mutex> lock(mtx);
+	auto it = lookup.find(make_tuple(f, chr, start, block));
+	if (it == lookup.end()) {
+		misses++;
+		return nullptr;
+	}
+	auto b = it->second->second;
+	if ((b->fields & fields) != fields) {
+		erase(it);
+		misses++;
+		return nullptr;
+	}
+	blocks.splice(blocks.begin(), blocks, it->second);
+	hits++;
+	return b;
+}
+
+void BlockCache::insert (int f, const string &chr, size_t start, size_t block, shared_ptr<Block> b)
+{
+	lock_guard<mutex> lock(mtx);
+	if (b->memory() > capacity)
+		return;
+	auto key = make_tuple(f, chr, start, block);
+	auto it = lookup.find(key);
+	if (it != lookup.end())
+		erase(it);
+	blocks.push_front(make_pair(key, b));
+	lookup[key] = blocks.begin();
+	used += b->memory();
+	evict();
+}
+
+void BlockCache::resize (size_t capacity)
+{
+	lock_guard<mutex> lock(mtx);
+	this->capacity = capacity;
+	evict();
+}
+
+void BlockCache::clear (void)
+{
+	lock_guard<mutex> lock(mtx);
+	blocks.clear();
+	lookup.clear();
+	used = 0;
+}
+
+BlockCache::Statistics BlockCache::statistics (void) const
+{
+	lock_guard<mutex> lock(mtx);
+	return { hits, misses, evictions, blocks.size(), used, capacity };
+}
+
+void BlockCache::erase (map<Key, List::iterator>::iterator it)
+{
+	used -= it->second->second->memory();
+	blocks.erase(it->second);
+	lookup.erase(it);
+}
+
+void BlockCache::evict (void)
+{
+	while (used > capacity) {
+		erase(lookup.find(blocks.back().first));
+		evictions++;
+	}
+}
@@ -0,0 +1,77 @@
+#ifndef BlockCache_H
+#define BlockCache_H
+
+#include "Common.h"
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Size-bounded LRU cache of the decoded blocks, used by the API for random-access queries.
+// Each block keeps all of its records in a compact layout: fixed-size records
+// whose strings are stored one after another (each ending with '\0') in the text of the block.
+// Blocks are keyed by file, chromosome and block start (and by the block number,
+// as several blocks of a chromosome may start at the same position).
+// The cache is shared by the queries of all threads; cached blocks are never modified.
+class BlockCache {
+public:
+	struct Record {
+		uint64_t start, end; // span on the reference (0-based, end exclusive)
+		uint64_t pnext;
+		int32_t flag, tlen;
+		uint32_t mapq;
+		uint64_t text; // offset of QNAME, CIGAR, RNEXT, SEQ, QUAL and optional fields
+	};
+	struct Block {
+		int fields; // decoded SAM columns (see FileDecompressor::Field)
+		std::string chr;
+		std::vector<Record> records; // sorted by start
+		std::string text;
+
+		Block (void): fields(0) {}
+		// QNAME, CIGAR, RNEXT, SEQ, QUAL and optional fields of the record
+		void strings (const Record &r, const char *s[6]) const;
+		void add (const Record &r, const std::string &rname, const std::string &cigar, const std::string &rnext,
+			const std::string &seq, const std::string &qual, const std::string &optional);
+		void add (const Record &r, const char *const s[6]);
+		// Appends the records and the text of the block
+		void append (const Block &b);
+		size_t memory (void) const;
+	};
+	struct Statistics {
+		size_t hits, misses, evictions;
+		size_t blocks, memory, capacity;
+	};
+
+private:
+	typedef std::tuple<int, std::string, size_t, size_t> Key;
+	typedef std::list<std::pair<Key, shared_ptr<Block>>> List;
+
+	List blocks; // most recently used first
+	std::map<Key, List::iterator> lookup;
+	size_t capacity, used;
+	size_t hits, misses, evictions;
+	mutable std::mutex mtx;
+
+public:
+	BlockCache (size_t capacity);
+
+public:
+	// Cached block if it has all the given fields (the block with fewer fields is dropped)
+	shared_ptr<Block> find (int f, const std::string &chr, size_t start, size_t block, int fields);
+	// Adds the block, evicting the least recently used blocks past the capacity
+	void insert (int f, const std::string &chr, size_t start, size_t block, shared_ptr<Block> b);
+	// Capacity in bytes (0 disables the cache)
+	void resize (size_t capacity);
+	void clear (void);
+	Statistics statistics (void) const;
+
+private:
+	void erase (std::map<Key, List::iterator>::iterator it);
+	void evict (void);
+};
+
+#endif // BlockCache_H
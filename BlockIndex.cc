@@ -0,0 +1,281 @@
+#include "BlockIndex.h"
+#include "Streams/GzipStream.h"
+
+#include <algorithm>
+#include <numeric>
+#include <unistd.h>
+#include <sys/mman.h>
+using namespace std;
+
+static inline size_t align8 (size_t pos)
+{
+	return (pos + 7) & ~size_t(7);
+}
+
+static void pad8 (FILE *out)
+{
+	static const char zeros[8] = { 0 };
+	size_t pos = ftell(out);
+	fwrite(zeros, 1, align8(pos) - pos, out);
+}
+
+BlockIndex::BlockIndex (shared_ptr<File> file, const string &path, size_t start, size_t end):
+	section(0), mapping(0), mappingSize(0)
+{
+	ZAMAN_START_P(MapIndex);
+	start = align8(start);
+	if (end < start + trailerSize())
+		throw DZException("Index is corrupted");
+	sectionSize = end - start;
+	if (!File::IsWeb(path)) {
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t offset = start / page * page;
+		mappingSize = end - offset;
+		mapping = mmap(0, mappingSize, PROT_READ, MAP_SHARED, fileno((FILE*)file->handle()), offset);
+		if (mapping == MAP_FAILED) {
+			mapping = 0;
+		} else {
+			section = (const uint8_t*)mapping + (start - offset);
+		}
+	}
+	if (!section) {
+		buffer.resize(sectionSize);
+		if (file->read(buffer.data(), sectionSize, start) != sectionSize)
+			throw DZException("Cannot read the index");
+		section = buffer.data();
+	}
+	setTables(section, sectionSize);
+	ZAMAN_END_P(MapIndex);
+}
+
+BlockIndex::BlockIndex (gzFile idxFile, uint32_t magic, int numFiles):
+	section(0), sectionSize(0), mapping(0), mappingSize(0)
+{
+	ZAMAN_START_P(LoadIndex);
+	map<pair<int, string>, uint32_t> chrs;
+	vector<pair<int, string>> chrNames;
+	// Stream states after the last block of each file;
+	// each entry is followed by the states after its block
+	vector<shared_ptr<State>> state(numFiles);
+	for (auto &st: state)
+		st = make_shared<State>(8);
+	while (1) {
+		Entry e;
+		memset(&e, 0, sizeof(Entry));
+		string chr;
+
+		int16_t f = 0;
+		if ((magic & 0xff) >= 0x11) {
+			if (gzread(idxFile, &f, sizeof(int16_t)) != sizeof(int16_t))
+				break;
+			gzread(idxFile, &e.zpos, sizeof(size_t));
+		}
+		else {
+			if (gzread(idxFile, &e.zpos, sizeof(size_t)) != sizeof(size_t))
+				break;
+		}
+		if (f < 0 || f >= numFiles)
+			throw DZException("Invalid file index %d", f);
+		e.file = f;
+
+		gzread(idxFile, &e.count, sizeof(size_t));
+		char c; while (gzread(idxFile, &c, 1) && c) chr += c;
+		gzread(idxFile, &e.startPos, sizeof(size_t));
+		gzread(idxFile, &e.endPos, sizeof(size_t));
+		gzread(idxFile, &e.fS, sizeof(size_t));
+		gzread(idxFile, &e.fE, sizeof(size_t));
+
+		auto it = chrs.find(make_pair(f, chr));
+		if (it == chrs.end()) {
+			it = chrs.insert(make_pair(make_pair(f, chr), chrNames.size())).first;
+			chrNames.push_back(make_pair(f, chr));
+		}
+		e.chr = it->second;
+
+		oldStates.push_back(state[f]);
+		state[f] = make_shared<State>(8);
+		for (int i = 0; i < 8; i++) {
+			size_t sz = 0;
+			gzread(idxFile, &sz, sizeof(size_t));
+			(*state[f])[i].resize(sz);
+			if (sz) gzread(idxFile, (*state[f])[i].data(), sz);
+		}
+		oldEntries.push_back(e);
+	}
+
+	buildTables(oldEntries, chrNames, oldChromosomes, oldNames, oldSorted);
+	entries = oldEntries.data();
+	chromosomes = oldChromosomes.data();
+	names = oldNames.c_str();
+	blockCount = oldEntries.size();
+	chromosomeCount = oldChromosomes.size();
+	sorted = oldSorted.data();
+	ZAMAN_END_P(LoadIndex);
+}
+
+// Sorts the chromosomes by file and name (renumbering the chromosomes of the entries)
+// and the blocks of each chromosome by start position (blocks with the same start stay in the file order)
+void BlockIndex::buildTables (vector<Entry> &entries, const vector<pair<int, string>> &chrNames,
+	vector<Chromosome> &chromosomes, string &names, vector<uint64_t> &sorted)
+{
+	vector<uint32_t> order(chrNames.size());
+	iota(order.begin(), order.end(), 0);
+	sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return chrNames[a] < chrNames[b]; });
+	vector<uint32_t> renumber(chrNames.size());
+	for (uint32_t i = 0; i < order.size(); i++) {
+		renumber[order[i]] = i;
+		chromosomes.push_back({ (uint32_t)chrNames[order[i]].first, (uint32_t)names.size(), 0, 0 });
+		names += chrNames[order[i]].second;
+		names += '\0';
+	}
+	for (auto &e: entries)
+		e.chr = renumber[e.chr];
+
+	sorted.resize(entries.size());
+	iota(sorted.begin(), sorted.end(), 0);
+	stable_sort(sorted.begin(), sorted.end(), [&](uint64_t a, uint64_t b) {
+		return make_pair(entries[a].chr, entries[a].startPos) < make_pair(entries[b].chr, entries[b].startPos);
+	});
+	for (size_t i = 0; i < sorted.size(); i++) {
+		Chromosome &c = chromosomes[entries[sorted[i]].chr];
+		if (!c.count)
+			c.first = i;
+		c.count++;
+	}
+}
+
+BlockIndex::~BlockIndex (void)
+{
+	if (mapping)
+		munmap(mapping, mappingSize);
+}
+
+void BlockIndex::setTables (const uint8_t *data, size_t size)
+{
+	uint64_t trailer[4];
+	memcpy(trailer, data + size - trailerSize(), trailerSize());
+	blockCount = trailer[0];
+	chromosomeCount = trailer[1];
+	size_t namesSize = trailer[2], offset = trailer[3];
+	if (offset % 8 || offset + blockCount * (sizeof(Entry) + sizeof(uint64_t))
+			+ chromosomeCount * sizeof(Chromosome) + namesSize + trailerSize() != size)
+		throw DZException("Index is corrupted");
+
+	entries = (const Entry*)(data + offset);
+	chromosomes = (const Chromosome*)(entries + blockCount);
+	sorted = (const uint64_t*)(chromosomes + chromosomeCount);
+	names = (const char*)(sorted + blockCount);
+	if (namesSize && names[namesSize - 1])
+		throw DZException("Index is corrupted");
+	for (size_t i = 0; i < chromosomeCount; i++)
+		if (chromosomes[i].name >= namesSize || chromosomes[i].first + chromosomes[i].count > blockCount)
+			throw DZException("Index is corrupted");
+	for (size_t k = 0; k < blockCount; k++)
+		if (entries[k].chr >= chromosomeCount || entries[k].state + entries[k].stateSize > offset)
+			throw DZException("Index is corrupted");
+}
+
+index_t BlockIndex::operator[] (size_t k) const
+{
+	const Entry &e = entries[k];
+	index_t idx;
+	idx.file = e.file;
+	idx.startPos = e.startPos;
+	idx.endPos = e.endPos;
+	idx.zpos = e.zpos;
+	idx.currentBlockCount = e.count;
+	idx.fS = e.fS;
+	idx.fE = e.fE;
+	return idx;
+}
+
+shared_ptr<BlockIndex::State> BlockIndex::state (size_t k) const
+{
+	if (!section)
+		return oldStates[k];
+
+	auto st = make_shared<State>(8);
+	const Entry &e = entries[k];
+	if (!e.stateSize)
+		return st;
+	Array<uint8_t> raw(e.stateRawSize);
+	raw.resize(e.stateRawSize);
+	GzipDecompressionStream gzc;
+	if (gzc.decompress((uint8_t*)section + e.state, e.stateSize, raw, 0) != e.stateRawSize)
+		throw DZException("Index is corrupted");
+	size_t pos = 0;
+	for (int i = 0; i < 8; i++) {
+		uint64_t sz;
+		if (pos + sizeof(uint64_t) > raw.size())
+			throw DZException("Index is corrupted");
+		memcpy(&sz, raw.data() + pos, sizeof(uint64_t));
+		pos += sizeof(uint64_t);
+		if (pos + sz > raw.size())
+			throw DZException("Index is corrupted");
+		(*st)[i].resize(sz);
+		if (sz) memcpy((*st)[i].data(), raw.data() + pos, sz);
+		pos += sz;
+	}
+	return st;
+}
+
+bool BlockIndex::find (int f, const string &chr, size_t &first, size_t &last) const
+{
+	auto it = lower_bound(chromosomes, chromosomes + chromosomeCount, make_pair(f, chr),
+		[&](const Chromosome &c, const pair<int, string> &p) {
+			return c.file != p.first ? (int)c.file < p.first : strcmp(names + c.name, p.second.c_str()) < 0;
+		});
+	if (it == chromosomes + chromosomeCount || it->file != f || chr != names + it->name)
+		return false;
+	first = it->first;
+	last = it->first + it->count;
+	return true;
+}
+
+size_t BlockIndex::seek (size_t first, size_t last, size_t pos) const
+{
+	size_t i = upper_bound(sorted + first, sorted + last, pos, [&](size_t p, uint64_t k) {
+		return p < entries[k].startPos;
+	}) - sorted;
+	if (i == first)
+		return first;
+	i--;
+	while (i > first && entries[sorted[i - 1]].startPos == entries[sorted[i]].startPos)
+		i--;
+	return i;
+}
+
+vector<pair<string, pair<size_t, size_t>>> BlockIndex::fileChromosomes (int f) const
+{
+	vector<pair<string, pair<size_t, size_t>>> result;
+	for (size_t i = 0; i < chromosomeCount; i++) if (chromosomes[i].file == f)
+		result.push_back(make_pair(string(names + chromosomes[i].name),
+			make_pair(chromosomes[i].first, chromosomes[i].first + chromosomes[i].count)));
+	return result;
+}
+
+void BlockIndex::write (FILE *out, FILE *states, vector<Entry> &entries, const vector<pair<int, string>> &chrNames)
+{
+	fwrite("DZMAP", 1, 5, out);
+	pad8(out);
+	size_t start = ftell(out);
+	char *buffer = (char*)malloc(MB);
+	fseek(states, 0, SEEK_SET);
+	while (size_t sz = fread(buffer, 1, MB, states))
+		fwrite(buffer, 1, sz, out);
+	free(buffer);
+	pad8(out);
+	uint64_t offset = ftell(out) - start;
+
+	vector<Chromosome> chromosomes;
+	string names;
+	vector<uint64_t> sorted;
+	buildTables(entries, chrNames, chromosomes, names, sorted);
+
+	fwrite(entries.data(), sizeof(Entry), entries.size(), out);
+	fwrite(chromosomes.data(), sizeof(Chromosome), chromosomes.size(), out);
+	fwrite(sorted.data(), sizeof(uint64_t), sorted.size(), out);
+	fwrite(names.c_str(), 1, names.size(), out);
+	uint64_t trailer[4] = { entries.size(), chromosomes.size(), names.size(), offset };
+	fwrite(trailer, sizeof(uint64_t), 4, out);
+}
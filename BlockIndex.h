@@ -0,0 +1,101 @@
+#ifndef BlockIndex_H
+#define BlockIndex_H
+
+#include "Common.h"
+#include "FileIO.h"
+
+#include <map>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+struct index_t {
+	int file;
+	size_t startPos, endPos;
+	size_t zpos, currentBlockCount;
+	size_t fS, fE;
+};
+
+// Index of the blocks of a DeeZ file.
+// Since DeeZ 0x21, the index is stored uncompressed after the stats (section DZMAP):
+//		stream states of each block, gzipped one block at a time
+//		Entry[blocks] in the file order
+//		Chromosome[chromosomes] sorted by file and name
+//		uint64_t[blocks]: blocks of each chromosome sorted by start position
+//		chromosome names
+//		uint64_t blocks, chromosomes, names size, offset of the entries
+// The section is mapped on open (read at once for web files),
+// so lookups are binary searches over the mapping and only
+// the stream states of the blocks which are decoded are ever inflated.
+// Older files store a gzipped list of blocks (section DZIDX),
+// which is loaded at once into the same tables.
+class BlockIndex {
+public:
+	struct Entry {
+		uint64_t zpos, count, startPos, endPos, fS, fE;
+		uint64_t state, stateSize, stateRawSize; // stream states at the start of the block (offset within the section)
+		uint32_t file, chr;
+	};
+	struct Chromosome {
+		uint32_t file, name; // name: offset within the names
+		uint64_t first, count; // blocks within the sorted list
+	};
+	typedef std::vector<Array<uint8_t>> State;
+
+private:
+	const uint8_t *section;
+	size_t sectionSize;
+	void *mapping;
+	size_t mappingSize;
+	Array<uint8_t> buffer; // section of the web files
+
+	const Entry *entries;
+	const Chromosome *chromosomes;
+	const uint64_t *sorted;
+	const char *names;
+	size_t blockCount, chromosomeCount;
+
+	// Tables of the old index
+	std::vector<Entry> oldEntries;
+	std::vector<Chromosome> oldChromosomes;
+	std::vector<uint64_t> oldSorted;
+	std::string oldNames;
+	std::vector<shared_ptr<State>> oldStates;
+
+public:
+	// Maps the DZMAP section of the file, which follows its key at start (aligned to 8 bytes) and ends at end
+	BlockIndex (shared_ptr<File> file, const std::string &path, size_t start, size_t end);
+	// Loads the old gzipped index
+	BlockIndex (gzFile idxFile, uint32_t magic, int numFiles);
+	~BlockIndex (void);
+
+public:
+	size_t size (void) const { return blockCount; }
+	index_t operator[] (size_t k) const;
+	shared_ptr<State> state (size_t k) const;
+
+	// Blocks of the chromosome, sorted by the start position, are [first, last) of the sorted list.
+	// Returns false if the file has no such chromosome
+	bool find (int f, const std::string &chr, size_t &first, size_t &last) const;
+	// Block within [first, last) of the sorted list from which the records at the position are decoded:
+	// the first block with the last start at or before the position (or the first block)
+	size_t seek (size_t first, size_t last, size_t pos) const;
+	size_t sortedBlock (size_t i) const { return sorted[i]; }
+	// Chromosomes of the file in the name order, with their ranges in the sorted list
+	std::vector<std::pair<std::string, std::pair<size_t, size_t>>> fileChromosomes (int f) const;
+
+public:
+	// Writes the DZMAP section: stream states (already written to the states file,
+	// their offsets being relative to its start) followed by the tables.
+	// Chromosomes of the entries are the positions in chrNames, which are renumbered here
+	static void write (FILE *out, FILE *states, std::vector<Entry> &entries,
+		const std::vector<std::pair<int, std::string>> &chrNames);
+	static size_t trailerSize (void) { return 4 * sizeof(uint64_t); }
+
+private:
+	void setTables (const uint8_t *data, size_t size);
+	static void buildTables (std::vector<Entry> &entries, const std::vector<std::pair<int, std::string>> &chrNames,
+		std::vector<Chromosome> &chromosomes, std::string &names, std::vector<uint64_t> &sorted);
+};
+
+#endif // BlockIndex_H
@@ -0,0 +1,64 @@
+#ifndef BoundedQueue_H
+#define BoundedQueue_H
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+// Blocking FIFO with a fixed number of slots used to hand blocks between pipeline stages.
+// push() blocks while the queue is full, pop() while it is empty.
+// close() wakes everybody: further pushes fail, pops drain what is left and then fail.
+template<class T>
+class BoundedQueue {
+	std::deque<T> _items;
+	size_t _capacity;
+	bool _closed;
+
+	std::mutex _mtx;
+	std::condition_variable _notEmpty, _notFull;
+
+public:
+	BoundedQueue (size_t capacity):
+		_capacity(capacity ? capacity : 1), _closed(false)
+	{
+	}
+
+	bool push (T t)
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+		_notFull.wait(lock, [&] { return _closed || _items.size() < _capacity; });
+		if (_closed)
+			return false;
+		_items.push_back(std::move(t));
+		_notEmpty.notify_one();
+		return true;
+	}
+
+	bool pop (T &t)
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+		_notEmpty.wait(lock, [&] { return _closed || _items.size(); });
+		if (!_items.size())
+			return false;
+		t = std::move(_items.front());
+		_items.pop_front();
+		_notFull.notify_one();
+		return true;
+	}
+
+	void close (void)
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+		_closed = true;
+		_notEmpty.notify_all();
+		_notFull.notify_all();
+	}
+
+	size_t size (void)
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+		return _items.size();
+	}
+};
+
+#endif // BoundedQueue_H
@@ -4,9 +4,14 @@
 #include <cstring>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <assert.h>
+#include <algorithm>
 #include "Utils.h"
 
-#if 0
+// Ring buffer with stable indices: index 0 is always the oldest element.
+// Removing the first k elements only moves the start, so the elements
+// which are kept (e.g. records carried over to the next block) are never moved.
+// Removed slots keep their objects and are handed out again by add().
 template<class T>
 class CircularArray {
 	T* _records;
@@ -18,7 +23,7 @@ class CircularArray {
 
 public:
 	CircularArray():
-		_records(0), _size(0), _start(0), _capacity(0), _extend(0)
+		_records(0), _size(0), _start(0), _extend(100), _capacity(0)
 	{
 	}
 
@@ -29,7 +34,7 @@ public:
 		_extend = _capacity; // by default, double ...
 	}
 
-	~CircularArray (void) 
+	~CircularArray (void)
 	{
 		if (_records) {
 			delete[] _records;
@@ -44,9 +49,10 @@ public:
 		_size = a._size;
 		_capacity = a._capacity;
 		_extend = a._extend;
-		_start = a._start;
-		_records = new T[a._capacity];
-		std::copy(a._records, a._records + a._size, _records);
+		_start = 0;
+		_records = _capacity ? new T[_capacity] : 0;
+		for (size_t i = 0; i < _size; i++)
+			_records[i] = a[i];
 	//	ZAMAN_END(CArray_Copy);
 	}
 
@@ -55,7 +61,7 @@ public:
 		swap(*this, a);
 	}
 
-	CircularArray& operator= (CircularArray a) 
+	CircularArray& operator= (CircularArray a)
 	{
 		swap(*this, a);
 		return *this;
@@ -72,16 +78,23 @@ public:
 		swap(a._extend, b._extend);
 	}
 
+private:
+	size_t pos (size_t i) const
+	{
+		i += _start;
+		return i >= _capacity ? i - _capacity : i;
+	}
+
 public:
-	void realloc (size_t sz) 
+	void realloc (size_t sz)
 	{
-		size_t newcap = sz + _extend;
+		size_t newcap = std::max(sz + _extend, _capacity + 1);
 		T *tmp = new T[newcap];
 
-		size_t p1 = std::min(_capacity - _start, _size);
-		size_t p2 = _size - p1;
-		std::copy(_records + _start, _records + _start + p1, tmp);
-		std::copy(_records, _records + p2, tmp + p1);
+		// Elements (and the objects of the free slots) are moved in ring order
+		size_t p1 = _capacity - _start;
+		std::move(_records + _start, _records + _capacity, tmp);
+		std::move(_records, _records + _start, tmp + p1);
 
 		_start = 0;
 		_capacity = newcap;
@@ -89,24 +102,24 @@ public:
 		_records = tmp;
 	}
 
-	void resize (size_t sz) 
+	void resize (size_t sz)
 	{
-		while (sz > _capacity)
+		if (sz > _capacity)
 			realloc(sz);
 		_size = sz;
 	}
 
 	// add element, realloc if needed
-	void add (const T &t) 
+	void add (const T &t)
 	{
 		if (_size == _capacity)
 			realloc(_capacity);
-		_records[(_start + _size) % _capacity] = t;
+		_records[pos(_size)] = t;
 		_size++;
 	}
 
 	// Add defualt element or use allocated
-	void add () 
+	void add ()
 	{
 		if (_size == _capacity)
 			realloc(_capacity);
@@ -114,60 +127,44 @@ public:
 	}
 
 	// add array, realloc if needed
-	void add (const T *t, size_t sz) 
+	void add (const T *t, size_t sz)
 	{
 		// can be faster!
 		for (size_t i = 0; i < sz; i++)
 			add(t[i]);
 	}
 
-	T &operator[] (size_t i) 
+	T &operator[] (size_t i)
 	{
 		assert(i < _size);
-		return _records[(_start + i) % _capacity];
+		return _records[pos(i)];
 	}
 
-	const T &operator[] (size_t i) const 
+	const T &operator[] (size_t i) const
 	{
 		assert(i < _size);
-		return _records[(_start + i) % _capacity];
+		return _records[pos(i)];
 	}
 
-	size_t size (void) const 
+	size_t size (void) const
 	{
 		return _size;
 	}
 
-	void remove_first_n (size_t k) 
+	void remove_first_n (size_t k)
 	{
 		assert (k <= _size);
+		if (!_capacity)
+			return;
 		_size -= k;
-		_start = (_start + k) % _capacity;
+		_start = pos(k);
 		//fprintf(stderr,"Resized %d\n",_size);
 	}
 
-	T *head (void) 
-	{
-		return _records + _start;
-	}
-
-	T *increase (T *x) 
-	{
-		if (x + 1 == _records + _capacity)
-			return _records;
-		else return x + 1;
-	}
-
 	/// 	 for memory checking
 	size_t capacity (void) const {
 		return _capacity;
 	}
-
-	T *data (void) {
-		return _records;
-	}
-
 };
 
 #endif
-#endif
\ No newline at end of file
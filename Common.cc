@@ -7,6 +7,7 @@ using namespace std;
 #ifdef ZAMAN
 	thread_local __zaman__ __zaman_thread__;
 	std::map<std::string, uint64_t> __zaman__::times_global;
+	std::map<std::string, uint64_t> __zaman__::counts_global;
 	std::string __zaman__::prefix_global;
 	std::mutex __zaman__::mtx;
 #endif
@@ -19,8 +19,8 @@
 #include "Array.h"
 #include "CircularArray.h"
 #include "Streams/Stream.h"
+#include "Scheduler.h"
 
-extern ctpl::thread_pool ThreadPool;
 extern bool optStdout;
 extern int  optThreads;
 extern int  optLogLevel;
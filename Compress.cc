@@ -37,12 +37,10 @@ FileCompressor::FileCompressor (const string &outFile, const vector<string> &sam
 			throw DZException("Cannot open the file %s", outFile.c_str());
 	}
 
-	FILE *tmp = tmpfile();
-	int tmpFile = dup(fileno(tmp));
-	indexTmp = fdopen(tmpFile, "rb");
-	indexFile = gzdopen(fileno(tmp), "wb6");
-	if (indexFile == Z_NULL)	
+	indexStates = tmpfile();
+	if (indexStates == NULL)	
 		throw DZException("Cannot open temporary file");
+	indexLastState.resize(parsers.size());
 }
 
 FileCompressor::~FileCompressor (void) 
@@ -102,25 +100,122 @@ void FileCompressor::outputComment (void)
 }
 
 template<typename Compressor, typename... ExtraParams>
-void FileCompressor::compressBlock (int f, Array<uint8_t>& out, Array<uint8_t>& idxOut, size_t k, shared_ptr<Compressor> c, ExtraParams&... params) 
+void FileCompressor::compressBlock (Block &b, Array<uint8_t>& out, Array<uint8_t>& idxOut, shared_ptr<Compressor> c, ExtraParams&... params) 
 {
 	out.resize(0);
-	c->outputRecords(records[f], out, 0, k, params...);
+	c->outputRecords(b.records, out, 0, b.count, params...);
 	idxOut.resize(0);
 	c->getIndexData(idxOut);
 }
 
-void FileCompressor::outputBlock (Array<uint8_t> &out, Array<uint8_t> &idxOut) 
+void FileCompressor::compressBlock (Block &b) 
+{
+	int16_t f = b.f;
+	for (int i = 0; i < 8; i++) {
+		b.outputBuffer[i].set_extend(MB);
+		b.idxBuffer[i].set_extend(MB);
+	}
+
+	// Field index doubles as the affinity hint, so the same field
+	// (and its model state) tends to stay on the same worker across blocks
+	TaskGroup tasks;
+	tasks.run([&]() {
+		compressBlock(b, b.outputBuffer[7], b.idxBuffer[7], optField[f], b.optFields, b.optLibrary);
+	}, 7);
+	tasks.run([&]() {
+		try {
+			compressBlock(b, b.outputBuffer[0], b.idxBuffer[0], sequence[f], b.fixedStart, b.fixedEnd);
+			compressBlock(b, b.outputBuffer[1], b.idxBuffer[1], editOp[f], b.editOps);
+			b.sequenceDone.set_value();
+		} catch (...) {
+			b.sequenceDone.set_exception(current_exception());
+		}
+	}, 0);
+	tasks.run([&]() {
+		compressBlock(b, b.outputBuffer[2], b.idxBuffer[2], readName[f], b.pairedEndInfos);
+	}, 2);
+	tasks.run([&]() {
+		compressBlock(b, b.outputBuffer[3], b.idxBuffer[3], mapFlag[f]);
+	}, 3);
+	tasks.run([&]() {
+		compressBlock(b, b.outputBuffer[4], b.idxBuffer[4], mapQual[f]);
+	}, 4);
+	tasks.run([&]() {
+		compressBlock(b, b.outputBuffer[5], b.idxBuffer[5], quality[f], b.qualityOffset);
+	}, 5);
+	tasks.run([&]() {
+		compressBlock(b, b.outputBuffer[6], b.idxBuffer[6], pairedEnd[f], b.pairedEndInfos);
+	}, 6);
+	optField[f]->compressThreads(b.optFieldBuffers, tasks);
+	tasks.wait();
+}
+
+void FileCompressor::outputBlock (Array<uint8_t> &out) 
 {
 	size_t out_sz = out.size();
 	fwrite(&out_sz, sizeof(size_t), 1, outputFile);
 	if (out_sz) 
 		fwrite(out.data(), 1, out_sz, outputFile);
-	
-	out_sz = idxOut.size();
-	gzwrite(indexFile, &out_sz, sizeof(size_t));
-	if (out_sz) 
-		gzwrite(indexFile, idxOut.data(), out_sz);
+}
+
+void FileCompressor::outputBlock (Block &b) 
+{
+	ZAMAN_START(WriteIndex);
+	size_t zpos = ftell(outputFile);
+
+	fwrite(&b.op, sizeof(char), 1, outputFile);
+	if (b.op) 
+		fwrite(b.chr.c_str(), b.chr.size() + 1, 1, outputFile);
+
+	BlockIndex::Entry e = indexLastState[b.f];
+	e.file = b.f;
+	e.zpos = zpos;
+	e.count = b.count;
+	e.startPos = b.firstLoc;
+	e.endPos = b.lastLoc;
+	e.fS = b.fixedStart;
+	e.fE = b.fixedEnd;
+	auto chr = indexChromosomes.insert(make_pair(make_pair(b.f, b.chr), indexChrNames.size()));
+	if (chr.second)
+		indexChrNames.push_back(chr.first->first);
+	e.chr = chr.first->second;
+	indexEntries.push_back(e);
+
+	Array<uint8_t> state(0, MB);
+	for (int ti = 0; ti < 8; ti++) {
+		uint64_t sz = b.idxBuffer[ti].size();
+		state.add((uint8_t*)&sz, sizeof(uint64_t));
+		state.add(b.idxBuffer[ti].data(), sz);
+	}
+	GzipCompressionStream<6> gzc;
+	Array<uint8_t> arc;
+	size_t arcsz = gzc.compress(state.data(), state.size(), arc, 0);
+	BlockIndex::Entry &next = indexLastState[b.f];
+	next.state = ftell(indexStates);
+	next.stateSize = arcsz;
+	next.stateRawSize = state.size();
+	fwrite(arc.data(), 1, arcsz, indexStates);
+	ZAMAN_END(WriteIndex);
+
+	ZAMAN_START(Output);
+	for (int ti = 0; ti < b.optFieldBuffers.size(); ti++)
+		b.outputBuffer[7].add(b.optFieldBuffers[ti].data(), b.optFieldBuffers[ti].size());
+	for (int ti = 0; ti < 8; ti++)
+		outputBlock(b.outputBuffer[ti]);
+	ZAMAN_END(Output);
+}
+
+template<typename T>
+void FileCompressor::takeFirstK (CircularArray<T> &from, Array<T> &to, size_t k)
+{
+	// Swap, so that the staging array gets already constructed elements
+	// of the recycled block in return
+	if (to.capacity() < k) 
+		to = Array<T>(k);
+	to.resize(k);
+	for (size_t i = 0; i < k; i++)
+		swap(from[i], to[i]);
+	from.remove_first_n(k);
 }
 
 void FileCompressor::parser(size_t f, size_t start, size_t end, unordered_map<int32_t, map<string, int>> &library)
@@ -136,7 +231,7 @@ void FileCompressor::parser(size_t f, size_t start, size_t end, unordered_map<in
 		if (p_loc == (size_t)-1) p_loc = 0;
 
 		ZAMAN_START(EditOperation);
-		editOps[f][i] = EditOperation(loc, rc.getSequence(), rc.getCigar());
+		editOps[f][i].reset(loc, rc.getSequence(), rc.getSequenceSize(), rc.getCigar(), rc.getCigarSize());
 		ZAMAN_END(EditOperation);
 
 		ZAMAN_START(PairedEnd);
@@ -144,7 +239,7 @@ void FileCompressor::parser(size_t f, size_t start, size_t end, unordered_map<in
 		assert(eo.ops.size());
 		maxEnd = max(maxEnd, eo.end);
 		pairedEndInfos[f][i] = PairedEndInfo(
-			rc.getPairChromosome(), p_loc, rc.getTemplateLenght(), 
+			string(rc.getPairChromosome(), rc.getPairChromosomeSize()), p_loc, rc.getTemplateLenght(), 
 			eo.start, eo.end - eo.start, rc.getMappingFlag() & 0x10);
 		ZAMAN_END(PairedEnd);
 
@@ -153,10 +248,14 @@ void FileCompressor::parser(size_t f, size_t start, size_t end, unordered_map<in
 		ZAMAN_END(Optionals);
 
 		ZAMAN_START(Qualities);
-		size_t est = quality[f]->shrink((char*)rc.getQuality(), strlen(rc.getQuality()), rc.getMappingFlag());
+		const char *q = rc.getQuality();
+		size_t est = quality[f]->shrink(q, rc.getQualitySize(), rc.getMappingFlag());
 		if (!quality[f]->getOffset()) {
-			const char *q = rc.getQuality();
-			while (*q) st[*q]++, q++;
+			// scores kept by shrink: a prefix, or a suffix for the reverse strand records
+			if (rc.getMappingFlag() & 0x10)
+				q += rc.getQualitySize() - est;
+			for (size_t j = 0; j < est; j++)
+				st[q[j]]++;
 		}
 		ZAMAN_END(Qualities);
 
@@ -174,8 +273,16 @@ void FileCompressor::parser(size_t f, size_t start, size_t end, unordered_map<in
 
 size_t FileCompressor::currentMemUsage(size_t f)
 {
-	// this is slow otherwise; use only for debugging
-	return 0; //sizeInMemory(records) + sizeInMemory(editOps) + sizeInMemory(pairedEndInfos); 
+	return stagedMemory[f] + sequence[f]->currentMemoryUsage();
+}
+
+// Estimate taken from the raw record, before it is parsed: the line itself,
+// the sequence and the expanded CIGAR of its edit operation (about the size of the sequence),
+// the optional fields, and the fixed parts of the structures
+size_t FileCompressor::recordMemUsage(const Record &rc)
+{
+	return sizeof(Record) + sizeof(EditOperation) + sizeof(PairedEndInfo) + sizeof(OptionalField) + sizeof(size_t)
+		+ rc.getLineLength() + 2 * rc.getSequenceSize() + rc.getOptionalSize();
 }
 
 void FileCompressor::outputRecords (void) 
@@ -187,313 +294,436 @@ void FileCompressor::outputRecords (void)
 	vector<int64_t> currentSize(parsers.size(), 0);
 	for (int16_t f = 0; f < parsers.size(); f++) {
 		stats[f].fileName = parsers[f]->fileName();
-		records.push_back(Array<Record>(blockSize));
-		editOps.push_back(Array<EditOperation>(blockSize));
-		pairedEndInfos.push_back(Array<PairedEndInfo>(blockSize));
-		optFields.push_back(Array<OptionalField>(blockSize));
+		records.push_back(CircularArray<Record>(blockSize));
+		editOps.push_back(CircularArray<EditOperation>(blockSize));
+		pairedEndInfos.push_back(CircularArray<PairedEndInfo>(blockSize));
+		optFields.push_back(CircularArray<OptionalField>(blockSize));
+		recordMemory.push_back(CircularArray<size_t>(blockSize));
 	}
-	int64_t total = 0;
-	int64_t blockCount = 0;
-	int64_t totalMatchedMates = 0;
-
-	Array<uint8_t> outputBuffer[8];
-	Array<uint8_t> idxBuffer[8];
-	for (int i = 0; i < 8; i++) {
-		outputBuffer[i].set_extend(MB);
-		idxBuffer[i].set_extend(MB);
+	stagedMemory.resize(parsers.size(), 0);
+	atomic<int64_t> total(0);
+	atomic<int64_t> blockCount(0);
+	atomic<int64_t> totalMatchedMates(0);
+
+	// Pipeline: parsing thread reads, parses and fixes blocks, while the
+	// compression stage compresses the fields of the previous block and the 
+	// output stage writes the blocks (in the order of parsing) to the file and index.
+	// By default, one parsing thread (this one) walks over the files in round-robin order.
+	// With optParallelFiles, each file gets its own parsing thread and compression stage (lane);
+	// the output stage then takes one block from each lane in turn, so that the output 
+	// does not depend on the thread timings.
+	// Blocks are queued in slices (see below), so the queues hold the slices of whole blocks.
+	int lanes = optParallelFiles ? parsers.size() : 1;
+	size_t slicesPerBlock = optSlice ? (blockSize + optSlice - 1) / optSlice : 1;
+	vector<shared_ptr<BoundedQueue<shared_ptr<Block>>>> compressQueue, outputQueue;
+	for (int l = 0; l < lanes; l++) {
+		compressQueue.push_back(make_shared<BoundedQueue<shared_ptr<Block>>>((InFlightBlocks - 1) * slicesPerBlock));
+		outputQueue.push_back(make_shared<BoundedQueue<shared_ptr<Block>>>((InFlightBlocks - 1) * slicesPerBlock));
 	}
-	vector<thread> threads(optThreads);
-
-	for (int fileAliveCount = 0; fileAliveCount < parsers.size();) { 
-		LOGN("\r");
-		for (int16_t f = 0; f < parsers.size(); f++) {
-			if (!parsers[f]->hasNext()) {
-				fileAliveCount++;
-				continue;
+	vector<shared_ptr<Block>> freeBlocks;
+	mutex freeBlocksMutex;
+	exception_ptr stageError = nullptr;
+	atomic<bool> failed(false);
+	auto stageFailed = [&](exception_ptr e) {
+		unique_lock<mutex> lock(freeBlocksMutex);
+		if (!stageError) 
+			stageError = e;
+		failed = true;
+		for (int l = 0; l < lanes; l++) {
+			compressQueue[l]->close();
+			outputQueue[l]->close();
+		}
+	};
+	vector<thread> compressStages, parseStages;
+	for (int l = 0; l < lanes; l++) compressStages.push_back(thread([&, l]() {
+		ZAMAN_THREAD_ROOT("Compress_Compress_");
+		shared_ptr<Block> b;
+		try {
+			while (compressQueue[l]->pop(b)) {
+				compressBlock(*b);
+				if (!outputQueue[l]->push(b))
+					break;
 			}
-
-		ZAMAN_START_P(Seek);
-			char op = 0;
-			string chr = parsers[f]->head();
-			while (sequence[f]->getChromosome() != parsers[f]->head()) 
-				sequence[f]->scanChromosome(parsers[f]->head(), samComment[f]), op = 1, prevLoc[f] = 0;
-		ZAMAN_END_P(Seek);
-
-		ZAMAN_START_P(Parse);
-			ZAMAN_START_P(GetReads);
-			size_t blockOffset = currentSize[f];
-			size_t blockByteSize = 0, blockReadByteSize = 0;
-			for (; currentSize[f] < currentBlockSize[f] && parsers[f]->hasNext() && parsers[f]->head() == sequence[f]->getChromosome() && blockReadByteSize < 200 * blockSize; currentSize[f]++) {
-				records[f].add();
-				pairedEndInfos[f].add();
-				optFields[f].add();
-				editOps[f].add();
-				records[f][records[f].size() - 1] = std::move(parsers[f]->next());
-				const Record &rc = records[f][records[f].size() - 1];
-				blockByteSize += const_cast<Record&>(rc).getLineLength();
-				blockReadByteSize += rc.getSequenceSize();
-				
-				size_t loc = rc.getLocation();
-				if (loc == (size_t)-1) 
-					loc = 0;
-				if (loc < prevLoc[f]) {
-					throw DZSortedException("%s is not sorted. Please sort it with 'dz --sort' before compressing it", parsers[f]->fileName().c_str());
+		} catch (...) {
+			stageFailed(current_exception());
+			try { // do not leave the parsing thread waiting
+				b->sequenceDone.set_exception(current_exception());
+			} catch (...) {}
+		}
+		outputQueue[l]->close();
+		// Blocks left behind will never be compressed; dropping them
+		// breaks their promises and wakes up the parsing thread
+		compressQueue[l]->close();
+		while (compressQueue[l]->pop(b))
+			b.reset();
+		ZAMAN_THREAD_JOIN();
+	}));
+	thread outputStage([&]() {
+		ZAMAN_THREAD_ROOT("Compress_");
+		try {
+			shared_ptr<Block> b;
+			vector<int> active;
+			for (int l = 0; l < lanes; l++)
+				active.push_back(l);
+			for (size_t i = 0; active.size(); ) {
+				if (!outputQueue[active[i]]->pop(b)) { // lane is done
+					active.erase(active.begin() + i);
+					if (i == active.size())
+						i = 0;
+					continue;
 				}
-				prevLoc[f] = loc;
-				lastStart[f] = loc;
-				ZAMAN_START_P(Stats);
-				stats[f].addRecord(rc.getMappingFlag());
-				ZAMAN_END_P(Stats);
-
-				parsers[f]->readNext();
-			}
-			ZAMAN_END_P(GetReads);	
-			//LOG("block size %'lu %'lu", blockByteSize, blockReadByteSize);
-			//LOG("Memory after reading: %'lu", currentMemUsage(f));
-	
-			ZAMAN_START_P(ParseRecords);
-			assert(records[f].size() == currentSize[f]);
-			size_t threadSz = (currentSize[f] - blockOffset) / optThreads + 1;
-			mutex m;
-			unordered_map<int32_t, map<string, int>> optLibrary;
-			for (int i = 0; i < optThreads; i++)
-				threads[i] = thread([&](int ti, size_t start, size_t end) {
-						ZAMAN_START(Thread);
-						unordered_map<int32_t, map<string, int>> lib;
-						this->parser(f, start, end, lib);
-						ZAMAN_END(Thread);
-
-						ZAMAN_START(Lock);
-						unique_lock<mutex> u(m);
-						for (auto &l: lib) 
-							optLibrary[l.first].insert(l.second.begin(), l.second.end());
-						ZAMAN_END(Lock);
-
-						ZAMAN_THREAD_JOIN();
-					}, 
-					i, 
-					blockOffset + threadSz * i, 
-					blockOffset + min(size_t(currentSize[f] - blockOffset), (i + 1) * threadSz)
-				);
-			for (int i = 0; i < optThreads; i++)
-				threads[i].join();
-			for (auto &kv: optLibrary) {
-				int p = 0;
-				for (auto &l: kv.second) {
-					l.second = p++;
+				outputBlock(*b);
+				for (size_t r = 0; r < b->records.size(); r++)
+					b->records[r].detach();
+				b->optLibrary.clear();
+				b->optFieldBuffers.resize(0);
+				b->sequenceDone = promise<void>();
+				{
+					unique_lock<mutex> lock(freeBlocksMutex);
+					freeBlocks.push_back(b);
 				}
+				b.reset();
+				i = (i + 1) % active.size();
 			}
-			ZAMAN_END_P(ParseRecords);
+		} catch (...) {
+			stageFailed(current_exception());
+		}
+		ZAMAN_THREAD_JOIN();
+	});
+	// With optMaxMemory, blocks are closed early so that the records of all blocks that may be in memory
+	// at the same time (staged, queued, compressed and written; per lane) and the loaded references stay
+	// within the budget. Blocks still hold up to blockSize records, so large budgets keep the usual blocks.
+	// If a block cannot be fixed within its share (e.g. very deep coverage), the share grows until it can
+	int blocksInMemory = 2 * InFlightBlocks + 1;
+	vector<size_t> extraMemory(parsers.size(), 0);
+	auto memoryLimit = [&](int16_t f) {
+		if (!optMaxMemory)
+			return (size_t)-1;
+		// Lanes are parsed concurrently, so each of them gets its own part of the budget
+		size_t budget = optMaxMemory / lanes, reference = 0;
+		for (int16_t i = 0; i < parsers.size(); i++) 
+			if (lanes == 1 || i == f)
+				reference += sequence[i]->currentMemoryUsage();
+		size_t share = budget > reference ? (budget - reference) / blocksInMemory : 0;
+		return max(share, budget / blocksInMemory / 16) + extraMemory[f];
+	};
+
+	// Fixed reference of a file is shared with the compression stage until its block is done
+	vector<future<void>> sequenceDone(parsers.size());
+	auto waitSequence = [&](int16_t f) {
+		if (sequenceDone[f].valid()) 
+			sequenceDone[f].get();
+	};
+
+	// Stop the stages even if parsing throws
+	auto stopStages = [&]() {
+		for (auto &t: parseStages) if (t.joinable()) 
+			t.join();
+		for (int l = 0; l < lanes; l++) 
+			compressQueue[l]->close();
+		for (auto &t: compressStages) if (t.joinable()) 
+			t.join();
+		if (outputStage.joinable()) 
+			outputStage.join();
+	};
+	struct StageGuard { 
+		function<void(void)> stop; 
+		~StageGuard() { stop(); } 
+	} stageGuard { stopStages };
+
+	// Parses, fixes and queues the next block of the file f
+	auto parseBlock = [&](int16_t f, BoundedQueue<shared_ptr<Block>> &queue) {
+	ZAMAN_START_P(Seek);
+		char op = 0;
+		string chr = parsers[f]->head();
+		if (sequence[f]->getChromosome() != chr)
+			waitSequence(f);
+		while (sequence[f]->getChromosome() != parsers[f]->head()) 
+			sequence[f]->scanChromosome(parsers[f]->head(), samComment[f]), op = 1, prevLoc[f] = 0;
+		if (op) // sorted files follow the order of the header
+			sequence[f]->getReference().prefetch(samComment[f].nextChromosome(parsers[f]->head()));
+	ZAMAN_END_P(Seek);
+
+	ZAMAN_START_P(Parse);
+		ZAMAN_START_P(GetReads);
+		size_t blockOffset = currentSize[f];
+		size_t blockByteSize = 0, blockReadByteSize = 0;
+		size_t memLimit = memoryLimit(f);
+		for (; currentSize[f] < currentBlockSize[f] && parsers[f]->hasNext() && parsers[f]->head() == sequence[f]->getChromosome() && blockReadByteSize < 200 * blockSize && stagedMemory[f] < memLimit; currentSize[f]++) {
+			records[f].add();
+			pairedEndInfos[f].add();
+			optFields[f].add();
+			editOps[f].add();
+			parsers[f]->next(records[f][records[f].size() - 1]);
+			const Record &rc = records[f][records[f].size() - 1];
+			blockByteSize += rc.getLineLength();
+			blockReadByteSize += rc.getSequenceSize();
+			recordMemory[f].add(recordMemUsage(rc));
+			stagedMemory[f] += recordMemory[f][recordMemory[f].size() - 1];
 			
-			ZAMAN_START_P(Load);
-			quality[f]->calculateOffset();
-			sequence[f]->getReference().loadIntoBuffer(sequence[f]->getBoundary());
-			ZAMAN_END_P(Load);
-
-			ZAMAN_START_P(Parse2);
-			threadSz = (currentSize[f] - blockOffset) / optThreads + 1;
-			for (int i = 0; i < optThreads; i++) 
-				threads[i] = thread([&](int ti, size_t start, size_t end) {
-						ZAMAN_START(Thread);
-						for (size_t i = start; i < end; i++) {
-							Record &rc = records[f][i];
-							editOps[f][i].calculateTags(sequence[f]->getReference());
-							optFields[f][i].parse((char*)rc.getOptional(), editOps[f][i], optLibrary);
-							quality[f]->offsetRecord(rc);
-						}
-						ZAMAN_END(Thread);
-						ZAMAN_THREAD_JOIN();
-					}, 
-					i, 
-					blockOffset + threadSz * i, 
-					blockOffset + min(size_t(currentSize[f] - blockOffset), (i + 1) * threadSz)
-				);
-			for (int i = 0; i < optThreads; i++)
-				threads[i].join();
-			//LOG("Memory after calculating: %'lu", currentMemUsage(f));
-			ZAMAN_END_P(Parse2);
-
-			total += currentSize[f] - blockOffset;
-			LOGN("\t%5.1lf%% [Chr %-10s Block %6zd]",
-				(100.0 * parsers[f]->fpos()) / parsers[f]->fsize(), 
-				sequence[f]->getChromosome().substr(0, 10).c_str(), 
-				blockCount + 1);
-		ZAMAN_END_P(Parse);
-
-		ZAMAN_START_P(Fix);
-			size_t 
-				currentBlockCount, 
-				currentBlockFirstLoc, 
-				currentBlockLastLoc, 
-				currentBlockLastEndLoc,
-				fixedStartPos, 
-				fixedEndPos,
-				zpos;
-
-			size_t fixingEnd = lastStart[f] - 1;
-			if (!parsers[f]->hasNext() 
-				|| parsers[f]->head() != sequence[f]->getChromosome() 
-				|| parsers[f]->head() == "*") 
-			{
-				fixingEnd = (size_t)-1;
+			size_t loc = rc.getLocation();
+			if (loc == (size_t)-1) 
+				loc = 0;
+			if (loc < prevLoc[f]) {
+				throw DZSortedException("%s is not sorted. Please sort it with 'dz --sort' before compressing it", parsers[f]->fileName().c_str());
 			}
+			prevLoc[f] = loc;
+			lastStart[f] = loc;
+			ZAMAN_START_P(Stats);
+			stats[f].addRecord(rc.getMappingFlag());
+			ZAMAN_END_P(Stats);
 
-			currentBlockCount = sequence[f]->applyFixes(
-				fixingEnd, records[f], editOps[f],
-				currentBlockFirstLoc, currentBlockLastLoc, currentBlockLastEndLoc, fixedStartPos, fixedEndPos
-			);
-			if (currentBlockCount == 0) {
-				currentBlockSize[f] += blockSize;
-				LOG("Retrying...");
-				ZAMAN_END_P(Fix);
-				continue;
+			parsers[f]->readNext();
+		}
+		ZAMAN_END_P(GetReads);	
+		//LOG("block size %'lu %'lu", blockByteSize, blockReadByteSize);
+		DEBUG("Memory after reading: %'lu", currentMemUsage(f));
+
+		ZAMAN_START_P(ParseRecords);
+		assert(records[f].size() == currentSize[f]);
+		size_t threadSz = (currentSize[f] - blockOffset) / optThreads + 1;
+		mutex m;
+		unordered_map<int32_t, map<string, int>> optLibrary;
+		TaskGroup tasks;
+		for (int i = 0; i < optThreads; i++) {
+			size_t start = blockOffset + threadSz * i;
+			size_t end = blockOffset + min(size_t(currentSize[f] - blockOffset), (i + 1) * threadSz);
+			tasks.run([&, start, end]() {
+				ZAMAN_START(Thread);
+				unordered_map<int32_t, map<string, int>> lib;
+				this->parser(f, start, end, lib);
+				ZAMAN_END(Thread);
+
+				ZAMAN_START(Lock);
+				unique_lock<mutex> u(m);
+				for (auto &l: lib) 
+					optLibrary[l.first].insert(l.second.begin(), l.second.end());
+				ZAMAN_END(Lock);
+			}, i);
+		}
+		tasks.wait();
+		for (auto &kv: optLibrary) {
+			int p = 0;
+			for (auto &l: kv.second) {
+				l.second = p++;
 			}
-			currentSize[f] -= currentBlockCount;
-		ZAMAN_END_P(Fix);
-			//LOG("Memory after fixing: %'lu", currentMemUsage(f));
-
-		ZAMAN_START_P(CheckMate);
-			int matchedMates = 0;
-			unordered_map<string, int> readNames; 
-			for (size_t i = 0; i < currentBlockCount; i++) {
-				string rn = records[f][i].getReadName();
-				auto it = readNames.find(rn);
-				if (it == readNames.end()) {
+		}
+		ZAMAN_END_P(ParseRecords);
+		
+		ZAMAN_START_P(Load);
+		quality[f]->calculateOffset();
+		sequence[f]->getReference().loadIntoBuffer(sequence[f]->getBoundary());
+		ZAMAN_END_P(Load);
+
+		ZAMAN_START_P(Parse2);
+		threadSz = (currentSize[f] - blockOffset) / optThreads + 1;
+		for (int i = 0; i < optThreads; i++) {
+			size_t start = blockOffset + threadSz * i;
+			size_t end = blockOffset + min(size_t(currentSize[f] - blockOffset), (i + 1) * threadSz);
+			tasks.run([&, start, end]() {
+				ZAMAN_START(Thread);
+				for (size_t i = start; i < end; i++) {
+					editOps[f][i].calculateTags(sequence[f]->getReference());
+					optFields[f][i].parse(editOps[f][i], optLibrary);
+				}
+				ZAMAN_END(Thread);
+			}, i);
+		}
+		tasks.wait();
+		//LOG("Memory after calculating: %'lu", currentMemUsage(f));
+		ZAMAN_END_P(Parse2);
+
+		total += currentSize[f] - blockOffset;
+		LOGN("\t%5.1lf%% [Chr %-10s Block %6zd]",
+			(100.0 * parsers[f]->fpos()) / parsers[f]->fsize(), 
+			sequence[f]->getChromosome().substr(0, 10).c_str(), 
+			blockCount + 1);
+	ZAMAN_END_P(Parse);
+
+	ZAMAN_START_P(Fix);
+		size_t 
+			currentBlockCount, 
+			currentBlockFirstLoc, 
+			currentBlockLastLoc, 
+			currentBlockLastEndLoc,
+			fixedStartPos, 
+			fixedEndPos;
+
+		size_t fixingEnd = lastStart[f] - 1;
+		if (!parsers[f]->hasNext() 
+			|| parsers[f]->head() != sequence[f]->getChromosome() 
+			|| parsers[f]->head() == "*") 
+		{
+			fixingEnd = (size_t)-1;
+		}
+
+		waitSequence(f);
+		currentBlockCount = sequence[f]->applyFixes(
+			fixingEnd, records[f], editOps[f],
+			currentBlockFirstLoc, currentBlockLastLoc, currentBlockLastEndLoc, fixedStartPos, fixedEndPos
+		);
+		if (currentBlockCount == 0) {
+			currentBlockSize[f] += blockSize;
+			if (stagedMemory[f] >= memLimit) {
+				extraMemory[f] = memLimit; // doubles the share
+				LOG("Block of %'zd records does not fit into %'lu bytes", currentSize[f], memLimit);
+			}
+			LOG("Retrying...");
+			ZAMAN_END_P(Fix);
+			return;
+		}
+		extraMemory[f] = 0;
+		currentSize[f] -= currentBlockCount;
+	ZAMAN_END_P(Fix);
+
+		// Block is written in slices of about optSlice records. Each slice is a block of its own 
+		// in the file and in the index, with its positions and stream states, so that range queries 
+		// start decoding at the slice of the region. Mates are paired only within a slice, and 
+		// records at the same position stay in the same slice (index is keyed by the first position)
+		vector<size_t> slices { 0 };
+		size_t sliceCount = optSlice ? (currentBlockCount + optSlice - 1) / optSlice : 1;
+		for (size_t k = 1; k < sliceCount; k++) {
+			size_t i = max(slices.back() + 1, k * currentBlockCount / sliceCount);
+			while (i < currentBlockCount && editOps[f][i].start == editOps[f][i - 1].start)
+				i++;
+			if (i >= currentBlockCount)
+				break;
+			slices.push_back(i);
+		}
+		slices.push_back(currentBlockCount);
+
+	ZAMAN_START_P(CheckMate);
+		int matchedMates = 0;
+		unordered_map<string, int> readNames; 
+		for (size_t i = 0, slice = 0; i < currentBlockCount; i++) {
+			if (i == slices[slice + 1])
+				slice++;
+			string rn(records[f][i].getReadName(), records[f][i].getReadNameSize());
+			auto it = readNames.find(rn);
+			if (it == readNames.end() || it->second < slices[slice]) {
+				readNames[rn] = i;
+			} else { // Check can we calculate back the necessary values
+				EditOperation &eo = editOps[f][i];
+				PairedEndInfo &pe = pairedEndInfos[f][i];
+				EditOperation &peo = editOps[f][it->second];
+				PairedEndInfo &ppe = pairedEndInfos[f][it->second];
+			//	LOG("%s %s %s", rn.c_str(), eo.op.c_str(), peo.op.c_str());
+			//	LOG("%d %d %d", pe.tlen, ppe.tlen, eo.start + (peo.end - peo.start) - peo.start);
+			//	LOG("%d %d (%d) %d %d (%d)", eo.start, eo.end, pe.pos, peo.start, peo.end, ppe.pos);
+				uint32_t off;
+				if (pe.tlen == -ppe.tlen // TLEN can be calculated
+					&& eo.start == ppe.pos
+					&& pe.pos == peo.start // POS can be calculated
+					&& (ppe.chr == "=" || chr == ppe.chr) // CHR can be calculated as well
+					&& ppe.tlen >= 0 
+					&& (off = eo.start + (peo.end - peo.start) - peo.start - ppe.tlen) <= 1)
+				{
+					ppe.bit = PairedEndInfo::Bits::LOOK_AHEAD + off; 
+					pe.bit = PairedEndInfo::Bits::LOOK_BACK;
+					pe.tlen = i - it->second;
+				//	LOG("%d...", pe.tlen);
+					matchedMates++;
+				} else { // Replace with current read
 					readNames[rn] = i;
-				} else { // Check can we calculate back the necessary values
-					EditOperation &eo = editOps[f][i];
-					PairedEndInfo &pe = pairedEndInfos[f][i];
-					EditOperation &peo = editOps[f][it->second];
-					PairedEndInfo &ppe = pairedEndInfos[f][it->second];
-				//	LOG("%s %s %s", rn.c_str(), eo.op.c_str(), peo.op.c_str());
-				//	LOG("%d %d %d", pe.tlen, ppe.tlen, eo.start + (peo.end - peo.start) - peo.start);
-				//	LOG("%d %d (%d) %d %d (%d)", eo.start, eo.end, pe.pos, peo.start, peo.end, ppe.pos);
-					uint32_t off;
-					if (pe.tlen == -ppe.tlen // TLEN can be calculated
-						&& eo.start == ppe.pos
-						&& pe.pos == peo.start // POS can be calculated
-						&& (ppe.chr == "=" || chr == ppe.chr) // CHR can be calculated as well
-						&& ppe.tlen >= 0 
-						&& (off = eo.start + (peo.end - peo.start) - peo.start - ppe.tlen) <= 1)
-					{
-						ppe.bit = PairedEndInfo::Bits::LOOK_AHEAD + off; 
-						pe.bit = PairedEndInfo::Bits::LOOK_BACK;
-						pe.tlen = i - it->second;
-					//	LOG("%d...", pe.tlen);
-						matchedMates++;
-					} else { // Replace with current read
-						readNames[rn] = i;
-					}
 				}
 			}
-			totalMatchedMates += matchedMates;
-		ZAMAN_END_P(CheckMate);
-
-		ZAMAN_START_P(WriteIndex);
-			zpos = ftell(outputFile);
-
-			fwrite(&op, sizeof(char), 1, outputFile);
-			if (op) 
-				fwrite(chr.c_str(), chr.size() + 1, 1, outputFile);
-
-			gzwrite(indexFile, &f, sizeof(int16_t));
-			gzwrite(indexFile, &zpos, sizeof(size_t));		
-			gzwrite(indexFile, &currentBlockCount, sizeof(size_t));
-			gzwrite(indexFile, sequence[f]->getChromosome().c_str(), sequence[f]->getChromosome().size() + 1);
-			gzwrite(indexFile, &currentBlockFirstLoc, sizeof(size_t));
-			gzwrite(indexFile, &currentBlockLastLoc, sizeof(size_t));
-			gzwrite(indexFile, &fixedStartPos, sizeof(size_t));
-			gzwrite(indexFile, &fixedEndPos, sizeof(size_t));
-		ZAMAN_END_P(WriteIndex);
-
-		ZAMAN_START_P(Compress);
-			ctpl::thread_pool threadPool(optThreads);
-			threadPool.push([&](int t, int ti) {
-				compressBlock(f, outputBuffer[ti], idxBuffer[ti], currentBlockCount, 
-					optField[f], optFields[f], optLibrary);
-				ZAMAN_THREAD_JOIN();
-			//	LOG("of done");
-			}, 7);
-			threadPool.push([&](int t, int ti) {
-				compressBlock(f, outputBuffer[ti], idxBuffer[ti], currentBlockCount, sequence[f]);
-				ZAMAN_THREAD_JOIN();
-			//	LOG("seq done");
-			}, 0);
-			threadPool.push([&](int t, int ti) {
-			 	compressBlock(f, outputBuffer[ti], idxBuffer[ti], currentBlockCount, editOp[f], editOps[f]);
-			 	ZAMAN_THREAD_JOIN();
-			// 	LOG("eo done");
-			}, 1);
-			threadPool.push([&](int t, int ti) {
-				compressBlock(f, outputBuffer[ti], idxBuffer[ti], currentBlockCount, readName[f], pairedEndInfos[f]);
-				ZAMAN_THREAD_JOIN();
-			//	LOG("rn done");
-			}, 2);
-			threadPool.push([&](int t, int ti) {
-				compressBlock(f, outputBuffer[ti], idxBuffer[ti], currentBlockCount, mapFlag[f]);
-				ZAMAN_THREAD_JOIN();
-			//	LOG("mf done");
-			}, 3);
-			threadPool.push([&](int t, int ti) {
-				compressBlock(f, outputBuffer[ti], idxBuffer[ti], currentBlockCount, mapQual[f]);
-				ZAMAN_THREAD_JOIN();
-			//	LOG("mq done");
-			}, 4);
-			threadPool.push([&](int t, int ti) {
-				compressBlock(f, outputBuffer[ti], idxBuffer[ti], currentBlockCount, quality[f]);
-				ZAMAN_THREAD_JOIN();
-			//	LOG("qual done");
-			}, 5);
-			threadPool.push([&](int t, int ti) {
-				compressBlock(f, outputBuffer[ti], idxBuffer[ti], currentBlockCount, pairedEnd[f], pairedEndInfos[f]);
-				ZAMAN_THREAD_JOIN();
-			//	LOG("pe done");
-			}, 6);
-			Array<Array<uint8_t>> outputBuffers;
-			optField[f]->compressThreads(outputBuffers, threadPool);
-			threadPool.stop(true);
-			records[f].removeFirstK(currentBlockCount);
-			editOps[f].removeFirstK(currentBlockCount);
-			pairedEndInfos[f].removeFirstK(currentBlockCount);
-			optFields[f].removeFirstK(currentBlockCount);
-			// LOG("Memory after compressing: %'lu", currentMemUsage(f));
-		ZAMAN_END_P(Compress);
-
-		ZAMAN_START_P(Output);
-			for (int ti = 0; ti < outputBuffers.size(); ti++)
-				outputBuffer[7].add(outputBuffers[ti].data(), outputBuffers[ti].size());
-			for (int ti = 0; ti < 8; ti++)
-				outputBlock(outputBuffer[ti], idxBuffer[ti]);
-		ZAMAN_END_P(Output);
-
-			blockCount++;
 		}
+		totalMatchedMates += matchedMates;
+	ZAMAN_END_P(CheckMate);
+
+	ZAMAN_START_P(Queue);
+		for (size_t slice = 0; slice + 1 < slices.size(); slice++) {
+			size_t count = slices[slice + 1] - slices[slice];
+			bool first = !slice, last = slice + 2 == slices.size();
+			shared_ptr<Block> b;
+			{
+				unique_lock<mutex> lock(freeBlocksMutex);
+				if (freeBlocks.size()) {
+					b = freeBlocks.back();
+					freeBlocks.pop_back();
+				}
+			}
+			if (!b) 
+				b = make_shared<Block>();
+			b->f = f;
+			b->op = first ? op : 0;
+			b->chr = sequence[f]->getChromosome();
+			b->count = count;
+			b->firstLoc = first ? currentBlockFirstLoc : editOps[f][0].start;
+			b->lastLoc = last ? currentBlockLastLoc : editOps[f][count - 1].start;
+			// Fixed reference of a slice starts at its first record
+			b->fixedStart = first ? fixedStartPos : editOps[f][0].start;
+			b->fixedEnd = fixedEndPos;
+			b->qualityOffset = quality[f]->getOffset();
+			if (last)
+				swap(b->optLibrary, optLibrary);
+			else 
+				b->optLibrary = optLibrary;
+			takeFirstK(records[f], b->records, count);
+			takeFirstK(editOps[f], b->editOps, count);
+			takeFirstK(pairedEndInfos[f], b->pairedEndInfos, count);
+			takeFirstK(optFields[f], b->optFields, count);
+			sequenceDone[f] = b->sequenceDone.get_future();
+			queue.push(b);
+		}
+		quality[f]->resetOffset();
+		for (size_t i = 0; i < currentBlockCount; i++)
+			stagedMemory[f] -= recordMemory[f][i];
+		recordMemory[f].remove_first_n(currentBlockCount);
+	ZAMAN_END_P(Queue);
+
+		blockCount++;
+	};
+
+	if (!optParallelFiles) {
+		for (bool alive = true; alive && !failed; ) { 
+			alive = false;
+			LOGN("\r");
+			for (int16_t f = 0; f < parsers.size() && !failed; f++) {
+				if (!parsers[f]->hasNext()) 
+					continue;
+				alive = true;
+				parseBlock(f, *compressQueue[0]);
+			}
+		}
+	} else {
+		for (int16_t f = 0; f < parsers.size(); f++) parseStages.push_back(thread([&, f]() {
+			ZAMAN_THREAD_ROOT("Compress_");
+			try {
+				while (!failed && parsers[f]->hasNext()) {
+					LOGN("\r");
+					parseBlock(f, *compressQueue[f]);
+				}
+			} catch (...) {
+				stageFailed(current_exception());
+			}
+			compressQueue[f]->close();
+			ZAMAN_THREAD_JOIN();
+		}));
 	}
-	LOGN("\nWritten %'zd lines\n", total);
+	stopStages();
+	if (stageError)
+		rethrow_exception(stageError);
+	LOGN("\nWritten %'zd lines\n", total.load());
 	fflush(outputFile);
 	
 	ZAMAN_START_P(WriteIndex);
 	size_t posStats = ftell(outputFile);
 	fwrite("DZSTATS", 1, 7, outputFile);
+	Array<uint8_t> statsBuffer(0, MB);
 	for (int i = 0; i < stats.size(); i++) {
-		stats[i].writeStats(outputBuffer[0], sequence[i].get());
-		size_t sz = outputBuffer->size();
+		stats[i].writeStats(statsBuffer, sequence[i].get());
+		size_t sz = statsBuffer.size();
 		fwrite(&sz, 8, 1, outputFile);
-		fwrite(outputBuffer->data(), 1, outputBuffer->size(), outputFile);
+		fwrite(statsBuffer.data(), 1, statsBuffer.size(), outputFile);
 	}
 	
-	int gzst = gzclose(indexFile);
-	fwrite("DZIDX", 1, 5, outputFile);
-	char *buffer = (char*)malloc(MB);
-	fseek(indexTmp, 0, SEEK_SET);
-	while (size_t sz = fread(buffer, 1, MB, indexTmp))
-		fwrite(buffer, 1, sz, outputFile);
-	free(buffer);
-	fclose(indexTmp);
+	BlockIndex::write(outputFile, indexStates, indexEntries, indexChrNames);
+	fclose(indexStates);
 	fwrite(&posStats, sizeof(size_t), 1, outputFile);
 	ZAMAN_END_P(WriteIndex);
 	
-	LOG("Paired %'lld out of %'lld reads", totalMatchedMates, total);
+	LOG("Paired %'lld out of %'lld reads", totalMatchedMates.load(), total.load());
 	#define VERBOSE(y,x) \
 		LOG("%-12s  %'20lu", y, x->compressedSize()); x->printDetails();
 	for (int f = 0; f < parsers.size(); f++) {
@@ -1,8 +1,11 @@
 #ifndef Compress_H
 #define Compress_H
 
+#include <future>
 #include "Common.h"
+#include "BoundedQueue.h"
 #include "Stats.h"
+#include "BlockIndex.h"
 #include "Parsers/BAMParser.h"
 #include "Parsers/SAMParser.h"
 #include "Fields/Sequence.h"
@@ -15,6 +18,10 @@
 #include "Fields/OptionalField.h"
 #include "Fields/SAMComment.h"
 
+extern bool optParallelFiles;
+extern size_t optMaxMemory;
+extern size_t optSlice;
+
 class FileCompressor {
 	vector<shared_ptr<Parser>> parsers;
 	vector<SAMComment> samComment;
@@ -28,11 +35,42 @@ class FileCompressor {
 	vector<shared_ptr<OptionalFieldCompressor>> optField;
 
 	FILE *outputFile;
-	FILE *indexTmp;
-	gzFile indexFile;
+	// Index entries in the file order; the stream states after each block are gzipped 
+	// into indexStates and referenced by the next block of the same file
+	FILE *indexStates;
+	vector<BlockIndex::Entry> indexEntries;
+	vector<BlockIndex::Entry> indexLastState;
+	map<pair<int, string>, uint32_t> indexChromosomes;
+	vector<pair<int, string>> indexChrNames;
 
 	size_t blockSize;
 
+	// Parsed and fixed block which waits for field compression and output
+	struct Block {
+		int16_t f;
+		char op;
+		std::string chr;
+		size_t count, firstLoc, lastLoc, fixedStart, fixedEnd;
+		char qualityOffset;
+
+		Array<Record> records;
+		Array<EditOperation> editOps;
+		Array<PairedEndInfo> pairedEndInfos;
+		Array<OptionalField> optFields;
+		std::unordered_map<int32_t, std::map<std::string, int>> optLibrary;
+
+		Array<uint8_t> outputBuffer[8];
+		Array<uint8_t> idxBuffer[8];
+		Array<Array<uint8_t>> optFieldBuffers;
+
+		// Set once the sequence and edit operation streams are done with the fixed reference,
+		// so that the next block of the same file may scan or fix it again
+		std::promise<void> sequenceDone;
+	};
+	// Number of blocks that may be processed by a pipeline stage or wait for it
+	// (per file with optParallelFiles); each of them keeps its records in memory
+	static const int InFlightBlocks = 2;
+
 public:
 	FileCompressor (const std::string &outFile, const std::vector<std::string> &samFiles, const std::string &genomeFile, int blockSize);
 	~FileCompressor (void);
@@ -51,8 +89,10 @@ private:
 	void outputBlock (Compressor *c, Array<uint8_t> &out, size_t count);
 
 	template<typename Compressor, typename... ExtraParams>
-	void compressBlock (int f, Array<uint8_t>& out, Array<uint8_t>& idxOut, size_t k, shared_ptr<Compressor> c, ExtraParams&... params);
-	void outputBlock (Array<uint8_t> &out, Array<uint8_t> &idxOut);
+	void compressBlock (Block &b, Array<uint8_t>& out, Array<uint8_t>& idxOut, shared_ptr<Compressor> c, ExtraParams&... params);
+	void compressBlock (Block &b);
+	void outputBlock (Array<uint8_t> &out);
+	void outputBlock (Block &b);
 
 public:
 	void compress (void);
@@ -60,13 +100,24 @@ public:
 private:
 	void parser(size_t f, size_t, size_t, std::unordered_map<int32_t, std::map<std::string, int>>&);
 	
-	vector<Array<Record>> records;
-	vector<Array<EditOperation>> editOps;
-	vector<Array<PairedEndInfo>> pairedEndInfos;
-	vector<Array<OptionalField>> optFields;
+	// Records parsed but not yet taken by a block; the ones past the fixing
+	// boundary stay in place for the next block
+	vector<CircularArray<Record>> records;
+	vector<CircularArray<EditOperation>> editOps;
+	vector<CircularArray<PairedEndInfo>> pairedEndInfos;
+	vector<CircularArray<OptionalField>> optFields;
+
+	// Estimated memory of each record above (with its edit operation, paired-end info
+	// and optional fields), and their sum: updated in constant time per record
+	vector<CircularArray<size_t>> recordMemory;
+	vector<size_t> stagedMemory;
 
 	std::mutex queueMutex;
 	size_t currentMemUsage(size_t f);
+	static size_t recordMemUsage(const Record &rc);
+
+	template<typename T>
+	static void takeFirstK (CircularArray<T> &from, Array<T> &to, size_t k);
 };
 
 #endif // Compress_H
@@ -1,12 +1,14 @@
 #include "Decompress.h"
 #include <thread>
+#include <climits>
+#include <sys/uio.h>
 using namespace std;
 
 void FileDecompressor::printStats (int filterFlag) 
 {
 	WARN("Index size: %'lu bytes", inFileSz - statPos);
-	WARN("Quality compression: %s", optQuality == 0 ? "rANS" : (optQuality == 1 ? "sam_comp" : "Order-2 AC"));
-	WARN("bzip compression: %s", optBzip ? "Yes" : "No");
+	WARN("Quality compression: %s", qualityMode == 0 ? "rANS" : (qualityMode == 1 ? "sam_comp" : "Order-2 AC"));
+	WARN("bzip compression: %s", bzip ? "Yes" : "No");
 	WARN("Number of files: %d", numFiles);
 	for (int f = 0; f < numFiles; f++) {
 		WARN("=== File %s ===", stats[f]->fileName.c_str());
@@ -43,11 +45,11 @@ void FileDecompressor::printStats (int filterFlag)
 		// blocks?
 		WARN("Block info: ");
 		int bid = 0;
-		for (auto &c: indices[f]) {
-			for (auto p: c.second) {
+		for (auto &c: index->fileChromosomes(f)) {
+			for (size_t i = c.second.first; i < c.second.second; i++) {
+				index_t p = (*index)[index->sortedBlock(i)];
 				WARN("  Block %4d: %s:%'lu-%'lu (patches %'lu-%'lu)",
-					++bid, c.first.c_str(), p.second.startPos, p.second.endPos,
-					p.second.fS, p.second.fE);
+					++bid, c.first.c_str(), p.startPos, p.endPos, p.fS, p.fE);
 			}
 		}
 	}
@@ -57,6 +59,8 @@ FileDecompressor::FileDecompressor (const string &inFilePath, const string &outF
 	blockSize(bs), genomeFile(genomeFile), outFile(outFile), finishedRange(false), isAPI(isAPI)
 {
 	initCache();
+	if (isAPI)
+		cache = make_shared<BlockCache>(size_t(CacheSize));
 
 	string name1 = inFilePath;
 	this->inFile = File::Open(name1.c_str(), "rb");
@@ -66,8 +70,8 @@ FileDecompressor::FileDecompressor (const string &inFilePath, const string &outF
 	inFileSz = inFile->size();
 
 	magic = inFile->readU32();
-	optQuality = inFile->readU8();
-	optBzip = inFile->readU8();
+	qualityMode = inFile->readU8();
+	bzip = inFile->readU8();
 	
 	numFiles = 1;
 	if ((magic & 0xff) >= 0x11) // DeeZ v1.1
@@ -93,34 +97,11 @@ FileDecompressor::FileDecompressor (const string &inFilePath, const string &outF
 		stats[f] = make_shared<Stats>(in, magic);
 	}
 
-	keymagic[5] = 0;
-	inFile->read(keymagic, 5);
-	if (strcmp(keymagic, "DZIDX"))
-		throw DZException("Index is corrupted ...%s", keymagic);
-
-	size_t idxToRead = inFileSz - inFile->tell() - sizeof(size_t);
-	FILE *tmp = tmpfile();
-	char *buffer = (char*)malloc(MB);
-
-	size_t sz;
-	while (idxToRead && (sz = inFile->read(buffer, min(uint64_t(MB), (uint64_t)idxToRead)))) {
-		fwrite(buffer, 1, sz, tmp);
-		idxToRead -= sz;
-	}
-	free(buffer);
-	
-	int idx = dup(fileno(tmp));
-	fseek(tmp, 0, SEEK_SET);
-	lseek(idx, 0, SEEK_SET); // needed for gzdopen
-	idxFile = gzdopen(idx, "rb");
-	if (idxFile == Z_NULL)
-		throw DZException("Cannot open the index");
-		
+	loadIndex(inFilePath);
 	inFile->seek(0);
 
 	getMagic();
 	getComment();
-	loadIndex();
 }
 
 FileDecompressor::~FileDecompressor (void) 
@@ -129,8 +110,6 @@ FileDecompressor::~FileDecompressor (void)
 		if (samFiles[f]) 
 			fclose(samFiles[f]);
 	}
-	if (idxFile) 
-		gzclose(idxFile);
 }
 
 void FileDecompressor::getMagic (void) 
@@ -142,23 +121,24 @@ void FileDecompressor::getMagic (void)
 	 	(magic >> 4) & 0xf,
 	 	magic & 0xf
 	);
-	optQuality = inFile->readU8();
-	optBzip = inFile->readU8();
-	if (optBzip) LOG("Using bzip decoding");
+	qualityMode = inFile->readU8();
+	bzip = inFile->readU8();
+	if (bzip) LOG("Using bzip decoding");
 
 	numFiles = 1;
 	if ((magic & 0xff) >= 0x11) // DeeZ v1.1
 		numFiles = inFile->readU16();
 
 	for (int f = 0; f < numFiles; f++) {
-		sequence.push_back(make_shared<SequenceDecompressor>(genomeFile, blockSize));
-		editOp.push_back(make_shared<EditOperationDecompressor>(blockSize, (*sequence.back())));
-		readName.push_back(make_shared<ReadNameDecompressor>(blockSize));
-		mapFlag.push_back(make_shared<MappingFlagDecompressor>(blockSize));
-		mapQual.push_back(make_shared<MappingQualityDecompressor>(blockSize));
-		pairedEnd.push_back(make_shared<PairedEndDecompressor>(blockSize));
-		optField.push_back(make_shared<OptionalFieldDecompressor>(blockSize));
-		quality.push_back(make_shared<QualityScoreDecompressor>(blockSize));
+		auto d = newFields();
+		sequence.push_back(d.sequence);
+		editOp.push_back(d.editOp);
+		readName.push_back(d.readName);
+		mapFlag.push_back(d.mapFlag);
+		mapQual.push_back(d.mapQual);
+		pairedEnd.push_back(d.pairedEnd);
+		optField.push_back(d.optField);
+		quality.push_back(d.quality);
 	}
 	fileNames.resize(numFiles);
 
@@ -177,7 +157,8 @@ void FileDecompressor::getMagic (void)
 
 			arcsz = 0;
 			for (int f = 0; f < fileNames.size(); f++) {
-				fileNames[f] = string((const char*)(arc.data()) + arcsz);
+				const char *name = (const char*)(arc.data()) + arcsz;
+				fileNames[f] = string(name, strnlen(name, arc.size() - arcsz));
 				arcsz += fileNames[f].size();
 			}
 		}
@@ -226,6 +207,18 @@ void FileDecompressor::readBlock (Array<uint8_t> &in)
 	if (sz) inFile->read(in.data(), sz);
 }
 
+void FileDecompressor::readBlock (size_t &pos, Array<uint8_t> &in) 
+{
+	uint64_t sz;
+	if (inFile->pread(&sz, sizeof(uint64_t), pos) != sizeof(uint64_t))
+		throw DZException("Cannot read the block at %'lu", pos);
+	pos += sizeof(uint64_t);
+	in.resize(sz);
+	if (sz && inFile->pread(in.data(), sz, pos) != sz)
+		throw DZException("Cannot read the block at %'lu", pos);
+	pos += sz;
+}
+
 void FileDecompressor::printRecord(const string &rname, int flag, 
 	const string &chr, const EditOperation &eo, int mqual, 
 	const string &qual, const string &optional, const PairedEndInfo &pe, 
@@ -233,94 +226,169 @@ void FileDecompressor::printRecord(const string &rname, int flag,
 {
 }
 
-size_t FileDecompressor::getBlock (int f, const string &chromosome, 
-	size_t start, size_t end, int filterFlag) 
+// Decoders of a file, with a reference of their own.
+// They are given the settings of the file (quality mode and bzip), so files can be opened at once
+FileDecompressor::BlockFields FileDecompressor::newFields (void)
 {
-	static string chr;
-	if (finishedRange) 
-		return 0;
-	if (chromosome != "")
-		chr = chromosome;
+	return newFields(make_shared<SequenceDecompressor>(genomeFile, blockSize, bzip));
+}
+
+FileDecompressor::BlockFields FileDecompressor::newFields (shared_ptr<SequenceDecompressor> sequence)
+{
+	BlockFields d;
+	d.sequence = sequence;
+	d.editOp = make_shared<EditOperationDecompressor>(blockSize, *sequence, bzip);
+	d.readName = make_shared<ReadNameDecompressor>(blockSize, bzip);
+	d.mapFlag = make_shared<MappingFlagDecompressor>(blockSize, bzip);
+	d.mapQual = make_shared<MappingQualityDecompressor>(blockSize, bzip);
+	d.pairedEnd = make_shared<PairedEndDecompressor>(blockSize, bzip);
+	d.optField = make_shared<OptionalFieldDecompressor>(blockSize, bzip);
+	d.quality = make_shared<QualityScoreDecompressor>(blockSize, qualityMode);
+	return d;
+}
+
+FileDecompressor::BlockFields FileDecompressor::fileFields (int f)
+{
+	return { sequence[f], editOp[f], readName[f], mapFlag[f], mapQual[f], quality[f], pairedEnd[f], optField[f] };
+}
+
+// Reads the chromosome header of the next block and moves the reference of the file f to it.
+// Returns false at the end of the blocks, or if the block is not on the requested chromosome
+bool FileDecompressor::readChromosome (int f, const string &chromosome, string &chr)
+{
+	// Blocks without chromosome continue the chromosome of their own file
+	chr = chromosome != "" ? chromosome : sequence[f]->getChromosome();
 
 	char chflag;
 	if (inFile->read(&chflag, 1) != 1)
-		return 0;
+		return false;
 	if (chflag > 1) // index!
-		return 0;
+		return false;
 	if (chflag) {
 		chr = "";
 		chflag = inFile->readU8();
 		while (chflag)
 			chr += chflag, chflag = inFile->readU8();
 		if (chromosome != "" && chr != chromosome)
-			return 0;
+			return false;
+	}
+	if (chr != sequence[f]->getChromosome()) {
+		while (chr != sequence[f]->getChromosome())
+			sequence[f]->scanChromosome(chr, samComment[f]);
+		if (chromosome == "") // blocks are in the order of the header
+			sequence[f]->getReference().prefetch(samComment[f].nextChromosome(chr));
 	}
-	while (chr != sequence[f]->getChromosome())
-		sequence[f]->scanChromosome(chr, samComment[f]);
+	return true;
+}
 
-	ZAMAN_START_P(Blocks);
-	Array<uint8_t> in[8];
+// Same as above, reading the block at pos without moving the input (see File::pread)
+// and moving the given reference instead of the one of the file
+bool FileDecompressor::readChromosome (SequenceDecompressor &sequence, int f, size_t &pos, 
+	const string &chromosome, string &chr)
+{
+	chr = chromosome != "" ? chromosome : sequence.getChromosome();
 
-	for (int ti = 0; ti < 8; ti++) {
-		readBlock(in[ti]);
+	char chflag;
+	if (inFile->pread(&chflag, 1, pos) != 1)
+		return false;
+	pos++;
+	if (chflag > 1) // index!
+		return false;
+	if (chflag) {
+		chr = "";
+		char buffer[256];
+		while (1) {
+			ssize_t sz = inFile->pread(buffer, sizeof(buffer), pos);
+			if (sz <= 0)
+				throw DZException("Cannot read the chromosome of the block");
+			size_t len = strnlen(buffer, sz);
+			chr.append(buffer, len);
+			pos += len;
+			if (len < sz) {
+				pos++;
+				break;
+			}
+		}
+		if (chromosome != "" && chr != chromosome)
+			return false;
 	}
+	while (chr != sequence.getChromosome())
+		sequence.scanChromosome(chr, samComment[f]);
+	return true;
+}
 
-	ctpl::thread_pool threadPool(optThreads);
-	threadPool.push([&](int t, Array<uint8_t> &buffer) {
-		optField[f]->importRecords(buffer.data(), buffer.size());
-		ZAMAN_THREAD_JOIN();
+// Streams of a block needed for the columns in optFields (bit i for the stream i).
+// Sequence and edit operations (locations) are always needed. Read names of mates are
+// restored through the paired-end bits, and paired-end data through the read names.
+// Quality models that adapt over blocks have to see every block when the blocks 
+// are decoded in order by the decompressors of their file
+int FileDecompressor::neededStreams (const Options &o, bool inOrder)
+{
+	int streams = 1 << 0 | 1 << 1;
+	if (o.fields & (QNAME | RNEXT | PNEXT | TLEN))
+		streams |= 1 << 2 | 1 << 6;
+	if ((o.fields & (FLAG | QUAL | RNEXT | PNEXT | TLEN)) || o.filterFlag)
+		streams |= 1 << 3;
+	if (o.fields & MAPQ)
+		streams |= 1 << 4;
+	if ((o.fields & QUAL) || (inOrder && quality[0]->adaptsOverBlocks()))
+		streams |= 1 << 5;
+	if (o.fields & OPT)
+		streams |= 1 << 7;
+	return streams;
+}
+
+void FileDecompressor::importFields (BlockFields &d, Array<uint8_t> *in, int streams)
+{
+	TaskGroup tasks;
+	if (streams & 1 << 7) tasks.run([&]() {
+		d.optField->importRecords(in[7].data(), in[7].size());
 		// LOG("opt done");
-	}, ref(in[7]));
-	threadPool.push([&](int t, Array<uint8_t> &buffer) {
-		sequence[f]->importRecords(buffer.data(), buffer.size());
-		ZAMAN_THREAD_JOIN();
+		// Queued from here, as waiting for the keys would block a worker that decodes the block
+		d.optField->decompressThreads(tasks);
+	}, 7);
+	tasks.run([&]() {
+		d.sequence->importRecords(in[0].data(), in[0].size());
 		// LOG("seq done");
-	}, ref(in[0]));
-	threadPool.push([&](int t, Array<uint8_t> &buffer) {
-		editOp[f]->importRecords(buffer.data(), buffer.size());
-		ZAMAN_THREAD_JOIN();
+	}, 0);
+	tasks.run([&]() {
+		d.editOp->importRecords(in[1].data(), in[1].size());
 		// LOG("seq done");
-	}, ref(in[1]));
-	threadPool.push([&](int t, Array<uint8_t> &buffer) {
-		readName[f]->importRecords(buffer.data(), buffer.size());
-		ZAMAN_THREAD_JOIN();
+	}, 1);
+	if (streams & 1 << 2) tasks.run([&]() {
+		d.readName->importRecords(in[2].data(), in[2].size());
 		// LOG("rname done");
-	}, ref(in[2]));
-	threadPool.push([&](int t, Array<uint8_t> &buffer) {
-		mapFlag[f]->importRecords(buffer.data(), buffer.size());
-		ZAMAN_THREAD_JOIN();
+	}, 2);
+	if (streams & 1 << 3) tasks.run([&]() {
+		d.mapFlag->importRecords(in[3].data(), in[3].size());
 		// LOG("mflag done");
-	}, ref(in[3]));
-	threadPool.push([&](int t, Array<uint8_t> &buffer) {
-		mapQual[f]->importRecords(buffer.data(), buffer.size());
-		ZAMAN_THREAD_JOIN();
+	}, 3);
+	if (streams & 1 << 4) tasks.run([&]() {
+		d.mapQual->importRecords(in[4].data(), in[4].size());
 		// LOG("mqual done");
-	}, ref(in[4]));
-	threadPool.push([&](int t, Array<uint8_t> &buffer) {
-		quality[f]->importRecords(buffer.data(), buffer.size());
-		ZAMAN_THREAD_JOIN();
+	}, 4);
+	if (streams & 1 << 5) tasks.run([&]() {
+		d.quality->importRecords(in[5].data(), in[5].size());
 		// LOG("qual done");
-	}, ref(in[5]));
-	threadPool.push([&](int t, Array<uint8_t> &buffer) {
-		pairedEnd[f]->importRecords(buffer.data(), buffer.size());
-		ZAMAN_THREAD_JOIN();
+	}, 5);
+	if (streams & 1 << 6) tasks.run([&]() {
+		d.pairedEnd->importRecords(in[6].data(), in[6].size());
 		// LOG("pe done");
-	}, ref(in[6]));
-	optField[f]->decompressThreads(threadPool);
-	threadPool.stop(true);
-	ZAMAN_END_P(Blocks);
+	}, 6);
+	tasks.wait();
+}
 
-	// TODO: stop early if slice/random access
-	ZAMAN_START_P(CheckMate);
-	for (int i = 0, j = 0; i < editOp[f]->size(); i++) {
-		PairedEndInfo &pe = (*pairedEnd[f])[i];
+void FileDecompressor::matchMates (BlockFields &d)
+{
+	for (int i = 0, j = 0; i < d.editOp->size(); i++) {
+		PairedEndInfo &pe = (*d.pairedEnd)[i];
 		if (pe.bit == PairedEndInfo::Bits::LOOK_BACK) {
-			int prevPos = i - readName[f]->getPaired(j++);
-			(*readName[f])[i] = (*readName[f])[prevPos];
+			int prevPos = i - d.readName->getPaired(j++);
+			(*d.readName)[i] = (*d.readName)[prevPos];
 						
-			EditOperation &eo = (*editOp[f])[i];
-			EditOperation &peo = (*editOp[f])[prevPos];
-			PairedEndInfo &ppe = (*pairedEnd[f])[prevPos];
+			EditOperation &eo = (*d.editOp)[i];
+			EditOperation &peo = (*d.editOp)[prevPos];
+			PairedEndInfo &ppe = (*d.pairedEnd)[prevPos];
 
 			ppe.tlen = eo.start + (peo.end - peo.start) - peo.start;
 			ppe.pos = eo.start;
@@ -331,24 +399,69 @@ size_t FileDecompressor::getBlock (int f, const string &chromosome,
 				pe.tlen++, ppe.tlen--;
 		}
 	}
-	ZAMAN_END_P(CheckMate);
+}
 
-	ZAMAN_START_P(Parse);
-	size_t recordCount = editOp[f]->size();
-	size_t threadSz = recordCount / optThreads + 1;
-	vector<thread> threads(optThreads);
-	vector<vector<string>> records(optThreads);
-	vector<char> finishedRangeThread(optThreads, 0);
-	size_t count = 0;
+// Formats the records of the block in parallel. Each thread appends its records 
+// to its own buffer in output, which keeps its capacity for the next blocks.
+// Records are sorted by position, so only the ones starting within the regions [start, end] (0-based,
+// sorted and disjoint) are formatted; with overlap, also the ones before start that reach into a region.
+// A record which reaches into several regions is formatted once.
+// With parts (API), the records are kept in the compact layout of the cache instead, one part per thread.
+// Returns the number of formatted records
+size_t FileDecompressor::formatRecords (BlockFields &d, int f, const string &chr, 
+	const vector<pair<size_t, size_t>> &regions, const Options &o, vector<string> &output, 
+	vector<BlockCache::Block> *parts)
+{
+	size_t recordCount = d.editOp->size();
+	auto firstAt = [&](size_t pos) {
+		size_t lo = 0, hi = recordCount;
+		while (lo < hi) {
+			size_t mid = (lo + hi) / 2;
+			if ((*d.editOp)[mid].start < pos) 
+				lo = mid + 1;
+			else 
+				hi = mid;
+		}
+		return lo;
+	};
+	// Records of each region: with overlap, the ones after the previous region
+	struct Span { size_t first, last, start; };
+	vector<Span> spans;
+	size_t total = 0, after = 0;
+	for (auto &r: regions) {
+		size_t first = firstAt(o.overlap ? after : r.first);
+		size_t last = r.second == (size_t)-1 ? recordCount : firstAt(r.second + 1);
+		if (first < last) {
+			spans.push_back({ first, last, r.first });
+			total += last - first;
+		}
+		after = r.second + 1;
+	}
 
+	size_t threadSz = total / optThreads + 1;
+	output.resize(optThreads);
+	int fields = o.fields, filterFlag = o.filterFlag, streams = neededStreams(o, false);
+	vector<size_t> counts(optThreads, 0);
+
+	TaskGroup tasks;
 	for (int ti = 0; ti < optThreads; ti++) {
-		if (ti) records[ti].reserve(threadSz);
-		threads[ti] = thread([&](int ti, size_t S, size_t E) {
+		output[ti].resize(0);
+		size_t S = threadSz * ti, E = min(total, (ti + 1) * threadSz);
+		tasks.run([&, ti, S, E]() {
 			ZAMAN_START(Thread);
-			size_t maxLen = 255;
-			string record;
-			for (size_t i = S; i < E; i++) {
-				int flag = mapFlag[f]->getRecord(i);
+			string &record = output[ti];
+			size_t &count = counts[ti];
+			PairedEndInfo noMate;
+			noMate.chr = "*", noMate.pos = 0, noMate.tlen = 0;
+			size_t span = 0, spanStart = 0; // span of the position and its first position 
+			for (size_t p = S; p < E; p++) {
+				while (p >= spanStart + spans[span].last - spans[span].first)
+					spanStart += spans[span].last - spans[span].first, span++;
+				size_t i = spans[span].first + p - spanStart, start = spans[span].start;
+				if ((*d.editOp)[i].start < start && (*d.editOp)[i].end <= start)
+					continue;
+
+				int flag = (streams & 1 << 3) ? d.mapFlag->getRecord(i) : 0;
 
 				if (filterFlag) {
 					if (filterFlag > 0 && (flag & filterFlag) != filterFlag)
@@ -357,88 +470,160 @@ size_t FileDecompressor::getBlock (int f, const string &chromosome,
 						continue;
 				}
 
-				auto &eo = editOp[f]->getRecord(i);
-				auto &pe = pairedEnd[f]->getRecord(i, eo.start, eo.end - eo.start, flag & 0x10);
+				// Sequence, CIGAR and tags are restored from the reference only when needed
+				auto &eo = (fields & (CIGAR | SEQ | QUAL | OPT)) ? d.editOp->getRecord(i) : (*d.editOp)[i];
+				auto &pe = (fields & (RNEXT | PNEXT | TLEN)) 
+					? d.pairedEnd->getRecord(i, eo.start, eo.end - eo.start, flag & 0x10) : noMate;
 
 				if (chr != "*") 
 					eo.start++;
 				if (pe.chr != "*") 
 					pe.pos++;
 
-				if (eo.start < start) {
-					if (!optOverlap || eo.end <= start) {
-						continue;
-					}
-				}
-				if (eo.start > end) {
-					finishedRangeThread[ti] = true;
-					return;
-				}
-
-				if (isAPI) {
+				if (parts) {
 					string of;
-					optField[f]->getRecord(i, eo, of);
-
-					//LOG("%d %d", ti, eo.start);
-					printRecord(readName[f]->getRecord(i), 
-						flag, chr, eo, 
-						mapQual[f]->getRecord(i),
-						quality[f]->getRecord(i, eo.seq.size(), flag), 
-						of, pe, f, ti);
+					if (fields & OPT) 
+						d.optField->getRecord(i, eo, of);
+					(*parts)[ti].add({ chr != "*" ? eo.start - 1 : eo.start, eo.end, 
+							(fields & PNEXT) ? pe.pos : 0, (fields & FLAG) ? flag : 0, (fields & TLEN) ? pe.tlen : 0,
+							uint32_t((fields & MAPQ) ? d.mapQual->getRecord(i) : 255), 0 }, 
+						(fields & QNAME) ? d.readName->getRecord(i) : "*", 
+						(fields & CIGAR) ? eo.op : "*", (fields & RNEXT) ? pe.chr : "*", 
+						(fields & SEQ) ? eo.seq : "*",
+						(fields & QUAL) ? d.quality->getRecord(i, eo.seq.size(), flag) : "*", of);
 					count++;
 					continue;
 				}
 
-				record.resize(0);
-				record += readName[f]->getRecord(i);
+				// Left out columns get the SAM placeholders
+				if (fields & QNAME) record += d.readName->getRecord(i); else record += '*';
 				record += '\t';
-				inttostr(flag, record); 
+				inttostr((fields & FLAG) ? flag : 0, record); 
 				record += '\t';
 				record += chr; 
 				record += '\t';
 				inttostr(eo.start, record); 
 				record += '\t';
-				inttostr(mapQual[f]->getRecord(i), record); 
+				inttostr((fields & MAPQ) ? d.mapQual->getRecord(i) : 255, record); 
 				record += '\t';
-				record += eo.op; 
+				if (fields & CIGAR) record += eo.op; else record += '*';
 				record += '\t';
-				record += pe.chr; 
+				if (fields & RNEXT) record += pe.chr; else record += '*';
 				record += '\t';
-				inttostr(pe.pos, record); 
+				inttostr((fields & PNEXT) ? pe.pos : 0, record); 
 				record += '\t';
-				inttostr(pe.tlen, record); 
+				inttostr((fields & TLEN) ? pe.tlen : 0, record); 
 				record += '\t';
-				record += eo.seq; 
+				if (fields & SEQ) record += eo.seq; else record += '*';
 				record += '\t';
-				record += quality[f]->getRecord(i, eo.seq.size(), flag);
-				optField[f]->getRecord(i, eo, record);
-				maxLen = max(record.size(), maxLen);
-				record.reserve(maxLen);
-
-				if (ti == 0) {
-					printRecord(record, f);
-					count++;
-				} else {
-					records[ti].push_back(record);
-				}
+				if (fields & QUAL)
+					d.quality->getRecord(i, eo.seq.size(), flag, record);
+				else
+					record += '*';
+				if (fields & OPT)
+					d.optField->getRecord(i, eo, record);
+				record += '\n';
+				count++;
 			}
 			ZAMAN_END(Thread);
-			ZAMAN_THREAD_JOIN();
-		}, ti, threadSz * ti, min(recordCount, (ti + 1) * threadSz));
+		}, ti);
 	}
-	for (int ti = 0; ti < optThreads; ti++) {
-		threads[ti].join();
-		if (finishedRangeThread[ti])
-			finishedRange = true;
+	tasks.wait();
+	size_t count = 0;
+	for (int ti = 0; ti < optThreads; ti++) 
+		count += counts[ti];
+	return count;
+}
+
+// Writes the buffers of a block in order with one system call
+void FileDecompressor::writeOutput (int f, const vector<string> &output)
+{
+	vector<iovec> iov;
+	for (auto &o: output) if (o.size())
+		iov.push_back({ (void*)o.data(), o.size() });
+
+	FILE *fo = samFiles[f];
+	fflush(fo); // comments are written through the stream
+	for (size_t i = 0; i < iov.size(); ) {
+		ssize_t sz = writev(fileno(fo), iov.data() + i, min(iov.size() - i, (size_t)IOV_MAX));
+		if (sz < 0) {
+			if (errno == EINTR)
+				continue;
+			throw DZException("Cannot write to the output file");
+		}
+		for (; i < iov.size() && sz >= iov[i].iov_len; i++)
+			sz -= iov[i].iov_len;
+		if (sz) {
+			iov[i].iov_base = (char*)iov[i].iov_base + sz;
+			iov[i].iov_len -= sz;
+		}
 	}
+}
+
+// Parses a comma-separated list of SAM columns; empty list selects all of them
+int FileDecompressor::parseFields (const string &fields)
+{
+	if (fields == "")
+		return ALL;
+	static const map<string, int> names = {
+		{ "QNAME", QNAME }, { "FLAG", FLAG }, { "RNAME", 0 }, { "POS", 0 }, 
+		{ "MAPQ", MAPQ }, { "CIGAR", CIGAR }, { "RNEXT", RNEXT }, { "PNEXT", PNEXT }, 
+		{ "TLEN", TLEN }, { "SEQ", SEQ }, { "QUAL", QUAL }, { "OPT", OPT }
+	};
+	int result = 0;
+	for (auto &n: split(fields, ',')) {
+		string name = n;
+		transform(name.begin(), name.end(), name.begin(), ::toupper);
+		auto it = names.find(name);
+		if (it == names.end())
+			throw DZException("Unknown SAM field %s", n.c_str());
+		result |= it->second;
+	}
+	return result;
+}
+
+size_t FileDecompressor::getBlock (int f, const string &chromosome, 
+	const vector<pair<size_t, size_t>> &regions, int filterFlag) 
+{
+	if (finishedRange) 
+		return 0;
+	string chr;
+	if (!readChromosome(f, chromosome, chr))
+		return 0;
+
+	ZAMAN_START_P(Blocks);
+	Array<uint8_t> in[8];
+
+	for (int ti = 0; ti < 8; ti++) {
+		readBlock(in[ti]);
+	}
+
+	auto d = fileFields(f);
+	int streams = neededStreams(Options(filterFlag), true);
+	importFields(d, in, streams);
+	ZAMAN_END_P(Blocks);
+
+	ZAMAN_START_P(CheckMate);
+	if (streams & 1 << 6)
+		matchMates(d);
+	ZAMAN_END_P(CheckMate);
+
+	ZAMAN_START_P(Parse);
+	vector<BlockCache::Block> parts(isAPI ? optThreads : 0);
+	size_t count = formatRecords(d, f, chr, regions, Options(filterFlag), blockOutput, isAPI ? &parts : nullptr);
+	size_t n = d.editOp->size(); 
+	if (n && (*d.editOp)[n - 1].start > regions.back().second) // next blocks are past the regions
+		finishedRange = true;
 	ZAMAN_END_P(Parse);
 	
 	ZAMAN_START_P(Write);
-	for (auto &v: records)
-		for (auto &r: v) {
-			printRecord(r, f);
-			count++;
-		}
+	if (isAPI) {
+		for (auto &p: parts) 
+			for (size_t i = 0; i < p.records.size(); i++)
+				printRecord(p, i, ALL, f);
+	} else {
+		writeOutput(f, blockOutput);
+	}
 	LOGN("\r\t%5.2lf%% [Chr %-10s]", (100.0 * inFile->tell()) / inFileSz, chr.substr(0, 10).c_str());
 	ZAMAN_END_P(Write);
 	
@@ -446,49 +631,83 @@ size_t FileDecompressor::getBlock (int f, const string &chromosome,
 	return count;
 }
 
-void FileDecompressor::loadIndex () 
+// Reads the block of the query and carries the state of its file over to it:
+// the fixed reference is decoded here in order, and the stream models are either taken 
+// from the index or, if they are not stored there, decoded here with the models of the file
+bool FileDecompressor::readBlock (const BlockQuery &q, DecodedBlock &b, int filterFlag)
 {
-	ZAMAN_START_P(LoadIndex);
-	fileBlockCount.clear();
-	bool firstRead = 1;
-	indices.resize(fileNames.size());
-	while (1) {
-		//WARN("Here...%x",this->magic&0xff);
-		index_t idx;
-		string chr;
-		
-		size_t sz;
-		if (firstRead) 
-			firstRead = 0;
-		else for (int i = 0; i < 8; i++) {
-			gzread(idxFile, &sz, sizeof(size_t));
-			idx.fieldData[i].resize(sz); 
-			if (sz) gzread(idxFile, idx.fieldData[i].data(), sz); 
-		}
+	size_t k = q.block;
+	int f = (*index)[k].file;
+	inFile->seek((*index)[k].zpos);
+	if (!readChromosome(f, q.chr, b.chr))
+		return false;
+	b.f = f;
+	b.regions = q.regions;
+	for (int ti = 0; ti < 8; ti++) 
+		readBlock(b.in[ti]);
+	b.filePos = inFile->tell();
+
+	ZAMAN_START_P(Sequence);
+	sequence[f]->importRecords(b.in[0].data(), b.in[0].size());
+	b.in[0].resize(0);
+	if (!b.fields.sequence)
+		b.fields.sequence = make_shared<SequenceDecompressor>("", blockSize, bzip);
+	b.fields.sequence->copyFixed(*sequence[f]);
+	ZAMAN_END_P(Sequence);
+
+	auto fieldData = index->state(k);
+	auto &state = *fieldData;
+	if (!b.fields.editOp || !state[1].size()) // first block of the file: initial models
+		b.fields = newFields(b.fields.sequence);
+	shared_ptr<Decompressor> di[] = { 
+		b.fields.sequence, b.fields.editOp, b.fields.readName, b.fields.mapFlag, 
+		b.fields.mapQual, b.fields.quality, b.fields.pairedEnd, b.fields.optField 
+	};
+	for (int ti = 0; ti < 8; ti++) if (state[ti].size() && (ti != 5 || quality[f]->hasIndexData())) 
+		di[ti]->setIndexData(state[ti].data(), state[ti].size());
+	if (!quality[f]->hasIndexData() && (neededStreams(Options(filterFlag), false) & 1 << 5)) {
+		ZAMAN_START_P(Quality);
+		b.fields.quality->shareModels(*quality[f]);
+		b.fields.quality->importRecords(b.in[5].data(), b.in[5].size());
+		b.in[5].resize(0);
+		ZAMAN_END_P(Quality);
+	}
+	return true;
+}
 
-		int16_t f = 0;
-		if ((this->magic & 0xff) >= 0x11) {
-			if (gzread(idxFile, &f, sizeof(int16_t)) != sizeof(int16_t)) 
-				break;
-			gzread(idxFile, &idx.zpos, sizeof(size_t));
-		}
-		else {
-			if (gzread(idxFile, &idx.zpos, sizeof(size_t)) != sizeof(size_t))
-				break;
-		}
-		fileBlockCount.push_back(f);
-		
-		gzread(idxFile, &idx.currentBlockCount, sizeof(size_t));
-		char c; while (gzread(idxFile, &c, 1) && c) chr += c;
-		gzread(idxFile, &idx.startPos, sizeof(size_t));
-		gzread(idxFile, &idx.endPos, sizeof(size_t));
-		gzread(idxFile, &idx.fS, sizeof(size_t));
-		gzread(idxFile, &idx.fE, sizeof(size_t));
+// Maps the index of the file, which follows the stats, or loads the gzipped index of the older files
+void FileDecompressor::loadIndex (const string &inFilePath) 
+{
+	char keymagic[6] = {0};
+	inFile->read(keymagic, 5);
+	if ((magic & 0xff) >= 0x21) {
+		if (strcmp(keymagic, "DZMAP"))
+			throw DZException("Index is corrupted ...%s", keymagic);
+		index = make_shared<BlockIndex>(inFile, inFilePath, inFile->tell(), inFileSz - sizeof(size_t));
+		return;
+	}
+
+	if (strcmp(keymagic, "DZIDX"))
+		throw DZException("Index is corrupted ...%s", keymagic);
+	size_t idxToRead = inFileSz - inFile->tell() - sizeof(size_t);
+	FILE *tmp = tmpfile();
+	char *buffer = (char*)malloc(MB);
 
-		//if (inMemory)
-		indices[f][chr][idx.startPos] = idx;
+	size_t sz;
+	while (idxToRead && (sz = inFile->read(buffer, min(uint64_t(MB), (uint64_t)idxToRead)))) {
+		fwrite(buffer, 1, sz, tmp);
+		idxToRead -= sz;
 	}
-	ZAMAN_END_P(LoadIndex);
+	free(buffer);
+	
+	int idx = dup(fileno(tmp));
+	fclose(tmp);
+	lseek(idx, 0, SEEK_SET); // needed for gzdopen
+	gzFile idxFile = gzdopen(idx, "rb");
+	if (idxFile == Z_NULL)
+		throw DZException("Cannot open the index");
+	index = make_shared<BlockIndex>(idxFile, magic, numFiles);
+	gzclose(idxFile);
 }
 
 vector<range_t> FileDecompressor::getRanges (string range)
@@ -501,23 +720,27 @@ vector<range_t> FileDecompressor::getRanges (string range)
 	while ((p = range.find(';')) != string::npos) {
 		string chr;
 		size_t start, end;
-		char *dup = strdup(range.substr(0, p).c_str());
-		char *tok = strtok(dup, ":-");
+		char *dup = strdup(range.substr(0, p).c_str()), *save;
+		char *tok = strtok_r(dup, ":-", &save);
 		
 		if (tok) {
-			chr = tok, tok = strtok(0, ":-");
+			chr = tok, tok = strtok_r(0, ":-", &save);
 			if (tok) {
-				start = atol(tok), tok = strtok(0, ":-");
+				start = atol(tok), tok = strtok_r(0, ":-", &save);
 				if (tok) 
-					end = atol(tok), tok = strtok(0, ":-");
+					end = atol(tok), tok = strtok_r(0, ":-", &save);
 				else 
 					end = -1;
 			}
 			else {
 				start = 1; end = -1;
 			}
+			free(dup);
+		}
+		else {
+			free(dup);
+			throw DZException("Range string %s invalid", range.substr(0, p - 1).c_str());
 		}
-		else throw DZException("Range string %s invalid", range.substr(0, p - 1).c_str());
 		if (end < start)
 			swap(start, end);
 		if (start) start--; 
@@ -544,15 +767,267 @@ void FileDecompressor::decompress (int filterFlag)
 			printComment(f);
 	}
 
-	size_t blockSz = 0, 
-		   totalSz = 0, 
+	if (isAPI) {
+		size_t blockSz = 0, 
+			totalSz = 0, 
+			blockCount = 0;
+		while (blockCount < index->size() && (blockSz = getBlock((*index)[blockCount].file, "", { { 0, -1 } }, filterFlag)) != 0) {
+			totalSz += blockSz;
+			blockCount++;
+		}
+		LOGN("\nDecompressed %'lu records, %'lu blocks\n", totalSz, blockCount);
+		ZAMAN_END_P(Decompress);
+		return;
+	}
+
+	vector<BlockQuery> blocks(index->size());
+	for (size_t k = 0; k < blocks.size(); k++) 
+		blocks[k] = { k, "", { { 0, -1 } } };
+	decodeBlocks(blocks, filterFlag);
+	ZAMAN_END_P(Decompress);
+}
+
+// Decodes the blocks in the given order with all threads and writes their records
+void FileDecompressor::decodeBlocks (const vector<BlockQuery> &blocks, int filterFlag)
+{
+	size_t totalSz = 0, 
 		   blockCount = 0;
-	while (blockCount < fileBlockCount.size() && (blockSz = getBlock(fileBlockCount[blockCount], "", 0, -1, filterFlag)) != 0) {
-		totalSz += blockSz;
-		blockCount++;
+
+	// Blocks are read (and their cross-block state carried over) in order by this thread,
+	// decoded by the workers up to optPrefetch blocks ahead of the output stage, and written in order.
+	// Stall times are the waits of the reader for a free block and of the output for a decoded one
+	int inFlightBlocks = optPrefetch + 1;
+	BoundedQueue<shared_ptr<DecodedBlock>> freeBlocks(inFlightBlocks), outputQueue(inFlightBlocks);
+	for (int i = 0; i < inFlightBlocks; i++)
+		freeBlocks.push(make_shared<DecodedBlock>());
+	exception_ptr stageError = nullptr;
+	thread outputStage([&]() {
+		ZAMAN_THREAD_ROOT("Decompress_");
+		try {
+			shared_ptr<DecodedBlock> b;
+			while (1) {
+				ZAMAN_START(Write);
+				ZAMAN_START(Stall);
+				bool ok = outputQueue.pop(b);
+				if (ok) 
+					b->done.get();
+				ZAMAN_END(Stall);
+				if (!ok) {
+					ZAMAN_END(Write);
+					break;
+				}
+				writeOutput(b->f, b->output);
+				totalSz += b->count;
+				blockCount++;
+				LOGN("\r\t%5.2lf%% [Chr %-10s]", (100.0 * b->filePos) / inFileSz, b->chr.substr(0, 10).c_str());
+				ZAMAN_END(Write);
+				freeBlocks.push(b);
+			}
+		} catch (...) {
+			stageError = current_exception();
+			freeBlocks.close();
+			outputQueue.close();
+		}
+		ZAMAN_THREAD_JOIN();
+	});
+
+	TaskGroup tasks;
+	exception_ptr readError = nullptr;
+	try {
+		shared_ptr<DecodedBlock> b;
+		for (auto &q: blocks) {
+			ZAMAN_START_P(Read);
+			ZAMAN_START_P(Stall);
+			bool read = freeBlocks.pop(b);
+			ZAMAN_END_P(Stall);
+			if (read)
+				read = readBlock(q, *b, filterFlag);
+			ZAMAN_END_P(Read);
+			if (!read)
+				break;
+			b->decoded = promise<void>();
+			b->done = b->decoded.get_future();
+			if (!outputQueue.push(b))
+				break;
+			tasks.run([&, b]() {
+				ZAMAN_THREAD_ROOT("Decompress_");
+				try {
+					ZAMAN_START(Blocks);
+					int streams = neededStreams(Options(filterFlag), false);
+					importFields(b->fields, b->in, streams);
+					if (streams & 1 << 6)
+						matchMates(b->fields);
+					ZAMAN_END(Blocks);
+					ZAMAN_START(Parse);
+					b->count = formatRecords(b->fields, b->f, b->chr, b->regions, Options(filterFlag), b->output);
+					ZAMAN_END(Parse);
+					b->decoded.set_value();
+				} catch (...) {
+					b->decoded.set_exception(current_exception());
+				}
+			});
+		}
+	} catch (...) {
+		readError = current_exception();
 	}
+	outputQueue.close();
+	tasks.wait();
+	outputStage.join();
+	if (readError)
+		rethrow_exception(readError);
+	if (stageError)
+		rethrow_exception(stageError);
 	LOGN("\nDecompressed %'lu records, %'lu blocks\n", totalSz, blockCount);
-	ZAMAN_END_P(Decompress);
+}
+
+// Moves the input to the block k and sets the stream models of its file to the ones at the block start
+void FileDecompressor::seekBlock (size_t k)
+{
+	int f = (*index)[k].file;
+	auto fieldData = index->state(k);
+	inFile->seek((*index)[k].zpos);
+	sequence[f]->rewind((*index)[k].fS);
+	auto &state = *fieldData;
+	if (!state[1].size()) { // first block of the file: initial models
+		auto d = newFields(sequence[f]);
+		editOp[f] = d.editOp, readName[f] = d.readName, mapFlag[f] = d.mapFlag, mapQual[f] = d.mapQual;
+		quality[f] = d.quality, pairedEnd[f] = d.pairedEnd, optField[f] = d.optField;
+	}
+	shared_ptr<Decompressor> di[] = { 
+		sequence[f], editOp[f], readName[f], mapFlag[f], 
+		mapQual[f], quality[f], pairedEnd[f], optField[f] 
+	};
+
+	for (int ti = 0; ti < 8; ti++) if (state[ti].size()) 
+		di[ti]->setIndexData(state[ti].data(), state[ti].size());
+}
+
+// Decodes the block k with the decoders of the query, reading it without moving the input.
+// With the cache, the block is decoded with all of its records (and FLAG, so the later queries
+// can filter them) and added to the cache, unless it is already there.
+// Otherwise, only the records of the query within the regions (sorted and disjoint) are kept.
+// Returns null if the block is not on the chromosome
+shared_ptr<BlockCache::Block> FileDecompressor::decodeBlock (Query &q, size_t k, const string &chr,
+	const vector<pair<size_t, size_t>> &regions)
+{
+	index_t idx = (*index)[k];
+	int f = idx.file;
+	bool cached = cache && cache->statistics().capacity;
+	Options o(q.options.filterFlag, q.options.fields | FLAG, q.options.overlap);
+	if (cached) {
+		o = Options(0, o.fields, true);
+		auto b = cache->find(f, chr, idx.startPos, k, o.fields);
+		if (b) 
+			return b;
+	}
+
+	ZAMAN_START_P(DecodeBlock);
+	if (q.decoders.size() != numFiles)
+		q.decoders.resize(numFiles);
+	if (!q.decoders[f].sequence)
+		q.decoders[f] = newFields();
+	BlockFields &d = q.decoders[f];
+
+	// Stream models at the block start
+	d.sequence->rewind(idx.fS);
+	auto fieldData = index->state(k);
+	auto &state = *fieldData;
+	if (!state[1].size()) // first block of the file: initial models
+		d = newFields(d.sequence);
+	shared_ptr<Decompressor> di[] = { 
+		d.sequence, d.editOp, d.readName, d.mapFlag, 
+		d.mapQual, d.quality, d.pairedEnd, d.optField 
+	};
+	for (int ti = 0; ti < 8; ti++) if (state[ti].size()) 
+		di[ti]->setIndexData(state[ti].data(), state[ti].size());
+
+	size_t pos = idx.zpos;
+	auto b = make_shared<BlockCache::Block>();
+	if (!readChromosome(*d.sequence, f, pos, chr, b->chr)) {
+		ZAMAN_END_P(DecodeBlock);
+		return nullptr;
+	}
+	Array<uint8_t> in[8];
+	for (int ti = 0; ti < 8; ti++) 
+		readBlock(pos, in[ti]);
+	int streams = neededStreams(o, true);
+	importFields(d, in, streams);
+	if (streams & 1 << 6)
+		matchMates(d);
+
+	vector<string> output;
+	q.parts.assign(optThreads, BlockCache::Block());
+	formatRecords(d, f, b->chr, cached ? vector<pair<size_t, size_t>>{ { 0, -1 } } : regions, o, output, &q.parts);
+	b->fields = o.fields;
+	for (auto &p: q.parts)
+		b->append(p);
+	q.parts.clear();
+	if (cached)
+		cache->insert(f, chr, idx.startPos, k, b);
+	ZAMAN_END_P(DecodeBlock);
+	return b;
+}
+
+// Appends the positions of the records of the decoded block within the regions (sorted and disjoint)
+// which pass the filter of the options to out (the same records as formatRecords).
+// Returns the number of the records
+size_t FileDecompressor::selectRecords (const BlockCache::Block &b, const vector<pair<size_t, size_t>> &regions, 
+	const Options &o, vector<uint32_t> &out)
+{
+	ZAMAN_START_P(SelectRecords);
+	int filterFlag = o.filterFlag;
+	auto &records = b.records;
+	size_t count = 0, after = 0;
+	for (auto &r: regions) {
+		// With overlap, the records after the previous region reaching into this one
+		auto it = lower_bound(records.begin(), records.end(), o.overlap ? after : r.first, 
+			[](const BlockCache::Record &rec, size_t pos) { return rec.start < pos; });
+		after = r.second + 1;
+		for (; it != records.end() && it->start <= r.second; it++) {
+			if (it->start < r.first && it->end <= r.first)
+				continue;
+			if (filterFlag > 0 && (it->flag & filterFlag) != filterFlag)
+				continue;
+			if (filterFlag < 0 && (it->flag & -filterFlag) == -filterFlag)
+				continue;
+
+			out.push_back(it - records.begin());
+			count++;
+		}
+	}
+	ZAMAN_END_P(SelectRecords);
+	return count;
+}
+
+void FileDecompressor::getRecord (const BlockCache::Block &b, size_t i, int fields, BlockCache::Record &r, const char *s[6])
+{
+	r = b.records[i];
+	b.strings(r, s);
+	if (!(fields & FLAG)) r.flag = 0;
+	if (!(fields & MAPQ)) r.mapq = 255;
+	if (!(fields & PNEXT)) r.pnext = 0;
+	if (!(fields & TLEN)) r.tlen = 0;
+	static const int columns[] = { QNAME, CIGAR, RNEXT, SEQ, QUAL, OPT };
+	for (int j = 0; j < 6; j++) if (!(fields & columns[j]))
+		s[j] = columns[j] == OPT ? "" : "*";
+}
+
+// Passes the record i of the decoded block of the file f to printRecord
+void FileDecompressor::printRecord (const BlockCache::Block &b, size_t i, int fields, int f)
+{
+	BlockCache::Record r;
+	const char *s[6];
+	getRecord(b, i, fields, r, s);
+	EditOperation eo;
+	eo.start = b.chr != "*" ? r.start + 1 : r.start;
+	eo.end = r.end;
+	eo.op = s[1];
+	eo.seq = s[3];
+	PairedEndInfo pe;
+	pe.chr = s[2];
+	pe.pos = r.pnext;
+	pe.tlen = r.tlen;
+	printRecord(s[0], r.flag, b.chr, eo, r.mapq, s[4], s[5], pe, f, 0);
 }
 
 void FileDecompressor::decompress (const string &range, int filterFlag)
@@ -575,19 +1050,15 @@ void FileDecompressor::decompress (const string &range, int filterFlag)
 		string chr = r->first.second;
 		if (f < 0 || f >= fileNames.size())
 			throw DZException("Invalid sample ID %d", f);
-		if (indices[f].find(chr) == indices[f].end())
+		size_t first, last;
+		if (!index->find(f, chr, first, last))
 			throw DZException("Invalid chromosome %s for sample ID %d", chr.c_str(), f);
 
-		auto idx = indices[f][chr];
-		auto i = idx.upper_bound(r->second.first);
-		if (i == idx.begin() || idx.size() == 0) {
-			if (i != idx.begin() || !intersect(i->second.startPos, i->second.endPos, r->second.first, r->second.second)) {
-				throw DZException("Region %s:%d-%d not found for sample ID %d", 	
-					chr.c_str(), r->second.first, r->second.second, f);
-			}
-		}
-		if (i != idx.begin()) {
-			i--;
+		size_t i = index->seek(first, last, r->second.first);
+		index_t b = (*index)[index->sortedBlock(i)];
+		if (b.startPos > r->second.first && !intersect(b.startPos, b.endPos, r->second.first, r->second.second)) {
+			throw DZException("Region %s:%d-%d not found for sample ID %d", 	
+				chr.c_str(), r->second.first, r->second.second, f);
 		}
 		
 		// prepare reference
@@ -608,124 +1079,226 @@ void FileDecompressor::decompress (const string &range, int filterFlag)
 		// 	}
 		// }
 		// set up field data
-		while (intersect(i->second.fS, i->second.fE, r->second.first, r->second.second)) {	
-			//LOG("in");
-			inFile->seek(i->second.zpos);
-			shared_ptr<Decompressor> di[] = { 
-				sequence[f], editOp[f], readName[f], mapFlag[f], 
-				mapQual[f], quality[f], pairedEnd[f], optField[f] 
-			};
-
-			for (int ti = 0; ti < 8; ti++) if (i->second.fieldData[ti].size()) 
-				di[ti]->setIndexData(i->second.fieldData[ti].data(), i->second.fieldData[ti].size());
-
-			size_t blockSz = getBlock(f, chr, r->second.first, r->second.second, filterFlag);
-			if (!blockSz) {
-				break;
+		for (; i < last; i++) {
+			b = (*index)[index->sortedBlock(i)];
+			if (!intersect(b.fS, b.fE, r->second.first, r->second.second)) {
+				if (b.startPos > r->second.second)
+					break;
+				continue;
 			}
-			totalSz += blockSz;
+			seekBlock(index->sortedBlock(i));
+			totalSz += getBlock(f, chr, { r->second }, filterFlag);
 			blockCount++;
 
 			if (finishedRange) {
 				finishedRange = false;
 				break;
 			}
-
-			i++;
 		}
 	}
 	ZAMAN_END_P(Decompress);
 	LOGN("\nDecompressed %'lu records, %'lu blocks\n", totalSz, blockCount);
 }
 
-bool FileDecompressor::decompress2 (const string &range, int filterFlag, bool cont)
+// Sorts and merges the regions of each chromosome and maps them to the distinct blocks they touch,
+// in the file order. Each block is decoded for the merged regions of its chromosome which it may hold
+vector<FileDecompressor::BlockQuery> FileDecompressor::planQuery (const vector<range_t> &ranges)
 {
-	static range_t r;
-	static map<size_t, index_t> idx;
-	static map<size_t, index_t>::iterator i;
-	static string chr;
-	static int f;
-
-	if (!cont) {
-		auto ranges = getRanges(range);
-		if (ranges.size() != 1) 
-			throw DZException("API supports only single range per invocation, %d provided", ranges.size());
+	map<pair<int, string>, vector<pair<size_t, size_t>>> regions;
+	for (auto &r: ranges) {
+		if (r.first.first < 0 || r.first.first >= fileNames.size())
+			throw DZException("Invalid sample ID %d", r.first.first);
+		regions[r.first].push_back(r.second);
+	}
 
-		r = ranges[0];
-		f = r.first.first;
-		chr = r.first.second;
-		if (f < 0 || f >= fileNames.size())
-			throw DZException("Invalid sample ID %d", f);
-		if (indices[f].find(chr) == indices[f].end())
+	map<size_t, BlockQuery> blocks;
+	for (auto &c: regions) {
+		int f = c.first.first;
+		const string &chr = c.first.second;
+		size_t first, last;
+		if (!index->find(f, chr, first, last))
 			throw DZException("Invalid chromosome %s for sample ID %d", chr.c_str(), f);
 
-		idx = indices[f][chr];
-		i = idx.upper_bound(r.second.first);
-		if (i == idx.begin() || idx.size() == 0) {
-			if (i != idx.begin() || !intersect(i->second.startPos, i->second.endPos, r.second.first, r.second.second)) {
-				throw DZException("Region %s:%d-%d not found for sample ID %d", 	
-					chr.c_str(), r.second.first, r.second.second, f);
-			}
+		auto &rs = c.second;
+		sort(rs.begin(), rs.end());
+		size_t merged = 0;
+		for (size_t j = 1; j < rs.size(); j++) {
+			if (rs[j].first <= rs[merged].second || rs[j].first - rs[merged].second == 1)
+				rs[merged].second = max(rs[merged].second, rs[j].second);
+			else
+				rs[++merged] = rs[j];
 		}
-		if (i != idx.begin()) {
-			i--;
+		rs.resize(merged + 1);
+
+		for (auto &r: rs) {
+			for (size_t i = index->seek(first, last, r.first); i < last; i++) {
+				index_t b = (*index)[index->sortedBlock(i)];
+				if (b.startPos > r.second)
+					break;
+				if (!intersect(b.fS, b.fE, r.first, r.second))
+					continue;
+				BlockQuery &q = blocks[index->sortedBlock(i)];
+				q.block = index->sortedBlock(i);
+				q.chr = chr;
+				q.regions.push_back(r);
+			}
 		}
-		
-		// prepare reference
-		// foreach (j, idx) { // TODO speed up
-		// 	if (j == i) break;
-		// 	if (intersect(j->second.fS, j->second.fE, r.second.first, r.second.second)) {
-		// 		inFile->seek(j->second.zpos);
-		// 		char chflag = inFile->readU8();
-		// 		while (chflag) chflag = inFile->readU8();
-		// 		while (chr != sequence[f]->getChromosome())
-		// 			sequence[f]->scanChromosome(chr, samComment[f]);
+	}
 
-		// 		Array<uint8_t> in;
-		// 		readBlock(in);
-		// 		sequence[f]->importRecords(in.data(), in.size());
-		// 	}
-		// }
+	vector<BlockQuery> result;
+	for (auto &b: blocks)
+		result.push_back(b.second);
+	return result;
+}
+
+// Decodes each block touched by the regions once with all threads
+// and formats its records within the merged regions
+void FileDecompressor::decompressBatch (const string &ranges, int filterFlag)
+{
+	ZAMAN_START_P(Decompress);
+	if (isAPI) {
+		if (!apiQuery)
+			apiQuery = make_shared<Query>();
+		apiQuery->options = Options(filterFlag);
+		queryBatch(*apiQuery, ranges);
+		auto parsed = getRanges(ranges);
+		for (size_t i = 0; i < parsed.size(); i++)
+			for (size_t j = 0; j < apiQuery->regions[i].records.size(); j++)
+				printRecord(apiQuery->regions[i], j, ALL, parsed[i].first.first);
+		ZAMAN_END_P(Decompress);
+		return;
 	}
-	
-	// set up field data
-	if (intersect(i->second.fS, i->second.fE, r.second.first, r.second.second)) {		
-		inFile->seek(i->second.zpos);
-		shared_ptr<Decompressor> di[] = { 
-			sequence[f], editOp[f], readName[f], mapFlag[f], 
-			mapQual[f], quality[f], pairedEnd[f], optField[f] 
-		};
-
-		for (int ti = 0; ti < 8; ti++) if (i->second.fieldData[ti].size()) 
-			di[ti]->setIndexData(i->second.fieldData[ti].data(), i->second.fieldData[ti].size());
-
-		size_t blockSz = getBlock(f, chr, r.second.first, r.second.second, filterFlag);
-		
-		if (!blockSz) {
-			return false;
-		}
-		
-		if (finishedRange) {
-			finishedRange = false;
-			//return false;
+
+	if (optComment) {
+		for (int f = 0; f < comments.size(); f++)
+			printComment(f);
+	}
+	decodeBlocks(planQuery(getRanges(ranges)), filterFlag);
+	ZAMAN_END_P(Decompress);
+}
+
+void FileDecompressor::startRange (Query &q, const string &range)
+{
+	auto ranges = getRanges(range);
+	if (ranges.size() != 1) 
+		throw DZException("API supports only single range per invocation, %d provided", ranges.size());
+
+	range_t r = ranges[0];
+	int f = r.first.first;
+	const string &chr = r.first.second;
+	if (f < 0 || f >= fileNames.size())
+		throw DZException("Invalid sample ID %d", f);
+	size_t first, last;
+	if (!index->find(f, chr, first, last))
+		throw DZException("Invalid chromosome %s for sample ID %d", chr.c_str(), f);
+
+	size_t i = index->seek(first, last, r.second.first);
+	index_t b = (*index)[index->sortedBlock(i)];
+	if (b.startPos > r.second.first && !intersect(b.startPos, b.endPos, r.second.first, r.second.second)) {
+		throw DZException("Region %s:%d-%d not found for sample ID %d", 	
+			chr.c_str(), r.second.first, r.second.second, f);
+	}
+	q.range = r;
+	q.next = i;
+	q.last = last;
+	q.block.reset();
+	q.selected.clear();
+}
+
+bool FileDecompressor::queryRange (Query &q, const string &range)
+{
+	if (range != "")
+		startRange(q, range);
+	q.block.reset();
+	q.selected.clear();
+
+	// Blocks without records within the range (e.g. the slices before it) are skipped
+	auto &r = q.range;
+	while (q.next < q.last) {
+		size_t k = index->sortedBlock(q.next);
+		index_t b = (*index)[k];
+		if (!intersect(b.fS, b.fE, r.second.first, r.second.second)) {
+			if (b.startPos > r.second.second)
+				break;
+			q.next++;
+			continue;
 		}
-		i++;
-		if (i == idx.end()) {
-			return false;
-		} 
-		return true;
-	} else {
-		return false;
+		q.next++;
+		auto block = decodeBlock(q, k, r.first.second, { r.second });
+		if (!block) 
+			continue;
+		q.block = block;
+		size_t count = selectRecords(*block, { r.second }, q.options, q.selected);
+		// Next blocks are past the range
+		if (block->records.size() && block->records.back().start > r.second.second) 
+			q.next = q.last;
+		if (count)
+			return q.next < q.last;
 	}
+	q.next = q.last;
+	return false;
 }
 
+void FileDecompressor::queryBatch (Query &q, const string &ranges)
+{
+	ZAMAN_START_P(Batch);
+	auto parsed = getRanges(ranges);
+	q.regions.assign(parsed.size(), BlockCache::Block());
+
+	// Regions of each chromosome sorted by start, with the largest end among the regions up to each of them
+	struct Region { size_t start, end, maxEnd, id; };
+	map<pair<int, string>, vector<Region>> regions;
+	for (size_t i = 0; i < parsed.size(); i++) 
+		regions[parsed[i].first].push_back({ parsed[i].second.first, parsed[i].second.second, 0, i });
+	for (auto &c: regions) {
+		auto &rs = c.second;
+		sort(rs.begin(), rs.end(), [](const Region &a, const Region &b) { return a.start < b.start; });
+		for (size_t j = 0; j < rs.size(); j++)
+			rs[j].maxEnd = max(rs[j].end, j ? rs[j - 1].maxEnd : 0);
+	}
 
-inline void FileDecompressor::printRecord(const string &record, int file) 
+	for (auto &bq: planQuery(parsed)) {
+		index_t idx = (*index)[bq.block];
+		auto b = decodeBlock(q, bq.block, bq.chr, bq.regions);
+		if (!b)
+			continue;
+		// Records of the block are within [fS, fE]
+		auto &rs = regions[make_pair(idx.file, bq.chr)];
+		size_t j = lower_bound(rs.begin(), rs.end(), idx.fS, [](const Region &r, size_t p) {
+			return r.maxEnd < p;
+		}) - rs.begin();
+		for (; j < rs.size() && rs[j].start <= idx.fE; j++) {
+			if (rs[j].end < idx.fS)
+				continue;
+			q.selected.clear();
+			selectRecords(*b, { make_pair(rs[j].start, rs[j].end) }, q.options, q.selected);
+			auto &out = q.regions[rs[j].id];
+			out.fields = q.options.fields;
+			out.chr = b->chr;
+			for (auto i: q.selected) {
+				BlockCache::Record r;
+				const char *s[6];
+				getRecord(*b, i, q.options.fields, r, s);
+				out.add(r, s);
+			}
+		}
+	}
+	q.selected.clear();
+	ZAMAN_END_P(Batch);
+}
+
+bool FileDecompressor::decompress2 (const string &range, int filterFlag, bool cont)
 {
-	fputs(record.c_str(), samFiles[file]);
-	fputc('\n', samFiles[file]);
+	if (!apiQuery)
+		apiQuery = make_shared<Query>();
+	apiQuery->options = Options(filterFlag);
+	bool more = queryRange(*apiQuery, cont ? "" : range);
+	for (auto i: apiQuery->selected)
+		printRecord(*apiQuery->block, i, apiQuery->options.fields, apiQuery->range.first.first);
+	return more;
 }
 
+
 inline void FileDecompressor::printComment(int file) 
 {
     fputs(comments[file].c_str(), samFiles[file]);
@@ -2,7 +2,10 @@
 #define Decompress_H
 
 #include "Common.h"
+#include "BoundedQueue.h"
 #include "Stats.h"
+#include "BlockIndex.h"
+#include "BlockCache.h"
 #include "FileIO.h"
 #include "Parsers/BAMParser.h"
 #include "Parsers/SAMParser.h"
@@ -16,6 +19,7 @@
 #include "Fields/OptionalField.h"
 
 #include <map>
+#include <future>
 
 #if __cplusplus <= 199711L
 #include <tr1/unordered_map>
@@ -26,24 +30,103 @@
 extern size_t optBlock;
 extern bool optComment;
 extern bool optOverlap;
+extern int optPrefetch;
+extern int optFields;
 
-struct index_t {
-	size_t startPos, endPos;
-	size_t zpos, currentBlockCount;
-	size_t fS, fE;
-	vector<Array<uint8_t>> fieldData;
-
-	index_t(): fieldData(8) { }
-};
 typedef pair<pair<int, string>, pair<size_t, size_t>> range_t;
 
 class IFileDecompressor {
 public:
    	vector<string> comments;
     virtual bool decompress2(const string &range, int filterFlag, bool cont) = 0;
+    virtual void decompressBatch(const string &ranges, int filterFlag) 
+    {
+    	throw DZException("Batch queries are not supported by this file version");
+    }
+    // Cache of the decoded blocks of the API (none if the file version has no cache)
+    virtual shared_ptr<BlockCache> blockCache(void) 
+    {
+    	return nullptr;
+    }
 };
 
 class FileDecompressor: public IFileDecompressor {
+public:
+	// SAM columns which can be left out of the decompression (see --fields).
+	// RNAME and POS are always decoded
+	enum Field {
+		QNAME = 1 << 0, FLAG = 1 << 1, MAPQ = 1 << 2, CIGAR = 1 << 3, RNEXT = 1 << 4, 
+		PNEXT = 1 << 5, TLEN = 1 << 6, SEQ = 1 << 7, QUAL = 1 << 8, OPT = 1 << 9,
+		ALL = (1 << 10) - 1
+	};
+	static int parseFields (const std::string &fields);
+	// Record i of the decoded block with the given fields (the SAM placeholders for the others left out):
+	// integer fields go to r, and QNAME, CIGAR, RNEXT, SEQ, QUAL and optional fields to s
+	static void getRecord (const BlockCache::Block &b, size_t i, int fields, BlockCache::Record &r, const char *s[6]);
+	// Default capacity of the cache of the decoded blocks of the API
+	static const size_t CacheSize = 256 * MB;
+
+	// Records to decompress: flags to filter by (see -f/-F), SAM columns (see --fields)
+	// and whether the records reaching into a region from before it are included
+	struct Options {
+		int filterFlag, fields;
+		bool overlap;
+
+		Options (int filterFlag = 0, int fields = optFields, bool overlap = optOverlap):
+			filterFlag(filterFlag), fields(fields), overlap(overlap) {}
+	};
+
+private:
+	// Field decompressors of one block
+	struct BlockFields {
+		shared_ptr<SequenceDecompressor> sequence;
+		shared_ptr<EditOperationDecompressor> editOp;
+		shared_ptr<ReadNameDecompressor> readName;
+		shared_ptr<MappingFlagDecompressor> mapFlag;
+		shared_ptr<MappingQualityDecompressor> mapQual;
+		shared_ptr<QualityScoreDecompressor> quality;
+		shared_ptr<PairedEndDecompressor> pairedEnd;
+		shared_ptr<OptionalFieldDecompressor> optField;
+	};
+	// Block which is decoded by the workers, next to the other blocks in flight
+	// (the block being written and up to optPrefetch blocks after it)
+	struct DecodedBlock {
+		int f;
+		std::string chr;
+		size_t filePos;
+		Array<uint8_t> in[8];
+		BlockFields fields;
+		vector<pair<size_t, size_t>> regions;
+		vector<string> output; // formatted records of each formatting thread
+		size_t count;
+		std::promise<void> decoded;
+		std::future<void> done;
+	};
+	// Block of the index with the regions of its chromosome (sorted and disjoint) to format from it
+	struct BlockQuery {
+		size_t block;
+		std::string chr; // empty: chromosome of the block header, or the one of its file
+		vector<pair<size_t, size_t>> regions;
+	};
+
+public:
+	// State of an API query: its options, the cursor of its range, the decoders of each file
+	// (with a reference of their own) and its records. Queries share only the read-only parts
+	// of the file (index, stats, comments) and the cache, so each thread can run its own query
+	struct Query {
+		Options options;
+		range_t range;
+		size_t next, last; // blocks of the range left, within the sorted blocks of its chromosome
+		vector<BlockFields> decoders;
+		vector<BlockCache::Block> parts; // records of each formatting thread of the block being decoded
+		shared_ptr<BlockCache::Block> block; // block of the last call
+		vector<uint32_t> selected; // its records within the range
+		vector<BlockCache::Block> regions; // records of each region of the last batch query
+
+		Query (const Options &options = Options()): options(options), next(0), last(0) {}
+	};
+
+private:
 	vector<SAMComment> samComment;
 	vector<shared_ptr<SequenceDecompressor>> sequence;
 	vector<shared_ptr<EditOperationDecompressor>> editOp;
@@ -56,11 +139,10 @@ class FileDecompressor: public IFileDecompressor {
 
    	vector<string> fileNames;
 	vector<FILE*> samFiles;
-	vector<map<string, map<size_t, index_t>>> indices;
+	shared_ptr<BlockIndex> index;
 
 	shared_ptr<File> inFile;
 	uint32_t magic;
-	gzFile idxFile;
 	
 	string genomeFile;
 	string outFile;
@@ -69,16 +151,19 @@ class FileDecompressor: public IFileDecompressor {
 	size_t statPos;
     size_t blockSize;
     uint16_t numFiles;
-   	vector<int> fileBlockCount;
 
    	bool finishedRange;
+	vector<string> blockOutput; // formatted records of the blocks decoded by getBlock
+	char qualityMode; // settings of the file, passed to its decoders
+	bool bzip;
+	shared_ptr<BlockCache> cache;
+	shared_ptr<Query> apiQuery; // query of decompress2
 
 protected:
 	const bool isAPI; // Ugly; hack for now
     virtual inline void printRecord(const string &rname, int flag, const string &chr, const EditOperation &eo, int mqual,
         const string &qual, const string &optional, const PairedEndInfo &pe, int file, int thread);
 
-	inline void printRecord(const string &record, int file);
     virtual inline void printComment(int file);
 
 public:
@@ -91,18 +176,49 @@ public:
 private:
 	void getMagic (void);
 	void getComment (void);
-	size_t getBlock (int f, const std::string &chromosome, size_t start, size_t end, int filterFlag);
+	size_t getBlock (int f, const std::string &chromosome, const vector<pair<size_t, size_t>> &regions, int filterFlag);
 	void readBlock (Array<uint8_t> &in);
-	void loadIndex (); 
-	vector<range_t> getRanges (std::string range);
+	void readBlock (size_t &pos, Array<uint8_t> &in);
+	bool readChromosome (int f, const std::string &chromosome, std::string &chr);
+	bool readChromosome (SequenceDecompressor &sequence, int f, size_t &pos, const std::string &chromosome, std::string &chr);
+	BlockFields newFields (void);
+	BlockFields newFields (shared_ptr<SequenceDecompressor> sequence);
+	BlockFields fileFields (int f);
+	int neededStreams (const Options &o, bool inOrder);
+	void importFields (BlockFields &d, Array<uint8_t> *in, int streams);
+	void matchMates (BlockFields &d);
+	size_t formatRecords (BlockFields &d, int f, const std::string &chr, const vector<pair<size_t, size_t>> &regions, 
+		const Options &o, vector<string> &output, vector<BlockCache::Block> *parts = nullptr);
+	void writeOutput (int f, const vector<string> &output);
+	bool readBlock (const BlockQuery &q, DecodedBlock &b, int filterFlag);
+	void seekBlock (size_t k);
+	shared_ptr<BlockCache::Block> decodeBlock (Query &q, size_t k, const std::string &chr, 
+		const vector<pair<size_t, size_t>> &regions);
+	size_t selectRecords (const BlockCache::Block &b, const vector<pair<size_t, size_t>> &regions, 
+		const Options &o, vector<uint32_t> &out);
+	void printRecord (const BlockCache::Block &b, size_t i, int fields, int f);
+	void decodeBlocks (const vector<BlockQuery> &blocks, int filterFlag);
+	vector<BlockQuery> planQuery (const vector<range_t> &ranges);
+	void loadIndex (const std::string &inFilePath); 
 
 private: // TODO finish
 	void query (const string &query, const string &range);
 
 public:
+	static vector<range_t> getRanges (std::string range);
 	void decompress (int filterFlag);
 	void decompress (const std::string &range, int filterFlag);
 	bool decompress2 (const string &range, int filterFlag, bool cont);
+	void decompressBatch (const string &ranges, int filterFlag);
+	shared_ptr<BlockCache> blockCache (void) { return cache; }
+
+	// Starts the range query at the first block of the range
+	void startRange (Query &q, const std::string &range);
+	// Starts the range query (or continues it, if the range is empty) and selects the records
+	// of its next block with records (q.block and q.selected). Returns false if the range has no more blocks
+	bool queryRange (Query &q, const std::string &range);
+	// Puts the records of each region into q.regions, decoding the blocks the regions touch once
+	void queryBatch (Query &q, const std::string &ranges);
 };
 
 #endif // Decompress_H
\ No newline at end of file
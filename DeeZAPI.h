@@ -27,6 +27,34 @@ public:
 		string opt;
 	};
 
+	// String within a decoded block
+	struct StringRef {
+		const char *data;
+		size_t size;
+
+		std::string str (void) const { return std::string(data, size); }
+	};
+	// Record of a decoded block (see nextRecords), with the same fields as SAMRecord
+	struct SAMRecordView {
+		StringRef rname;
+		int flag;
+		StringRef chr;
+		unsigned long loc;
+		int mapqual;
+		StringRef cigar;
+		StringRef pchr;
+		unsigned long ploc;
+		int tlen;
+		StringRef seq;
+		StringRef qual;
+		StringRef opt;
+
+		SAMRecord record (void) const {
+			return { rname.str(), flag, chr.str(), loc, mapqual, cigar.str(), pchr.str(), ploc, tlen, 
+				seq.str(), qual.str(), opt.str() };
+		}
+	};
+
 private:
 	class FDv11 : public Legacy::v11::FileDecompressor {
 		std::vector<std::vector<SAMRecord>> &records;
@@ -43,28 +71,69 @@ private:
 		}
 	};
 
-	class FDv20 : public FileDecompressor {
-		std::vector<std::vector<SAMRecord>> &records;
-		virtual inline void printRecord(const string &rname, int flag, const string &chr, const EditOperation &eo, int mqual, const string &qual, const string &optional, const PairedEndInfo &pe, int file, int thread) {
-	    	records[thread].push_back({rname, flag, chr, eo.start, mqual, eo.op, pe.chr, pe.pos, pe.tlen, eo.seq, qual, optional});
-	    }
-	    virtual inline void printComment(int file) {
-	    }
-
-	public:
-		FDv20 (std::vector<std::vector<SAMRecord>> &rec, const std::string &inFile, const std::string &genomeFile = ""):
-			FileDecompressor(inFile, "", genomeFile, optBlock, true), records(rec)
-		{
-		}
-	};
-
-
-	std::vector<std::vector<SAMRecord>> records;
+	std::vector<std::vector<SAMRecord>> records; // records of each thread (DeeZ v1.1 files)
 	std::string prev_range;
 	int prev_filter_flag;
 	
 	shared_ptr<IFileDecompressor> dec;
+	shared_ptr<FileDecompressor> file; // DeeZ v2.0 files
+
+public:
+	// State of the queries of one thread: the position of its range, its decoders and its records.
+	// Threads can query the same DeeZFile at once, each with its own Query
+	// (DeeZ v1.1 files support only the queries without a Query, from one thread)
+	class Query {
+		FileDecompressor::Query query;
+		std::vector<SAMRecordView> views; // records of the block of the query
+		std::vector<SAMRecord> records;
+		std::vector<std::vector<SAMRecord>> regionRecords; // records of each region of a batch query
+		friend class DeeZFile;
+	};
+
+private:
+	Query defaultQuery; // query of the methods without a Query
+
+	static StringRef stringRef (const char *s) {
+		return { s, strlen(s) };
+	}
+
+	// Views of the records selected by the query in its block
+	static void getViews (const FileDecompressor::Query &q, std::vector<SAMRecordView> &out) {
+		out.clear();
+		if (!q.block) {
+			return;
+		}
+		auto &b = *q.block;
+		StringRef chr = { b.chr.c_str(), b.chr.size() };
+		for (auto i: q.selected) {
+			BlockCache::Record r;
+			const char *s[6];
+			FileDecompressor::getRecord(b, i, q.options.fields, r, s);
+			out.push_back({ stringRef(s[0]), r.flag, chr, b.chr != "*" ? r.start + 1 : r.start, (int)r.mapq, 
+				stringRef(s[1]), stringRef(s[2]), r.pnext, r.tlen, stringRef(s[3]), stringRef(s[4]), stringRef(s[5]) });
+		}
+	}
+
+	static void getSAMRecords (const BlockCache::Block &b, std::vector<SAMRecord> &out) {
+		out.clear();
+		out.reserve(b.records.size());
+		for (auto &r: b.records) {
+			const char *s[6];
+			b.strings(r, s);
+			out.push_back({ s[0], r.flag, b.chr, b.chr != "*" ? r.start + 1 : r.start, (int)r.mapq, s[1], 
+				s[2], r.pnext, r.tlen, s[3], s[4], s[5] });
+		}
+	}
 
+	void checkQuery (void) {
+		if (!file) {
+			throw DZException("Queries are not supported by this file version");
+		}
+	}
+
+	static FileDecompressor::Options queryOptions (int filterFlag, bool overlap, const std::string &fields) {
+		return FileDecompressor::Options(filterFlag, FileDecompressor::parseFields(fields), overlap);
+	}
 
 public:
 	DeeZFile (const std::string &inFile, const std::string &genomeFile = ""):
@@ -80,7 +149,8 @@ public:
 			LOG("Using old DeeZ v1.1 engine");
 			dec = make_shared<FDv11>(records, inFile, genomeFile);
 		} else {
-			dec = make_shared<FDv20>(records, inFile, genomeFile);
+			this->file = make_shared<FileDecompressor>(inFile, "", genomeFile, optBlock, true);
+			dec = this->file;
 		}
 
 	}
@@ -94,6 +164,25 @@ public:
 		optLogLevel = level;
 	}
 
+	// Capacity of the cache of the decoded blocks in bytes (0 disables it).
+	// Supported only by DeeZ v2.0 files
+	void setCacheSize (size_t bytes) {
+		auto cache = dec->blockCache();
+		if (!cache) {
+			throw DZException("Block cache is not supported by this file version");
+		}
+		cache->resize(bytes);
+	}
+
+	// Hits, misses and evictions of the cache, and its size
+	BlockCache::Statistics getCacheStatistics () {
+		auto cache = dec->blockCache();
+		if (!cache) {
+			throw DZException("Block cache is not supported by this file version");
+		}
+		return cache->statistics();
+	}
+
 	int getFileCount () {
 		return dec->comments.size();
 	}
@@ -105,22 +194,106 @@ public:
 		return dec->comments[file];
 	}
 
-	std::vector<SAMRecord> &getRecords (const std::string &range = "", int filterFlag = 0, bool overlap = true) {
+	// Records of the range, one block at a time: the first call gives the range,
+	// and each call with an empty range gives the records of the next block of the range.
+	// fields: comma-separated SAM columns to decompress (all if empty); see --fields.
+	// Fields are supported only by DeeZ v2.0 files
+	std::vector<SAMRecord> &getRecords (const std::string &range = "", int filterFlag = 0, bool overlap = true, 
+		const std::string &fields = "") 
+	{
+		if (file) {
+			return getRecords(defaultQuery, range, filterFlag, overlap, fields);
+		}
+
 		for (auto &r: records)
 			r.clear();
-
 		optOverlap = overlap;
+		optFields = FileDecompressor::parseFields(fields);
 		if (range != "") {
 			prev_range = range;
 			prev_filter_flag = filterFlag;
 			dec->decompress2(prev_range, prev_filter_flag, false);
 		} else {
 			dec->decompress2(prev_range, prev_filter_flag, true);
-			for (size_t i = 1; i < records.size(); i++)
-				records[0].insert(records[0].end(), records[i].begin(), records[i].end());
 		}
+		for (size_t i = 1; i < records.size(); i++)
+			records[0].insert(records[0].end(), records[i].begin(), records[i].end());
 		return records[0];
 	}
+
+	// Same as above, within the query of the calling thread (continued with an empty range).
+	// Supported only by DeeZ v2.0 files
+	std::vector<SAMRecord> &getRecords (Query &q, const std::string &range = "", int filterFlag = 0, 
+		bool overlap = true, const std::string &fields = "") 
+	{
+		if (range != "") {
+			startQuery(q, range, filterFlag, overlap, fields);
+		}
+		auto &views = nextRecords(q);
+		q.records.clear();
+		q.records.reserve(views.size());
+		for (auto &v: views) 
+			q.records.push_back(v.record());
+		return q.records;
+	}
+
+	// Starts the range query; its records are then read with nextRecords.
+	// Supported only by DeeZ v2.0 files
+	void startQuery (Query &q, const std::string &range, int filterFlag = 0, bool overlap = true, 
+		const std::string &fields = "") 
+	{
+		checkQuery();
+		q.query.options = queryOptions(filterFlag, overlap, fields);
+		file->startRange(q.query, range);
+		q.views.clear();
+	}
+
+	void startQuery (const std::string &range, int filterFlag = 0, bool overlap = true, const std::string &fields = "") {
+		startQuery(defaultQuery, range, filterFlag, overlap, fields);
+	}
+
+	// Records of the next block of the query with records within its range (none at the end of the range).
+	// Views point into the decoded block, which the query holds until the next call:
+	// the memory of a query is bounded by a block, whatever the size of its range
+	const std::vector<SAMRecordView> &nextRecords (Query &q) {
+		checkQuery();
+		file->queryRange(q.query, "");
+		getViews(q.query, q.views);
+		return q.views;
+	}
+
+	const std::vector<SAMRecordView> &nextRecords (void) {
+		return nextRecords(defaultQuery);
+	}
+
+	// Records of each of the regions, with the blocks of overlapping or nearby regions decoded once.
+	// A record which falls into several regions is in the records of each of them.
+	// Supported only by DeeZ v2.0 files
+	std::vector<std::vector<SAMRecord>> &getRecords (const std::vector<std::string> &ranges, int filterFlag = 0, 
+		bool overlap = true, const std::string &fields = "") 
+	{
+		return getRecords(defaultQuery, ranges, filterFlag, overlap, fields);
+	}
+
+	// Same as above, within the query of the calling thread
+	std::vector<std::vector<SAMRecord>> &getRecords (Query &q, const std::vector<std::string> &ranges, int filterFlag = 0, 
+		bool overlap = true, const std::string &fields = "") 
+	{
+		checkQuery();
+		std::string batch;
+		for (auto &r: ranges) {
+			if (r.find(';') != std::string::npos)
+				throw DZException("Regions of a batch query are given one per string");
+			batch += r + ";";
+		}
+		q.query.options = queryOptions(filterFlag, overlap, fields);
+		file->queryBatch(q.query, batch);
+		q.regionRecords.resize(q.query.regions.size());
+		for (size_t i = 0; i < q.regionRecords.size(); i++)
+			getSAMRecords(q.query.regions[i], q.regionRecords[i]);
+		q.query.regions.clear();
+		return q.regionRecords;
+	}
 };
 
 #endif // DeeZAPI_H
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define StringEngine_H
 
 #include <string>
+#include <atomic>
 #include "../Common.h"
 #include "GenericEngine.h"
 
@@ -10,7 +11,9 @@ class StringCompressor:
 	public GenericCompressor<std::string, TStream> 
 {
 protected:
-	size_t totalSize;
+	// Estimate of the buffer needed for the records which are still not compressed.
+	// Updated both by the parsing threads and by the compression stage
+	std::atomic<size_t> totalSize;
 
 public:
 	StringCompressor (void);
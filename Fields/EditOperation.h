@@ -26,6 +26,7 @@ struct EditOperation
 
 	EditOperation(): NM(-1) {}
 	EditOperation(size_t s, const std::string &se, const std::string &op);
+	void reset(size_t s, const char *se, size_t seLen, const char *cigar, size_t cigarLen);
 
 	void calculateTags(Reference &reference);
 };
@@ -76,7 +77,7 @@ class EditOperationDecompressor:
 	ACTGStream nucleotides[3];
 
 public:
-	EditOperationDecompressor(int blockSize, const SequenceDecompressor &seq);
+	EditOperationDecompressor(int blockSize, const SequenceDecompressor &seq, bool bzip);
 
 public:
 	void importRecords (uint8_t *in, size_t in_size);
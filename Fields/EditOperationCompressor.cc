@@ -1,12 +1,28 @@
 #include "EditOperation.h"
 #include "Sequence.h"
+#include "MDKernel.h"
 #include "../Streams/rANSOrder2Stream.h"
 
 using namespace std;
 
 EditOperation::EditOperation(size_t s, const std::string &se, const std::string &op) :
-	start(s), end(s), seq(se), NM(-1), ops(2, op.size() / 2), op(op)
+	NM(-1), ops(2, op.size() / 2)
 {
+	reset(s, se.c_str(), se.size(), op.c_str(), op.size());
+}
+
+// Re-initializes a recycled edit operation in place.
+// Strings and ops keep their storage, so parsing a block does not allocate per record
+void EditOperation::reset(size_t s, const char *se, size_t seLen, const char *cigar, size_t cigarLen)
+{
+	start = end = s;
+	seq.assign(se, seLen);
+	op.assign(cigar, cigarLen);
+	MD.clear();
+	NM = -1;
+	ops.resize(0);
+	ops.set_extend(op.size() / 2 + 1); // upper bound of the operation count; used only if ops has to grow
+
 	if (op == "*") {
 		ops.add(make_pair('*', 0));
 		return;
@@ -45,6 +61,8 @@ EditOperation::EditOperation(size_t s, const std::string &se, const std::string
 void EditOperation::calculateTags(Reference &reference) 
 {
 	ZAMAN_START(CalculateMDNM);
+	static const MDKernel::Kernel kernel = MDKernel::best();
+	char chunk[1024];
 	NM = 0;
 	size_t mdOperLen = 0, seqPos = 0, genPos = start;
 	for (auto &op: ops) {
@@ -52,14 +70,12 @@ void EditOperation::calculateTags(Reference &reference)
 		case 'M':
 		case '=':
 		case 'X':
-			for (size_t i = 0; i < op.second; i++, seqPos++, genPos++) {
-				if (reference[genPos] != seq[seqPos]) {
-					inttostr(mdOperLen, MD), mdOperLen = 0;
-					MD += reference[genPos];
-					NM++;
-				} else {
-					mdOperLen++;
-				}
+			// reference is compared in chunks, as mapped or packed references are not contiguous
+			for (size_t i = 0; i < op.second; ) {
+				size_t len = min(op.second - i, sizeof(chunk));
+				MDKernel::alignedRun(kernel, reference.bases(genPos, len, chunk), seq.c_str() + seqPos, len, 
+					mdOperLen, MD, NM);
+				i += len, seqPos += len, genPos += len;
 			}
 			break;
 		case 'D':
@@ -2,14 +2,14 @@
 #include "Sequence.h"
 using namespace std;
 
-EditOperationDecompressor::EditOperationDecompressor (int blockSize, const SequenceDecompressor &seq):
+EditOperationDecompressor::EditOperationDecompressor (int blockSize, const SequenceDecompressor &seq, bool bzip):
 	GenericDecompressor<EditOperation, GzipDecompressionStream>(blockSize),
 	sequence(seq)
 {
 	streams.resize(EditOperationCompressor::Fields::ENUM_COUNT);
 	for (int i = 0; i < streams.size(); i++)
 		streams[i] = make_shared<GzipDecompressionStream>();
-	if (optBzip) {
+	if (bzip) {
 		streams[EditOperationCompressor::Fields::OPCODES] = make_shared<BzipDecompressionStream>();
 		streams[EditOperationCompressor::Fields::ACGT_U] = make_shared<BzipDecompressionStream>();
 	}
@@ -119,9 +119,8 @@ inline EditOperation EditOperationDecompressor::getEditOperation (size_t loc, ve
 		eo.end += endPos - prevLoc;
 	}
 
-	return eo;
-
 	ZAMAN_END(GetEO);
+	return eo;
 }
 
 EditOperation &EditOperationDecompressor::getRecord(size_t i) 
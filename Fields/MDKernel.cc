@@ -0,0 +1,95 @@
+#include "MDKernel.h"
+
+#include <smmintrin.h>
+#include <immintrin.h>
+using namespace std;
+
+uint64_t MDKernel::scalar (const char *ref, const char *seq, size_t len)
+{
+	uint64_t mask = 0;
+	for (size_t i = 0; i < len; i++)
+		mask |= uint64_t(ref[i] != seq[i]) << i;
+	return mask;
+}
+
+// Mismatches of 16 bases
+static inline uint64_t differ16 (const char *ref, const char *seq)
+{
+	__m128i r = _mm_loadu_si128((const __m128i*)ref);
+	__m128i s = _mm_loadu_si128((const __m128i*)seq);
+	return ~_mm_movemask_epi8(_mm_cmpeq_epi8(r, s)) & 0xffff;
+}
+
+uint64_t MDKernel::sse41 (const char *ref, const char *seq, size_t len)
+{
+	if (len < 16)
+		return scalar(ref, seq, len);
+	uint64_t mask = 0;
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16)
+		mask |= differ16(ref + i, seq + i) << i;
+	// last bases are compared together with some of the previous ones, so nothing is read past the end
+	if (i < len)
+		mask |= differ16(ref + len - 16, seq + len - 16) << (len - 16);
+	return mask;
+}
+
+__attribute__((target("avx2")))
+uint64_t MDKernel::avx2 (const char *ref, const char *seq, size_t len)
+{
+	if (len < 16)
+		return scalar(ref, seq, len);
+	uint64_t mask = 0;
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i r = _mm256_loadu_si256((const __m256i*)(ref + i));
+		__m256i s = _mm256_loadu_si256((const __m256i*)(seq + i));
+		mask |= uint64_t(~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(r, s))) << i;
+	}
+	if (i + 16 <= len) {
+		mask |= differ16(ref + i, seq + i) << i;
+		i += 16;
+	}
+	if (i < len)
+		mask |= differ16(ref + len - 16, seq + len - 16) << (len - 16);
+	return mask;
+}
+
+MDKernel::Kernel MDKernel::best (void)
+{
+	// SSE4.1 is the baseline of the build (-msse4.1)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") ? avx2 : sse41;
+}
+
+void MDKernel::alignedRun (Kernel kernel, const char *ref, const char *seq, size_t len,
+	size_t &mdOperLen, string &MD, int &NM)
+{
+	for (size_t i = 0; i < len; i += 64) {
+		size_t n = min(len - i, size_t(64)), last = 0;
+		// shorter tails are compared 16 bases at a time, where AVX2 does not pay off
+		uint64_t mask = (n == 64 ? kernel : sse41)(ref + i, seq + i, n);
+		NM += __builtin_popcountll(mask);
+		for (; mask; mask &= mask - 1) {
+			size_t j = __builtin_ctzll(mask);
+			inttostr(mdOperLen + j - last, MD);
+			MD += ref[i + j];
+			mdOperLen = 0, last = j + 1;
+		}
+		mdOperLen += n - last;
+	}
+}
+
+void MDKernel::alignedRunScalar (const char *ref, const char *seq, size_t len,
+	size_t &mdOperLen, string &MD, int &NM)
+{
+	for (size_t i = 0; i < len; i++) {
+		if (ref[i] != seq[i]) {
+			inttostr(mdOperLen, MD), mdOperLen = 0;
+			MD += ref[i];
+			NM++;
+		} else {
+			mdOperLen++;
+		}
+	}
+}
@@ -0,0 +1,31 @@
+#ifndef MDKernel_H
+#define MDKernel_H
+
+#include "../Common.h"
+
+#include <string>
+
+// MD and NM of the aligned (M, = and X) parts of a record.
+// Bases are compared 16 (SSE4.1) or 32 (AVX2) at a time into bitmasks of mismatches,
+// so MD is only appended to at the mismatches, which are taken from the masks one set bit at a time.
+namespace MDKernel {
+	// Bit i of the result is set if ref[i] != seq[i], for i < len <= 64
+	typedef uint64_t (*Kernel) (const char *ref, const char *seq, size_t len);
+
+	uint64_t scalar (const char *ref, const char *seq, size_t len);
+	uint64_t sse41 (const char *ref, const char *seq, size_t len);
+	uint64_t avx2 (const char *ref, const char *seq, size_t len);
+	// AVX2 kernel if the CPU supports it, SSE4.1 otherwise
+	Kernel best (void);
+
+	// Appends the run of len aligned bases to MD and adds its mismatches to NM.
+	// The kernel compares the full 64 bases chunks of the run, SSE4.1 the rest.
+	// mdOperLen is the count of the matches which are not yet in MD
+	void alignedRun (Kernel kernel, const char *ref, const char *seq, size_t len,
+		size_t &mdOperLen, std::string &MD, int &NM);
+	// Same as above, one base at a time
+	void alignedRunScalar (const char *ref, const char *seq, size_t len,
+		size_t &mdOperLen, std::string &MD, int &NM);
+}
+
+#endif // MDKernel_H
@@ -42,10 +42,10 @@ class MappingFlagDecompressor:
 	public GenericDecompressor<uint16_t, GzipDecompressionStream> 
 {
 public:
-	MappingFlagDecompressor (int blockSize): 
+	MappingFlagDecompressor (int blockSize, bool bzip): 
 		GenericDecompressor<uint16_t, GzipDecompressionStream>(blockSize)
 	{
-		if (optBzip) {
+		if (bzip) {
 			streams[0] = make_shared<BzipDecompressionStream>();
 		}
 	}
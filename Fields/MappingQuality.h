@@ -42,10 +42,10 @@ class MappingQualityDecompressor:
 	public GenericDecompressor<uint8_t, GzipDecompressionStream> 
 {
 public:
-	MappingQualityDecompressor (int blockSize): 
+	MappingQualityDecompressor (int blockSize, bool bzip): 
 		GenericDecompressor<uint8_t, GzipDecompressionStream>(blockSize)
 	{
-		if (optBzip) {
+		if (bzip) {
 			streams[0] = make_shared<BzipDecompressionStream>();
 		}
 	}
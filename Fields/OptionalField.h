@@ -36,16 +36,19 @@ inline string keyStr(int f)
 }
 
 struct OptionalField {
-	string data;
-	Array<pair<int, int>> keys; // Tag, Position | Int
+	string data; // tags of the record, encoded in place; input lines are never modified
+	Array<pair<int, int>> keys; // Tag, Position within data | Int
 
-	OptionalField(): keys(50, 100) 
+	// Keys are allocated on first use; fields are recycled with their block,
+	// so the storage is reused by the following blocks
+	OptionalField()
 	{
+		keys.set_extend(50);
 	}
 	
 	void parse1 (const char *rec, const char *recEnd, 
 		std::unordered_map<int32_t, std::map<std::string, int>> &library);
-	void parse(char *rec, const EditOperation &eo, 
+	void parse(const EditOperation &eo, 
 		std::unordered_map<int32_t, std::map<std::string, int>> &library);
 
 public:
@@ -64,6 +67,7 @@ class OptionalFieldCompressor:
 	vector<Array<uint8_t>*> oa;
 	std::condition_variable condition;
 	std::mutex conditionMutex;
+	bool keysReady; // set by outputRecords, consumed by compressThreads
 	Array<int32_t> idxToKey;
 
 public:
@@ -80,14 +84,14 @@ public:
 public:
 	void outputRecords (const Array<Record> &records, Array<uint8_t> &out, size_t out_offset, size_t k, 
 		const Array<OptionalField> &optFields, std::unordered_map<int32_t, std::map<std::string, int>> &library);
-	void compressThreads(Array<Array<uint8_t>> &outT, ctpl::thread_pool &pool);
+	void compressThreads(Array<Array<uint8_t>> &outT, TaskGroup &tasks);
 	//void getIndexData (Array<uint8_t> &out);
 
 	void printDetails(void);
 	size_t compressedSize(void);
 
 private:
-	int processFields(const char *rec, std::vector<Array<uint8_t>*> &out,
+	int processFields(std::vector<Array<uint8_t>*> &out,
 		Array<uint8_t> &tags, const OptionalField &of, size_t k);
 
 public:
@@ -113,17 +117,20 @@ class OptionalFieldDecompressor:
 
 	std::condition_variable condition;
 	std::mutex conditionMutex;
+	bool keysReady; // set by importRecords, consumed by decompressThreads
 	uint8_t *inputBuffer;
+	bool bzip; // of the file, as fields streams are created while decoding
 
 public:
-	OptionalFieldDecompressor (int blockSize);
+	OptionalFieldDecompressor (int blockSize, bool bzip);
 	
 public:
 	void getRecord(size_t i, const EditOperation &eo, std::string &record);
 	void importRecords (uint8_t *in, size_t in_size);
-	void decompressThreads(ctpl::thread_pool &pool);
+	void decompressThreads(TaskGroup &tasks);
 
 private:
+	void setKeysReady (void);
 	OptionalField parseFields(uint8_t *&tags, uint8_t *&in);
 };
 
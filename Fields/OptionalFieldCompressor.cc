@@ -27,7 +27,8 @@ OptionalFieldCompressor::OptionalFieldCompressor(void):
 	StringCompressor<GzipCompressionStream<6>>(),
 	fields(AlphabetRange * AlphabetRange * AlphabetRange, -1),
 	prevIndex(AlphabetRange * AlphabetRange * AlphabetRange),
-	fieldCount(0)
+	fieldCount(0),
+	keysReady(false)
 {
 	streams.resize(Fields::ENUM_COUNT);
 	if (optBzip) {
@@ -85,11 +86,12 @@ void OptionalFieldCompressor::outputRecords (const Array<Record> &records, Array
 
 	oa.resize(0);
 	Array<uint8_t> buffer(k * 10, MB);
+	size_t used = 0;
 	for (size_t i = 0; i < k; i++) {
-		int size = processFields(records[i].getOptional(), 
-			oa, buffer, optFields[i], k);
-		totalSize -= records[i].getOptionalSize() + 1;
+		int size = processFields(oa, buffer, optFields[i], k);
+		used += records[i].getOptionalSize() + 1;
 	}
+	totalSize -= used;
 
 	ZAMAN_START(Index);
 	compressArray(streams[Fields::TAG], lib, out, out_offset);
@@ -116,6 +118,10 @@ void OptionalFieldCompressor::outputRecords (const Array<Record> &records, Array
 			}
 		}
 	}
+	{
+		unique_lock<std::mutex> lock(conditionMutex);
+		keysReady = true;
+	}
 	condition.notify_all();
 
 	ZAMAN_END(Keys);
@@ -126,15 +132,18 @@ void OptionalFieldCompressor::outputRecords (const Array<Record> &records, Array
 	ZAMAN_END(OptionalFieldOutput);
 }
 
-void OptionalFieldCompressor::compressThreads(Array<Array<uint8_t>> &outT, ctpl::thread_pool &pool)
+void OptionalFieldCompressor::compressThreads(Array<Array<uint8_t>> &outT, TaskGroup &tasks)
 {
 	unique_lock<std::mutex> lock(conditionMutex);
-    condition.wait(lock);
+	condition.wait(lock, [&] { return keysReady; });
+	keysReady = false;
 
    	ZAMAN_START(OptionalFieldOutput);
    	outT.resize(oa.size());
 	for (int i = 0; i < oa.size(); i++) {
-		pool.push([&](int T, int ti, int key, shared_ptr<CompressionStream> stream) {
+		int ti = i, key = idxToKey[i];
+		auto stream = fieldStreams[idxToKey[i]];
+		tasks.run([&, ti, key, stream]() {
 			ZAMAN_START(OptionalFieldOutput_Keys_C);
 			#ifdef ZAMAN
 				__zaman_thread__.prefix = __zaman_thread__.prefix.substr(0, __zaman_thread__.prefix.size() - 2) + keyStr(key);
@@ -149,16 +158,16 @@ void OptionalFieldCompressor::compressThreads(Array<Array<uint8_t>> &outT, ctpl:
 			#ifdef ZAMAN
 				__zaman_thread__.prefix = __zaman_thread__.prefix.substr(0, __zaman_thread__.prefix.size() - 3 + 2);
 			#endif
-			ZAMAN_THREAD_JOIN();
-		}, i, idxToKey[i], fieldStreams[idxToKey[i]]);
+		}, ti);
 	}
 	ZAMAN_END(OptionalFieldOutput);
 }
 
-int OptionalFieldCompressor::processFields (const char *rec, vector<Array<uint8_t>*> &out,
+int OptionalFieldCompressor::processFields (vector<Array<uint8_t>*> &out,
 	 Array<uint8_t> &tags, const OptionalField &of, size_t k)
 {
 	ZAMAN_START(ParseFields);
+	const char *rec = of.data.c_str();
 	int pi = -1, pk = 0;
 	for (auto &kv: of.keys) {
 		int key = kv.first;
@@ -203,6 +212,10 @@ int OptionalFieldCompressor::processFields (const char *rec, vector<Array<uint8_
 void OptionalField::parse1 (const char *rec, const char *recEnd, unordered_map<int32_t, map<string, int>> &library)
 {
 	//ZAMAN_START(OptionalField);
+	// Tags are copied (their storage is reused with the field) and separated by \0
+	data.assign(rec, recEnd - rec);
+	replace(data.begin(), data.end(), '\t', '\0');
+	rec = data.c_str(), recEnd = rec + data.size();
 	keys.resize(0);
 	for (const char *recStart = rec; rec < recEnd; rec++) {
 		if (recEnd - rec < 5 || rec[2] != ':' || rec[4] != ':') {
@@ -251,9 +264,10 @@ void OptionalField::parse1 (const char *rec, const char *recEnd, unordered_map<i
 	//ZAMAN_END(OptionalField);
 }
 
-void OptionalField::parse(char *rec, const EditOperation &eo, unordered_map<int32_t, map<string, int>> &library)
+void OptionalField::parse(const EditOperation &eo, unordered_map<int32_t, map<string, int>> &library)
 {
 	ZAMAN_START(OptionalField);
+	char *rec = &data[0];
 	for (auto &kv: keys) {
 		int key = kv.first;
 		char type = kv.first % AlphabetRange + AlphabetStart;
@@ -3,13 +3,15 @@
 #include "../Streams/rANSOrder2Stream.h"
 using namespace std;
 
-OptionalFieldDecompressor::OptionalFieldDecompressor (int blockSize):
+OptionalFieldDecompressor::OptionalFieldDecompressor (int blockSize, bool bzip):
 	GenericDecompressor<OptionalField, GzipDecompressionStream>(blockSize),
 	fields(AlphabetRange * AlphabetRange * AlphabetRange, -1),
-	prevIndex(AlphabetRange * AlphabetRange * AlphabetRange)
+	prevIndex(AlphabetRange * AlphabetRange * AlphabetRange),
+	keysReady(false),
+	bzip(bzip)
 {
 	streams.resize(OptionalFieldCompressor::Fields::ENUM_COUNT);
-	if (optBzip) {
+	if (bzip) {
 		for (int i = 0; i < streams.size(); i++)
 			streams[i] = make_shared<BzipDecompressionStream>();	
 	} else {
@@ -20,7 +22,14 @@ OptionalFieldDecompressor::OptionalFieldDecompressor (int blockSize):
 
 void OptionalFieldDecompressor::importRecords (uint8_t *in, size_t in_size) 
 {
-	if (in_size == 0) return;
+	if (in_size == 0) {
+		data.clear();
+		dataLoc.clear();
+		positions.clear();
+		records.resize(0);
+		setKeysReady();
+		return;
+	}
 
 	ZAMAN_START(OptionalField);
 
@@ -53,7 +62,7 @@ void OptionalFieldDecompressor::importRecords (uint8_t *in, size_t in_size)
 	while (tags != index.data() + index.size()) {
 		records.add(parseFields(tags, in));
 	}
-	condition.notify_all();
+	setKeysReady();
 
 	ZAMAN_END(OptionalField);
 }
@@ -75,7 +84,7 @@ inline OptionalField OptionalFieldDecompressor::parseFields(uint8_t *&tags, uint
 			if (fieldStreams.find(key) == fieldStreams.end()) {
 				if (OptionalFieldCompressor::QualityTags.find(key) != OptionalFieldCompressor::QualityTags.end()) {
 					fieldStreams[key] = make_shared<rANSOrder2DecompressionStream<128>>();
-				} else if (optBzip) {
+				} else if (bzip) {
 					fieldStreams[key] = make_shared<BzipDecompressionStream>();	
 				} else {
 					fieldStreams[key] = make_shared<GzipDecompressionStream>();
@@ -94,19 +103,33 @@ inline OptionalField OptionalFieldDecompressor::parseFields(uint8_t *&tags, uint
 	return of;
 }
 
-void OptionalFieldDecompressor::decompressThreads(ctpl::thread_pool &pool)
+void OptionalFieldDecompressor::setKeysReady (void)
+{
+	{
+		unique_lock<std::mutex> lock(conditionMutex);
+		keysReady = true;
+	}
+	condition.notify_all();
+}
+
+void OptionalFieldDecompressor::decompressThreads(TaskGroup &tasks)
 {
 	unique_lock<std::mutex> lock(conditionMutex);
-    condition.wait(lock);
+	condition.wait(lock, [&] { return keysReady; });
+	keysReady = false;
 
 	for (int i = 0; i < data.size(); i++) {
-		pool.push([&](int T, int ti, int key, shared_ptr<DecompressionStream> stream, uint8_t *in) {
+		int ti = i, key = fields[i];
+		auto stream = fieldStreams[fields[i]];
+		uint8_t *in = inputBuffer;
+		tasks.run([&, ti, key, stream, in]() {
 			ZAMAN_START(OptionalField_C);
 			#ifdef ZAMAN
 				__zaman_thread__.prefix = __zaman_thread__.prefix.substr(0, __zaman_thread__.prefix.size() - 2) + keyStr(key);
 			#endif
 
-			decompressArray(stream, in, data[ti]);
+			uint8_t *buffer = in;
+			decompressArray(stream, buffer, data[ti]);
 			int type = key % AlphabetRange + AlphabetStart;
 			if (type > 'A' && type <= 'Z') {
 				dataLoc[ti].add(0);
@@ -120,8 +143,7 @@ void OptionalFieldDecompressor::decompressThreads(ctpl::thread_pool &pool)
 			#ifdef ZAMAN
 				__zaman_thread__.prefix = __zaman_thread__.prefix.substr(0, __zaman_thread__.prefix.size() - 3 + 2);
 			#endif
-			ZAMAN_THREAD_JOIN();
-		}, i, fields[i], fieldStreams[fields[i]], inputBuffer);
+		}, ti);
 		
 		size_t in_sz = *(size_t*)inputBuffer;
 		inputBuffer += 2 * sizeof(size_t) + in_sz;
@@ -55,7 +55,7 @@ class PairedEndDecompressor:
 	public GenericDecompressor<PairedEndInfo, GzipDecompressionStream> 
 {
 public:
-	PairedEndDecompressor (int blockSize);
+	PairedEndDecompressor (int blockSize, bool bzip);
 	
 public:
 	void importRecords (uint8_t *in, size_t in_size);
@@ -1,5 +1,6 @@
 #include "PairedEnd.h"
 #include <unordered_map>
+#include <atomic>
 using namespace std;
 
 PairedEndInfo::PairedEndInfo (const std::string &c, size_t pos, int32_t t, size_t opos, size_t ospan, bool reverse):
@@ -63,7 +64,7 @@ void PairedEndCompressor::outputRecords (const Array<Record> &records, Array<uin
 
 	Array<uint8_t> ptrs(k * 4, MB);
 
-	static size_t _valid = 0, _total = 0;
+	static std::atomic<size_t> _valid(0), _total(0);
 	unordered_map<string, char> chromosomeIndex;
 	for (size_t i = 0; i < k; i++) {
 		tlenBits.add(pairedEndInfos[i].bit);
@@ -2,11 +2,11 @@
 #include <unordered_map>
 using namespace std;
 
-PairedEndDecompressor::PairedEndDecompressor (int blockSize):
+PairedEndDecompressor::PairedEndDecompressor (int blockSize, bool bzip):
 	GenericDecompressor<PairedEndInfo, GzipDecompressionStream>(blockSize)
 {
 	streams.resize(PairedEndCompressor::Fields::ENUM_COUNT);
-	if (optBzip) {
+	if (bzip) {
 		for (int i = 0; i < streams.size(); i++)
 			streams[i] = make_shared<BzipDecompressionStream>();	
 	} else {
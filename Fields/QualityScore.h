@@ -37,19 +37,19 @@ public:
 
 public:
 	void addRecord (const std::string &qual, int flag);
-	void outputRecords (const Array<Record> &records, Array<uint8_t> &out, size_t out_offset, size_t k);
-	static size_t shrink(char *qual, size_t len, int flag);
+	void outputRecords (const Array<Record> &records, Array<uint8_t> &out, size_t out_offset, size_t k, char blockOffset);
+	static size_t shrink(const char *qual, size_t len, int flag);
 
 	int getOffset(void);
 	void updateOffset(int *st);
 	void calculateOffset (void);
-	void offsetRecord (Record &rc);
+	void resetOffset (void);
 
 	
 private:
 	static double phredScore (char c, int offset);
 	void calculateLossyTable (int percentage);
-	void lossyTransform (char *qual, size_t len);
+	char offsetScore (char q, char offset) const;
 };
 
 class QualityScoreDecompressor: 
@@ -57,14 +57,22 @@ class QualityScoreDecompressor:
 {
 	char offset;
 	char sought;
+	char mode; // quality mode of the file (optQuality when it was compressed)
 
 public:
-	QualityScoreDecompressor (int blockSize);
+	QualityScoreDecompressor (int blockSize, char mode);
 
 public:
 	std::string getRecord (size_t i, size_t seq_len, int flag);
+	void getRecord (size_t i, size_t seq_len, int flag, std::string &record);
 	void importRecords (uint8_t *in, size_t in_size);
 	void setIndexData (uint8_t *in, size_t in_size);
+	// sam_comp models adapt over all blocks and are not stored in the index;
+	// blocks decoded apart continue with the models of q instead
+	bool hasIndexData (void) const { return mode != 1; }
+	void shareModels (const QualityScoreDecompressor &q) { streams = q.streams; }
+	// Blocks cannot be skipped if the models continue from the previous block
+	bool adaptsOverBlocks (void) const { return mode != 0 && sought != 2; }
 };
 
 #endif
@@ -29,24 +29,21 @@ QualityScoreCompressor::QualityScoreCompressor(void):
 	LOG("Using quality mode %s", qualities[optQuality]);
 }
 
-size_t QualityScoreCompressor::shrink(char *qual, size_t len, int flag)
+// Size of the stored qualities: they are reversed for the reverse strand records
+// and the trailing run of the same score is kept only once
+size_t QualityScoreCompressor::shrink(const char *qual, size_t len, int flag)
 {
-	if (!len || (len == 1 && qual[0] == '*')) {
-		*qual = 0;
+	if (!len || (len == 1 && qual[0] == '*'))
 		return 0;
-	}
-
-	if (flag & 0x10) for (size_t j = 0; j < len / 2; j++)
-		swap(qual[j], qual[len - j - 1]);
 
+	auto at = [&](size_t j) { return (flag & 0x10) ? qual[len - j - 1] : qual[j]; };
 	ssize_t sz = len;
 	if (sz >= 2) {
 		sz -= 2;
-		while (sz && qual[sz] == qual[len - 1])
+		while (sz && at(sz) == at(len - 1))
 			sz--;
 		sz += 2;
 	}
-	qual[sz] = 0;
 	assert(sz > 0);
 	return sz;
 }
@@ -85,38 +82,44 @@ void QualityScoreCompressor::calculateOffset()
 	} 
 }
 
-void QualityScoreCompressor::offsetRecord (Record &rc)
+void QualityScoreCompressor::resetOffset()
 {
-	assert(offset);
-	char *qual = (char*)rc.getQuality();
-	lossyTransform(qual, strlen(qual));
-	while (*qual) {
-		if (*qual < offset)
-			throw DZException("Quality scores out of range with L offset %d [%c]", offset, *qual);
-		*qual = (*qual - offset) + 1;
-		if (*qual >= QualRange)
-			throw DZException("Quality scores out of range with R offset %d [%c]", offset, *qual + offset - 1);
-		qual++;
-	}
+	memset(stat, 0, 128 * sizeof(int));
+	offset = 0;
+}
+
+char QualityScoreCompressor::offsetScore (char q, char offset) const
+{
+	if (optLossy && !statMode)
+		q = lossy[q];
+	if (q < offset)
+		throw DZException("Quality scores out of range with L offset %d [%c]", offset, q);
+	q = (q - offset) + 1;
+	if (q >= QualRange)
+		throw DZException("Quality scores out of range with R offset %d [%c]", offset, q + offset - 1);
+	return q;
 }
 
-void QualityScoreCompressor::outputRecords (const Array<Record> &records, Array<uint8_t> &out, size_t out_offset, size_t k) 
+// Offset is calculated per block; the caller resets it after the block has been parsed.
+// Records are not modified: their qualities are shrunk and offset while they are copied to the buffer
+void QualityScoreCompressor::outputRecords (const Array<Record> &records, Array<uint8_t> &out, size_t out_offset, size_t k, char blockOffset) 
 {
 	ZAMAN_START(QualityScoreOutput);
 	
-	out.add(offset); out_offset++;
+	out.add(blockOffset); out_offset++;
 
 	Array<uint8_t> buffer(totalSize, MB);
 	for (size_t i = 0; i < k; i++) {
 		const char *q = records[i].getQuality();
-		while (*q)
-			buffer.add(*q), q++;
+		size_t len = records[i].getQualitySize();
+		int flag = records[i].getMappingFlag();
+		size_t sz = shrink(q, len, flag);
+		for (size_t j = 0; j < sz; j++)
+			buffer.add(offsetScore((flag & 0x10) ? q[len - j - 1] : q[j], blockOffset));
 		buffer.add(0);
-		totalSize -= (q - records[i].getQuality()) + 1;
 	}
+	totalSize -= buffer.size();
 	compressArray(streams.front(), buffer, out, out_offset);
-	memset(stat, 0, 128 * sizeof(int));
-	offset = 0;
 
 	ZAMAN_END(QualityScoreOutput);
 }
@@ -190,11 +193,3 @@ void QualityScoreCompressor::calculateLossyTable (int percentage)
 		}
 	}
 }
-
-void QualityScoreCompressor::lossyTransform (char *qual, size_t len) 
-{
-	if (!optLossy) 
-		return;
-	if (!statMode) for (size_t i = 0; i < len; i++)
-		qual[i] = lossy[qual[i]];
-}
@@ -1,11 +1,12 @@
 #include "QualityScore.h"
 using namespace std;
 
-QualityScoreDecompressor::QualityScoreDecompressor (int blockSize):
-	StringDecompressor<QualityDecompressionStream>(blockSize) 
+QualityScoreDecompressor::QualityScoreDecompressor (int blockSize, char mode):
+	StringDecompressor<QualityDecompressionStream>(blockSize),
+	mode(mode)
 {
 	sought = 0;
-	switch (optQuality) {
+	switch (mode) {
 		case 0:
 			break;
 		case 1:
@@ -20,7 +21,7 @@ QualityScoreDecompressor::QualityScoreDecompressor (int blockSize):
 			break;
 	}
 	const char* qualities[] = { "default", "samcomp", "arithmetic" };
-	LOG("Using quality mode %s", qualities[optQuality]);
+	LOG("Using quality mode %s", qualities[mode]);
 	if (optNoQual)
 		sought = 2;
 }
@@ -33,33 +34,41 @@ void QualityScoreDecompressor::setIndexData (uint8_t *in, size_t in_size)
 }
 
 string QualityScoreDecompressor::getRecord (size_t record, size_t seq_len, int flag) 
+{
+	string s;
+	getRecord(record, seq_len, flag, s);
+	return s;
+}
+
+// Appends the qualities of the record to the output
+void QualityScoreDecompressor::getRecord (size_t record, size_t seq_len, int flag, string &out) 
 {
 	ZAMAN_START(QualityScoreGet);
 
 	if (sought == 2) {
-		string s = "";
-		for (int i = 0; i < seq_len; i++)
-			s += (char)64;
+		out.append(seq_len, (char)64);
 		ZAMAN_END(QualityScoreGet);
-		return s;
+		return;
 	}
 
-	string s = string(StringDecompressor<QualityDecompressionStream>::getRecord(record));
-	if (s == "") {
+	const string &q = StringDecompressor<QualityDecompressionStream>::getRecord(record);
+	if (q == "") {
+		out += '*';
 		ZAMAN_END(QualityScoreGet);
-		return "*";
+		return;
 	}
 
-	for (size_t i = 0; i < s.size(); i++)
+	size_t p = out.size();
+	out += q;
+	char *s = &out[p];
+	for (size_t i = 0; i < q.size(); i++)
 		s[i] += offset - 1;
-    char c = s[s.size() - 1];
-    while (s.size() < seq_len)
-		s += c;
-    if (flag & 0x10) for (size_t i = 0; i < seq_len / 2; i++)
-		swap(s[i], s[seq_len - i - 1]);
+	if (q.size() < seq_len)
+		out.append(seq_len - q.size(), out.back());
+	if (flag & 0x10) 
+		reverse(out.begin() + p, out.begin() + p + seq_len);
 
 	ZAMAN_END(QualityScoreGet);
-    return s;
 }
 
 void QualityScoreDecompressor::importRecords (uint8_t *in, size_t in_size) 
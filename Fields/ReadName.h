@@ -55,7 +55,7 @@ class ReadNameDecompressor:
 	Array<uint32_t> paired;
 
 public:
-	ReadNameDecompressor(int blockSize);
+	ReadNameDecompressor(int blockSize, bool bzip);
 
 public:
 	void importRecords (uint8_t *in, size_t in_size);
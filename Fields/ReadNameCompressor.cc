@@ -36,8 +36,9 @@ void ReadNameCompressor::outputRecords (const Array<Record> &records, Array<uint
 	Array<uint8_t> indices(k * 10);	
 	Array<uint8_t> paired(k);	
 
+	size_t used = 0;
 	for (size_t i = 0; i < k; i++) {
-		size_t rnLen = strlen(records[i].getReadName());
+		size_t rnLen = records[i].getReadNameSize();
 		if (pairedEndInfos[i].bit == PairedEndInfo::Bits::LOOK_BACK) {
 			indices.add(6 * MAX_TOKEN);
 			if (pairedEndInfos[i].tlen < (1 << 16)) {
@@ -54,8 +55,9 @@ void ReadNameCompressor::outputRecords (const Array<Record> &records, Array<uint
 				rnLen,
 				buffer, indices);
 		}
-		this->totalSize -= rnLen + 1;
+		used += rnLen + 1;
 	}
+	this->totalSize -= used;
 
 	compressArray(streams[Fields::INDEX], indices, out, out_offset);
 	compressArray(streams[Fields::CONTENT], buffer, out, out_offset);
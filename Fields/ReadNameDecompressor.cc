@@ -1,12 +1,12 @@
 #include "ReadName.h"
 using namespace std;
 
-ReadNameDecompressor::ReadNameDecompressor (int blockSize):
+ReadNameDecompressor::ReadNameDecompressor (int blockSize, bool bzip):
 	StringDecompressor<GzipDecompressionStream>(blockSize),
 	paired(blockSize)
 {
 	streams.resize(ReadNameCompressor::Fields::ENUM_COUNT);
-	if (optBzip) {
+	if (bzip) {
 		for (int i = 0; i < streams.size(); i++)
 			streams[i] = make_shared<BzipDecompressionStream>();	
 	} else {
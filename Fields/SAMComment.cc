@@ -19,6 +19,8 @@ SAMComment::SAMComment(const string &comment)
 
 		string id = f[0];
 		if (id == "@SQ" && kv.find("SN") != kv.end()) {
+			if (SQIndex.insert(make_pair(kv["SN"], SQOrder.size())).second)
+				SQOrder.push_back(kv["SN"]);
 			SQ[kv["SN"]] = kv;
 		} else if (id == "@RG" && kv.find("ID") != kv.end()) {
 			int cnt = RG.size();
@@ -42,3 +44,11 @@ SAMComment::SAMComment(const string &comment)
 	// 	LOG("%s->%d ", c.first.c_str(), c.second);
 	// }
 }
+
+string SAMComment::nextChromosome (const string &chr) const
+{
+	auto it = SQIndex.find(chr);
+	if (it == SQIndex.end() || it->second + 1 >= SQOrder.size())
+		return "";
+	return SQOrder[it->second + 1];
+}
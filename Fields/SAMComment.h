@@ -8,7 +8,12 @@ struct SAMComment {
 	std::vector<std::string> lines;
 	std::unordered_map<std::string, int> PG, RG;
 	std::unordered_map<std::string, std::unordered_map<std::string, std::string>> SQ;
+	std::vector<std::string> SQOrder; // @SQ names in the header order
+	std::unordered_map<std::string, size_t> SQIndex; // position within SQOrder
 	SAMComment(const std::string &comment);
+
+	// Chromosome which follows chr in the header (empty if none)
+	std::string nextChromosome (const std::string &chr) const;
 };
 
 #endif // SAMComment_H
\ No newline at end of file
@@ -117,14 +117,10 @@ class SequenceCompressor: public Compressor {
 	friend class Stats;
 	Reference reference;
 	
-	Array<uint8_t> 
-		fixesLoc,
-		fixesReplace;
-	Array<uint8_t>
-		fixesLocSt;
-	
 	std::string chromosome; // chromosome index
 	std::string fixed;
+	std::string original; // reference below fixed
+	std::string refixed; // positions of fixed changed by the current block
 	size_t fixedStart, fixedEnd;
 	size_t maxEnd;
 
@@ -135,17 +131,17 @@ public:
 	void updateBoundary (size_t loc);
 	size_t getBoundary() const { return maxEnd; };
 	void outputRecords (const Array<Record> &records, Array<uint8_t> &output, size_t out_offset, size_t k);
+	void outputRecords (const Array<Record> &records, Array<uint8_t> &output, size_t out_offset, size_t k, size_t start, size_t end);
 	void getIndexData (Array<uint8_t> &out) { out.resize(0); }
 	void printDetails(void);
 
-	size_t applyFixes (size_t end, const Array<Record> &records, const Array<EditOperation> &editOps, size_t&, size_t&, size_t&, size_t&, size_t&);
+	size_t applyFixes (size_t end, const CircularArray<Record> &records, const CircularArray<EditOperation> &editOps, size_t&, size_t&, size_t&, size_t&, size_t&);
 
-	size_t currentMemoryUsage() {
-		LOG("Reference uses %'lu", reference.currentMemoryUsage());
+	// Fixed reference (with the reference below it) and the loaded reference; constant time
+	size_t currentMemoryUsage() const {
 		return 
-			sizeInMemory(fixesLoc) + sizeInMemory(fixesReplace) +
-			sizeInMemory(chromosome) + sizeInMemory(fixed) + sizeInMemory(streams) +
-			sizeof(size_t) * 3 + reference.currentMemoryUsage();
+			fixed.capacity() + original.capacity() + refixed.capacity() + 
+			reference.currentMemoryUsage();
 	}
 
 	
@@ -157,7 +153,7 @@ public:
 	Reference &getReference() { return reference; }
 
 private:
-	static void applyFixesThread(const Array<Record> &records, const Array<EditOperation> &editOps, shared_ptr<GenomeStats> &stats, 
+	static void applyFixesThread(const CircularArray<Record> &records, const CircularArray<EditOperation> &editOps, shared_ptr<GenomeStats> &stats, 
 		size_t fixedStart, size_t offset, size_t size);
 
 public:
@@ -178,7 +174,7 @@ private:
 	size_t fixedStart, fixedEnd;
 
 public:
-	SequenceDecompressor (const std::string &refFile, int bs);
+	SequenceDecompressor (const std::string &refFile, int bs, bool bzip);
 
 public:
 	bool hasRecord (void);
@@ -187,7 +183,11 @@ public:
 
 public:
 	void scanChromosome (const std::string &s, const SAMComment &samComment);
+	void copyFixed (const SequenceDecompressor &s);
 	std::string getChromosome (void) const { return chromosome; }
+	// Blocks decoded out of order may start before the reference kept from the previous block:
+	// the chromosome is then scanned again by the next block
+	void rewind (size_t start) { if (start < fixedStart) chromosome = ""; }
 	char operator[] (size_t pos) const;
 	const Reference &getReference() const { return reference; }
 };
@@ -21,9 +21,8 @@ const __m128i GenomeStatsSSE::invert = _mm_set_epi16(0xffff, 0xffff, 0xffff, 0xf
 
 SequenceCompressor::SequenceCompressor (const string &refFile):
 	reference(refFile), 
-	fixesLoc(MB, MB),
-	fixesReplace(MB, MB),
-	fixesLocSt(MB, MB),
+	fixedStart(0),
+	fixedEnd(0),
 	maxEnd(0)
 {
 	if (!supports_sse41()) {
@@ -54,23 +53,45 @@ void SequenceCompressor::updateBoundary (size_t loc)
 }
 
 void SequenceCompressor::outputRecords (const Array<Record> &records, Array<uint8_t> &out, size_t out_offset, size_t k) 
+{
+	outputRecords(records, out, out_offset, k, fixedStart, fixedEnd);
+}
+
+// Outputs the fixes within [start, end) of the fixed reference: the positions which differ from the reference,
+// and the ones changed back to it by the current block. Parts of a block can thus restore their reference 
+// without the blocks before them, while the fixes of the previous block are kept when decoding in order
+void SequenceCompressor::outputRecords (const Array<Record> &records, Array<uint8_t> &out, size_t out_offset, size_t k, 
+	size_t start, size_t end) 
 {
 	if (chromosome == "*") 
 		return;
 
 	ZAMAN_START(SequenceImport);
 
-	out.add((uint8_t*)&fixedStart, sizeof(size_t));
-	out.add((uint8_t*)&fixedEnd,   sizeof(size_t));
+	assert(start >= fixedStart && end <= fixedEnd);
+	Array<uint8_t> fixesLoc(MB, MB), fixesLocSt(MB, MB), fixesReplace(MB, MB);
+	size_t fixedPrev = 0;
+	for (size_t i = start - fixedStart; i < end - fixedStart; i++) {
+		if (fixed[i] == original[i] && !refixed[i])
+			continue;
+		size_t p = fixedStart + i - fixedPrev;
+		if (p >= 254) {
+			fixesLoc.add(255);
+			addEncoded(p - 254 + 1, fixesLocSt);
+		} else {
+			fixesLoc.add(p);
+		}
+		fixedPrev = fixedStart + i;
+		fixesReplace.add(fixed[i]);
+	}
+
+	out.add((uint8_t*)&start, sizeof(size_t));
+	out.add((uint8_t*)&end,   sizeof(size_t));
 	out_offset += sizeof(size_t) * 2;
 	compressArray(streams[Fields::FIXES], fixesLoc, out, out_offset);
 	compressArray(streams[Fields::FIXES_ST], fixesLocSt, out, out_offset);
 	compressArray(streams[Fields::REPLACE], fixesReplace, out, out_offset);
 
-	fixesLoc.resize(0);
-	fixesLocSt.resize(0);
-	fixesReplace.resize(0);
-
 	ZAMAN_END(SequenceImport);
 }
 
@@ -84,12 +105,10 @@ char SequenceCompressor::operator[] (size_t pos) const
 
 void SequenceCompressor::scanChromosome (const string &s, const SAMComment &samComment) 
 {
-	// by here, all should be fixed ...
-	assert(fixesLoc.size() == 0);
-	assert(fixesReplace.size() == 0);
-	
 	// clean genomePager
 	fixed.resize(0);
+	original.resize(0);
+	refixed.resize(0);
 	fixedStart = fixedEnd = maxEnd = 0;
 
 	chromosome = reference.scanChromosome(s, samComment);
@@ -98,8 +117,8 @@ void SequenceCompressor::scanChromosome (const string &s, const SAMComment &samC
 // called at the end of the block!
 // IS NOT ATOMIC!
 
-void SequenceCompressor::applyFixesThread(const Array<Record> &records, 
-	const Array<EditOperation> &editOps, shared_ptr<GenomeStats> &stats,
+void SequenceCompressor::applyFixesThread(const CircularArray<Record> &records, 
+	const CircularArray<EditOperation> &editOps, shared_ptr<GenomeStats> &stats,
 	size_t fixedStart, size_t start, size_t end) 
 {
 	for (size_t k = start; k < end; k++) {
@@ -135,7 +154,7 @@ void SequenceCompressor::applyFixesThread(const Array<Record> &records,
  * out start_S
  */
 size_t SequenceCompressor::applyFixes (size_t nextBlockBegin, 
-	const Array<Record> &records, const Array<EditOperation> &editOps,
+	const CircularArray<Record> &records, const CircularArray<EditOperation> &editOps,
 	size_t &start_S, size_t &end_S, size_t &end_E, size_t &fS, size_t &fE) 
 {
 	if (editOps.size() == 0) 
@@ -163,12 +182,14 @@ size_t SequenceCompressor::applyFixes (size_t nextBlockBegin,
 			if (fixed.size() && newFixedStart < fixedEnd) { // Copy old fixes
 				ZAMAN_START_P(Load);
 				fixed = fixed.substr(newFixedStart - fixedStart, fixedEnd - newFixedStart);
-				fixed += reference.copy(fixedEnd, newFixedEnd);
+				original = original.substr(newFixedStart - fixedStart, fixedEnd - newFixedStart);
+				string ref = reference.copy(fixedEnd, newFixedEnd);
+				fixed += ref, original += ref;
 				reference.trim(fixedEnd);
 				ZAMAN_END_P(Load);
 			} else {
 				ZAMAN_START_P(Load);
-				fixed = reference.copy(newFixedStart, newFixedEnd);
+				fixed = original = reference.copy(newFixedStart, newFixedEnd);
 				reference.trim(newFixedStart);
 				ZAMAN_END_P(Load);
 			}
@@ -183,68 +204,52 @@ size_t SequenceCompressor::applyFixes (size_t nextBlockBegin,
 
 		// obtain statistics
 		ZAMAN_START_P(Calculate);
-		vector<thread> t(optThreads);
 		auto stats = GenomeStatsSSE::newStats(fixedEnd - fixedStart);
 		size_t maxSz = editOps.size();
 		size_t sz = maxSz / optThreads + 1;
-		vector<thread> threads(optThreads);
-		mutex mtx;
-		mtx.lock(); // lock for stats array
+		// First chunk updates the block statistics in place; other chunks
+		// collect their own and are merged once all of them are done
+		vector<shared_ptr<GenomeStats>> threadStats(optThreads);
+		vector<size_t> genomeStarts(optThreads);
+		TaskGroup tasks;
 		for (int i = 0; i < optThreads; i++) {
-			threads[i] = thread([&](int ti, size_t start, size_t end) {
+			size_t start = i * sz, end = min(maxSz, (i + 1) * sz);
+			if (start >= end)
+				continue;
+			tasks.run([&, i, start, end]() {
 				ZAMAN_START(Thread);
-				if (ti == 0) {
+				if (i == 0) {
 					applyFixesThread(records, editOps, stats, fixedStart, start, end);
-					mtx.unlock();
-					return;
+				} else {
+					size_t genomeStart = editOps[start].start;
+					size_t genomeEnd = 0;
+					for (size_t j = start; j < end; j++) 
+						genomeEnd = max(genomeEnd, editOps[j].end);
+
+					genomeStarts[i] = genomeStart;
+					threadStats[i] = GenomeStatsSSE::newStats(genomeEnd - genomeStart);
+					applyFixesThread(records, editOps, threadStats[i], genomeStart, start, end);
 				}
-				if (start >= editOps.size())
-					return;
-
-				size_t genomeStart = editOps[start].start;
-				size_t genomeEnd = 0;
-				for (size_t i = start; i < end; i++) 
-					genomeEnd = max(genomeEnd, editOps[i].end);
-
-				auto threadStats = GenomeStatsSSE::newStats(genomeEnd - genomeStart);
-				applyFixesThread(records, editOps, threadStats, genomeStart, start, end);
 				ZAMAN_END(Thread);
-
-				unique_lock<mutex> lock(mtx);
-				for (size_t i = 0; i < threadStats->size(); i++) {
-					stats->update(i + genomeStart - fixedStart, threadStats, i);
-				}
-				ZAMAN_THREAD_JOIN();
-				// LOG("Done with %d.. %d %d fixes", ti, start, end);
-			}, i, i * sz, min(maxSz, (i + 1) * sz));
+			}, i);
+		}
+		tasks.wait();
+		for (int i = 1; i < optThreads; i++) if (threadStats[i]) {
+			for (size_t j = 0; j < threadStats[i]->size(); j++) 
+				stats->update(j + genomeStarts[i] - fixedStart, threadStats[i], j);
 		}
-		for (int i = 0; i < optThreads; i++) 
-			threads[i].join();
 		ZAMAN_END_P(Calculate); 
 
-		// patch reference genome
-		size_t fixedPrev = 0;
+		// patch reference genome; fixes are output with the block
 		ZAMAN_START_P(Apply);
-		fixesLoc.resize(0);
-		fixesLocSt.resize(0);
-		fixesReplace.resize(0);
-
+		refixed.assign(fixedEnd - fixedStart, 0);
 		for (size_t i = 0; i < fixedEnd - fixedStart; i++) {
 			int pos = stats->maxPos(i);
 			if (pos == -1)
 				continue;
 			if (fixed[i] != pos[".ACGTN"]) {
-				int p = fixedStart + i - fixedPrev;
-				if (p >= 254) {
-					fixesLoc.add(255);
-					addEncoded(p - 254 + 1, fixesLocSt);
-				} else {
-					fixesLoc.add(p);
-				}
-				// addEncoded(fixedStart + i - fixedPrev + 1, fixesLoc);  // +1 for 0 termninator avoid
-				// fprintf(fo, "%d %c%c\n", fixedStart + i - fixedPrev + 1, fixed[i], pos[".ACGTN"]);
-				fixedPrev = fixedStart + i;
-				fixesReplace.add(fixed[i] = pos[".ACGTN"]);
+				fixed[i] = pos[".ACGTN"];
+				refixed[i] = 1;
 			}
 		}
 
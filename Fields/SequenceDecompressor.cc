@@ -4,12 +4,12 @@
 #include "../Streams/rANSOrder0Stream.h"
 using namespace std;
 
-SequenceDecompressor::SequenceDecompressor (const string &refFile, int bs):
+SequenceDecompressor::SequenceDecompressor (const string &refFile, int bs, bool bzip):
 	reference(refFile), 
 	chromosome("")
 {
 	streams.resize(SequenceCompressor::Fields::ENUM_COUNT);
-	if (optBzip) {
+	if (bzip) {
 		for (int i = 0; i < streams.size(); i++)
 			streams[i] = make_shared<BzipDecompressionStream>();	
 	} else {
@@ -81,6 +81,16 @@ char SequenceDecompressor::operator[] (size_t pos) const
 	return fixed[pos - fixedStart];
 }
 
+// Takes the fixed reference of the current block of s (and the reference below it),
+// so that the block can be decoded while s continues with the next blocks
+void SequenceDecompressor::copyFixed (const SequenceDecompressor &s)
+{
+	chromosome = s.chromosome;
+	fixed = s.fixed;
+	fixedStart = s.fixedStart, fixedEnd = s.fixedEnd;
+	reference.copyLoaded(s.reference, fixedStart, fixedEnd);
+}
+
 void SequenceDecompressor::scanChromosome (const string &s, const SAMComment &samComment)
 {
 	// by here, all should be fixed ...
@@ -1,4 +1,5 @@
 #include "FileIO.h"
+#include <unistd.h>
 
 #ifdef OPENSSL
 #include <openssl/hmac.h>
@@ -181,6 +182,18 @@ ssize_t File::read (void *buffer, size_t size, size_t offset)
 	return read(buffer, size);
 }
 
+ssize_t File::pread (void *buffer, size_t size, size_t offset) 
+{
+	size_t total = 0;
+	while (total < size) {
+		ssize_t sz = ::pread(fileno(fh), (char*)buffer + total, size - total, offset + total);
+		if (sz <= 0)
+			break;
+		total += sz;
+	}
+	return total;
+}
+
 size_t File::advance(size_t size)
 {
 	fseek(fh, size, SEEK_CUR);
@@ -304,6 +317,14 @@ ssize_t WebFile::read (void *buffer, size_t size)
 
 ssize_t WebFile::read(void *buffer, size_t size, size_t offset) 
 {
+	size_t sz = pread(buffer, size, offset);
+	foffset = offset + sz;
+	return sz;
+}
+
+ssize_t WebFile::pread(void *buffer, size_t size, size_t offset) 
+{
+	lock_guard<mutex> lock(mtx);
 	CURLBuffer bfr;
 	curl_easy_setopt(ch, CURLOPT_WRITEDATA, (void*)&bfr); 
 	curl_easy_setopt(ch, CURLOPT_RANGE, S("%zu-%zu", offset, offset + size - 1).c_str());
@@ -311,7 +332,6 @@ ssize_t WebFile::read(void *buffer, size_t size, size_t offset)
 	if (result != CURLE_OK)
 		throw DZException("CURL read failed");
 	memcpy(buffer, bfr.data, bfr.size);
-	foffset = offset + bfr.size;
 	return bfr.size;
 }
 
@@ -461,6 +481,11 @@ ssize_t GzFile::read(void *buffer, size_t size, size_t offset)
 	throw DZException("GZ random access is not yet supported");
 }
 
+ssize_t GzFile::pread(void *buffer, size_t size, size_t offset) 
+{
+	throw DZException("GZ random access is not yet supported");
+}
+
 ssize_t GzFile::write (void *buffer, size_t size) 
 { 
 	return gzwrite(fh, buffer, size); 
@@ -4,6 +4,7 @@
 #include "Common.h"
 #include <curl/curl.h>
 #include <zlib.h>
+#include <mutex>
 
 using namespace std;
 
@@ -25,6 +26,8 @@ public:
 
 	virtual ssize_t read (void *buffer, size_t size);
 	virtual ssize_t read (void *buffer, size_t size, size_t offset);
+	// Reads at the offset without moving the position of the file (safe to call from several threads)
+	virtual ssize_t pread (void *buffer, size_t size, size_t offset);
 	virtual ssize_t write (void *buffer, size_t size);
 	virtual size_t advance(size_t size);
 
@@ -58,6 +61,7 @@ class WebFile: public File
 {
 	CURL *ch;
 	size_t fsize, foffset;
+	std::mutex mtx; // requests through the handle
 
 public:
 	WebFile (const string &path, const char *mode);
@@ -68,6 +72,7 @@ public:
 
 	ssize_t read (void *buffer, size_t size);
 	ssize_t read(void *buffer, size_t size, size_t offset);
+	ssize_t pread (void *buffer, size_t size, size_t offset);
 	ssize_t write (void *buffer, size_t size);
 
 	ssize_t tell ();
@@ -108,6 +113,7 @@ public:
 
 	ssize_t read (void *buffer, size_t size);
 	ssize_t read(void *buffer, size_t size, size_t offset);
+	ssize_t pread (void *buffer, size_t size, size_t offset);
 	ssize_t write (void *buffer, size_t size);
 
 	ssize_t tell ();
@@ -3,6 +3,15 @@
 #include <DeeZAPI.h>
 #include "DeeZFile.h"
 #include <stdio.h>
+#include <string.h>
+
+// Native state of a DeeZFile object
+struct DeeZHandle {
+	DeeZFile file;
+
+	DeeZHandle (const std::string &path, const std::string &genome):
+		file(path, genome) {}
+};
 
 jfieldID getHandleField (JNIEnv *env, jobject obj)
 {
@@ -37,7 +46,7 @@ void throwJavaException(JNIEnv *env, const char *msg)
 JNIEXPORT void JNICALL Java_DeeZFile_init (JNIEnv *env, jobject obj, jstring path, jstring genome)
 {
 	try {
-		auto f = new DeeZFile(
+		auto f = new DeeZHandle(
 			env->GetStringUTFChars(path, 0),
 			env->GetStringUTFChars(genome, 0)
 		);
@@ -51,7 +60,7 @@ JNIEXPORT void JNICALL Java_DeeZFile_init (JNIEnv *env, jobject obj, jstring pat
 JNIEXPORT void JNICALL Java_DeeZFile_setLogLevel (JNIEnv *env, jobject obj, jint level)
 {
 	try {
-		auto f = getHandle<DeeZFile>(env, obj);
+		auto f = &getHandle<DeeZHandle>(env, obj)->file;
 		f->setLogLevel(level);
 	}
 	catch (DZException &e) {
@@ -62,7 +71,7 @@ JNIEXPORT void JNICALL Java_DeeZFile_setLogLevel (JNIEnv *env, jobject obj, jint
 JNIEXPORT jint JNICALL Java_DeeZFile_getFileCount (JNIEnv *env, jobject obj)
 {
 	try {
-		auto f = getHandle<DeeZFile>(env, obj);
+		auto f = &getHandle<DeeZHandle>(env, obj)->file;
 		return (jint)f->getFileCount();
 	}
 	catch (DZException &e) {
@@ -73,7 +82,7 @@ JNIEXPORT jint JNICALL Java_DeeZFile_getFileCount (JNIEnv *env, jobject obj)
 JNIEXPORT jstring JNICALL Java_DeeZFile_getComment (JNIEnv *env, jobject obj, jint file)
 {
 	try {
-		auto f = getHandle<DeeZFile>(env, obj);
+		auto f = &getHandle<DeeZHandle>(env, obj)->file;
 		return env->NewStringUTF(f->getComment(file).c_str());
 	}
 	catch (DZException &e) {
@@ -87,7 +96,7 @@ JNIEXPORT jobjectArray JNICALL Java_DeeZFile_getRecords (JNIEnv *env, jobject ob
 	auto ctor = env->GetMethodID(cls, "<init>", "(LDeeZFile;Ljava/lang/String;ILjava/lang/String;JILjava/lang/String;Ljava/lang/String;JILjava/lang/String;Ljava/lang/String;Ljava/lang/String;)V");
 
 	try {
-		auto f = getHandle<DeeZFile>(env, obj);
+		auto f = &getHandle<DeeZHandle>(env, obj)->file;
 		auto records = f->getRecords(env->GetStringUTFChars(range, 0), flags, overlap);
 
 		auto arr = env->NewObjectArray(records.size(), cls, NULL);
@@ -118,11 +127,90 @@ JNIEXPORT jobjectArray JNICALL Java_DeeZFile_getRecords (JNIEnv *env, jobject ob
 	}
 }
 
+// Columnar layout of the records of a block, in the native byte order 
+// (read in place by DeeZFile.RecordBuffer):
+//	int32 count, int32 (unused)
+//	int64 loc[count], int64 ploc[count]
+//	int32 flag[count], int32 mapqual[count], int32 tlen[count]
+//	int32 offsets[7][count + 1]: strings of each column (rname, chr, cigar, pchr, seq, qual, opt),
+//		where the string i of a column spans [offsets[i], offsets[i + 1]) of the strings
+//	strings
+static size_t packedSize (const std::vector<DeeZFile::SAMRecordView> &records)
+{
+	size_t n = records.size(), strings = 0;
+	for (auto &r: records) 
+		strings += r.rname.size + r.chr.size + r.cigar.size + r.pchr.size + r.seq.size + r.qual.size + r.opt.size;
+	size_t size = 8 + (2 * sizeof(int64_t) + 3 * sizeof(int32_t)) * n + 7 * (n + 1) * sizeof(int32_t) + strings;
+	if (size > INT32_MAX)
+		throw DZException("Block is too large for a record buffer");
+	return size;
+}
+
+// Writes the records into p (of packedSize bytes)
+static void packRecords (const std::vector<DeeZFile::SAMRecordView> &records, char *p)
+{
+	size_t n = records.size();
+	int32_t header[2] = { (int32_t)n, 0 };
+	memcpy(p, header, sizeof(header));
+
+	int64_t *loc = (int64_t*)(p + 8), *ploc = loc + n;
+	int32_t *flag = (int32_t*)(ploc + n), *mapqual = flag + n, *tlen = mapqual + n;
+	int32_t *offsets = tlen + n;
+	char *s = (char*)(offsets + 7 * (n + 1));
+	for (size_t i = 0; i < n; i++) {
+		loc[i] = records[i].loc, ploc[i] = records[i].ploc;
+		flag[i] = records[i].flag, mapqual[i] = records[i].mapqual, tlen[i] = records[i].tlen;
+	}
+	const DeeZFile::StringRef DeeZFile::SAMRecordView::*fields[7] = {
+		&DeeZFile::SAMRecordView::rname, &DeeZFile::SAMRecordView::chr, &DeeZFile::SAMRecordView::cigar,
+		&DeeZFile::SAMRecordView::pchr, &DeeZFile::SAMRecordView::seq, &DeeZFile::SAMRecordView::qual,
+		&DeeZFile::SAMRecordView::opt
+	};
+	int32_t pos = 0;
+	for (int c = 0; c < 7; c++) {
+		for (size_t i = 0; i < n; i++) {
+			auto &str = records[i].*fields[c];
+			*offsets++ = pos;
+			memcpy(s + pos, str.data, str.size);
+			pos += str.size;
+		}
+		*offsets++ = pos;
+	}
+}
+
+JNIEXPORT jobject JNICALL Java_DeeZFile_getRecordBytes (JNIEnv *env, jobject obj, jstring range, jint flags, jboolean overlap)
+{
+	try {
+		auto h = getHandle<DeeZHandle>(env, obj);
+		const char *r = env->GetStringUTFChars(range, 0);
+		std::string rs = r;
+		env->ReleaseStringUTFChars(range, r);
+		if (rs != "") 
+			h->file.startQuery(rs, flags, overlap);
+		auto &records = h->file.nextRecords();
+		size_t size = packedSize(records);
+
+		// Buffer is allocated (and freed) by the JVM, so it stays valid 
+		// after the next call and after dispose; records are packed straight into it
+		jclass cls = env->FindClass("java/nio/ByteBuffer");
+		jmethodID allocate = env->GetStaticMethodID(cls, "allocateDirect", "(I)Ljava/nio/ByteBuffer;");
+		jobject buffer = env->CallStaticObjectMethod(cls, allocate, (jint)size);
+		if (buffer == NULL) // OutOfMemoryError is pending
+			return NULL;
+		packRecords(records, (char*)env->GetDirectBufferAddress(buffer));
+		return buffer;
+	}
+	catch (DZException &e) {
+		throwJavaException(env, e.what());
+		return NULL;
+	}
+}
+
 JNIEXPORT void JNICALL Java_DeeZFile_dispose (JNIEnv *env, jobject obj)
 {
 	try {
-		auto f = getHandle<DeeZFile>(env, obj);
-	    setHandle<DeeZFile>(env, obj, 0);
+		auto f = getHandle<DeeZHandle>(env, obj);
+	    setHandle<DeeZHandle>(env, obj, 0);
 	    delete f;
   	}
 	catch (DZException &e) {
@@ -47,6 +47,14 @@ JNIEXPORT jstring JNICALL Java_DeeZFile_getComment
 JNIEXPORT jobjectArray JNICALL Java_DeeZFile_getRecords
   (JNIEnv *, jobject, jstring, jint, jboolean);
 
+/*
+ * Class:     DeeZFile
+ * Method:    getRecordBytes
+ * Signature: (Ljava/lang/String;IZ)Ljava/nio/ByteBuffer;
+ */
+JNIEXPORT jobject JNICALL Java_DeeZFile_getRecordBytes
+  (JNIEnv *, jobject, jstring, jint, jboolean);
+
 /*
  * Class:     DeeZFile
  * Method:    dispose
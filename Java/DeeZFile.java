@@ -51,6 +51,69 @@ public class DeeZFile {
 		}
 	}
 
+	/// Records of a block in the columnar layout of getRecordBuffer,
+	/// read in place from a direct buffer (no objects are created per record).
+	/// The buffer is allocated by the JVM: it stays valid after the next call and after dispose.
+	public class RecordBuffer {
+		/// String columns
+		public static final int RNAME = 0, CHR = 1, CIGAR = 2, PCHR = 3, SEQ = 4, QUAL = 5, OPT = 6;
+
+		private final java.nio.ByteBuffer buffer;
+		private final int count, locs, plocs, flags, mapquals, tlens, offsets, strings;
+
+		RecordBuffer(java.nio.ByteBuffer _buffer) {
+			buffer = _buffer.order(java.nio.ByteOrder.nativeOrder());
+			count = buffer.getInt(0);
+			locs = 8;
+			plocs = locs + 8 * count;
+			flags = plocs + 8 * count;
+			mapquals = flags + 4 * count;
+			tlens = mapquals + 4 * count;
+			offsets = tlens + 4 * count;
+			strings = offsets + 4 * 7 * (count + 1);
+		}
+
+		/// Number of records
+		public int size() { return count; }
+
+		public int flag(int i) { return buffer.getInt(flags + 4 * i); }
+		public long loc(int i) { return buffer.getLong(locs + 8 * i); }
+		public int mapqual(int i) { return buffer.getInt(mapquals + 4 * i); }
+		public long ploc(int i) { return buffer.getLong(plocs + 8 * i); }
+		public int tlen(int i) { return buffer.getInt(tlens + 4 * i); }
+
+		/// Length in bytes of the string <column> of the record <i>
+		public int length(int column, int i) {
+			int o = offsets + 4 * (column * (count + 1) + i);
+			return buffer.getInt(o + 4) - buffer.getInt(o);
+		}
+		/// Byte <j> of the string <column> of the record <i>, read in place
+		public byte byteAt(int column, int i, int j) {
+			return buffer.get(strings + buffer.getInt(offsets + 4 * (column * (count + 1) + i)) + j);
+		}
+		/// String <column> of the record <i> (copied into a new String)
+		public String string(int column, int i) {
+			byte[] b = new byte[length(column, i)];
+			java.nio.ByteBuffer d = buffer.duplicate();
+			d.position(strings + buffer.getInt(offsets + 4 * (column * (count + 1) + i)));
+			d.get(b);
+			return new String(b, java.nio.charset.StandardCharsets.ISO_8859_1);
+		}
+
+		public String rname(int i) { return string(RNAME, i); }
+		public String chr(int i) { return string(CHR, i); }
+		public String cigar(int i) { return string(CIGAR, i); }
+		public String pchr(int i) { return string(PCHR, i); }
+		public String seq(int i) { return string(SEQ, i); }
+		public String qual(int i) { return string(QUAL, i); }
+		public String opt(int i) { return string(OPT, i); }
+
+		/// Copies the record <i> into a SAMRecord
+		public SAMRecord record(int i) {
+			return new SAMRecord(rname(i), flag(i), chr(i), loc(i), mapqual(i), cigar(i), pchr(i), ploc(i), tlen(i), seq(i), qual(i), opt(i));
+		}
+	}
+
     static {
         System.loadLibrary("deez-jni");
     }        
@@ -79,6 +142,10 @@ public class DeeZFile {
 	///     dz.getRange("1:60-100", 4)
 	/// gets all mapped records (flag 0x04) from chromosome 1 in range 60-100
 	public native SAMRecord[] getRecords (String range, int filterFlag, boolean overlap) throws DeeZException;
+	/// Gets the records of the next block of the <range> (or of the last range, if <range> is empty)
+	/// in a new direct buffer (see RecordBuffer). Returns an empty buffer at the end of the range.
+	/// Supported only by DeeZ v2.0 files
+	private native java.nio.ByteBuffer getRecordBytes (String range, int filterFlag, boolean overlap) throws DeeZException;
 	/// Cleans up DeeZ native instance. 
 	/// Call it after you are done with DeeZ object.
 	public native void dispose() throws DeeZException;
@@ -111,4 +178,14 @@ public class DeeZFile {
 	public SAMRecord[] getRecords () throws DeeZException {
 		return getRecords("", 0, false);
 	}
+	/// Gets the records of the first block of the <range> (see getRecordBytes)
+	/// whose mapping flag conforms to <filterFlag>.
+	/// Faster than getRecords on large ranges, as the records are not copied into objects.
+	public RecordBuffer getRecordBuffer (String range, int filterFlag, boolean overlap) throws DeeZException {
+		return new RecordBuffer(getRecordBytes(range, filterFlag, overlap));
+	}
+	/// Gets the records of the next block of the range.
+	public RecordBuffer getRecordBuffer () throws DeeZException {
+		return getRecordBuffer("", 0, false);
+	}
 }
@@ -15,12 +15,14 @@ int main (void)
 
 		int f = df->getFileCount();
 		auto comment = df->getComment(0);
-		auto records = df->getRecords("1:30000-40000");
-		while (records.size()) {
+		df->startQuery("1:30000-40000");
+		while (1) {
+			auto &records = df->nextRecords();
+			if (!records.size())
+				break;
 			cerr << "Block!" << endl;
 			for (auto &r: records)
-				cout << r.rname << " " << r.loc << endl;
-			records = df->getRecords();
+				cout << r.rname.str() << " " << r.loc << endl;
 		}
 	}
 	catch (DZException &e) {
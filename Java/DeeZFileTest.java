@@ -1,6 +1,12 @@
 /// 786
 
 public class DeeZFileTest {
+	static boolean sameRecord (DeeZFile.SAMRecord a, DeeZFile.SAMRecord b) {
+		return a.rname.equals(b.rname) && a.flag == b.flag && a.chr.equals(b.chr) && a.loc == b.loc
+			&& a.mapqual == b.mapqual && a.cigar.equals(b.cigar) && a.pchr.equals(b.pchr) && a.ploc == b.ploc
+			&& a.tlen == b.tlen && a.seq.equals(b.seq) && a.qual.equals(b.qual) && java.util.Arrays.equals(a.opt, b.opt);
+	}
+
 	public static void main (String[] args) {
 		try {
 			DeeZFile df = new DeeZFile("test.dz", "test.fa");
@@ -22,8 +28,55 @@ public class DeeZFileTest {
 				records = df.getRecords();
 			}
 
+			// Throughput of the records as objects and in place from the record buffers
+			String range = args.length > 0 ? args[0] : "1:15000-16000";
+			long start = System.nanoTime(), count = 0, bases = 0;
+			for (records = df.getRecords(range, true); records.length > 0; records = df.getRecords()) {
+				for (DeeZFile.SAMRecord r: records) {
+					count++;
+					bases += r.seq.length();
+				}
+			}
+			double objectTime = (System.nanoTime() - start) / 1e9;
+
+			start = System.nanoTime();
+			long bufferCount = 0, bufferBases = 0;
+			for (DeeZFile.RecordBuffer b = df.getRecordBuffer(range, 0, true); b.size() > 0; b = df.getRecordBuffer()) {
+				for (int i = 0; i < b.size(); i++) {
+					bufferCount++;
+					bufferBases += b.length(DeeZFile.RecordBuffer.SEQ, i);
+				}
+			}
+			double bufferTime = (System.nanoTime() - start) / 1e9;
+
+			System.err.printf("getRecords:      %d records (%d bases) in %.3fs (%.0f records/s)%n", count, bases, objectTime, count / objectTime);
+			System.err.printf("getRecordBuffer: %d records (%d bases) in %.3fs (%.0f records/s)%n", bufferCount, bufferBases, bufferTime, bufferCount / bufferTime);
+
+			// Record buffers hold the same records as getRecords, field by field
+			java.util.ArrayList<DeeZFile.SAMRecord> expected = new java.util.ArrayList<DeeZFile.SAMRecord>();
+			for (records = df.getRecords(range, true); records.length > 0; records = df.getRecords())
+				expected.addAll(java.util.Arrays.asList(records));
+			int i = 0, differ = 0;
+			DeeZFile.RecordBuffer first = null;
+			for (DeeZFile.RecordBuffer b = df.getRecordBuffer(range, 0, true); b.size() > 0; b = df.getRecordBuffer()) {
+				if (first == null)
+					first = b;
+				for (int j = 0; j < b.size(); j++, i++) {
+					if (i >= expected.size() || !sameRecord(expected.get(i), b.record(j))) {
+						if (differ++ < 10)
+							System.err.println("Record " + i + " differs in the record buffer");
+					}
+				}
+			}
+			if (differ > 0 || i != expected.size())
+				System.err.println("Record buffers differ: " + differ + " records, " + i + " instead of " + expected.size() + " records");
+
 			df.dispose();
 
+			// Buffers outlive the later calls and the file
+			if (first != null && !sameRecord(expected.get(0), first.record(0)))
+				System.err.println("Record buffer changed after dispose");
+
 			// df = new DeeZFile("../run/74299.merged.sorted.nodups.realigned.recal.dz");
 			// f = df.getFileCount();
 			// comment = df.getComment(0);
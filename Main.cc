@@ -10,6 +10,7 @@
 #include "Compress.h"
 #include "Decompress.h"
 #include "Sort.h"
+#include "ReferenceCache.h"
 #include "FileIO.h"
 #include "Legacy/v1.1/Decompress.h"
 using namespace std;
@@ -24,9 +25,11 @@ bool optOverlap = false;
 bool optReadLossy = false;
 bool optInvalidChr = false;
 bool optComment = false;
+bool optIndexRef = false;
 string optRef 	 = "";
 vector<string> optInput;
 string optRange  = "";
+string optRegions = "";
 string optOutput = "";
 // string optQuery  = "";
 size_t optBlock = 1000000;
@@ -36,7 +39,22 @@ int optThreads  = 4;
 int optFlag     = 0;
 int optLogLevel	= 0;
 bool optBzip = false;
+bool optParallelFiles = false;
 size_t optSortMemory = GB;
+size_t optMaxMemory = 0;
+size_t optSlice = 0;
+int optPrefetch = 2;
+int optFields = FileDecompressor::ALL;
+
+size_t parseSize (const char *arg)
+{
+	char c = arg[strlen(arg) - 1];
+	size_t size = atol(arg);
+	if (c == 'K') size *= KB;	
+	if (c == 'M') size *= MB;
+	if (c == 'G') size *= GB;
+	return size;
+}
 
 void parseArguments (int argc, char **argv) 
 {
@@ -63,10 +81,17 @@ void parseArguments (int argc, char **argv)
 		{ "bzip",        0, NULL, 'b' },
 		{ "block",       1, NULL, 'B' },
 		{ "overlap",     0, NULL, 'x' },
+		{ "parallel-files", 0, NULL, 'P' },
+		{ "max-memory",  1, NULL, 'm' },
+		{ "prefetch",    1, NULL, 'p' },
+		{ "fields",      1, NULL, 'k' },
+		{ "slice",       1, NULL, 'i' },
+		{ "regions",     1, NULL, 'R' },
+		{ "index-ref",   0, NULL, 'X' },
 	//	{ "allow-invalid-ref", 0, NULL, 'I' },
 		{ NULL, 0, NULL, 0 }
 	};
-	const char *short_opt = "?hr:t:T!co:q:l:sM:Sf:F:QLbv:B:x" /*"I"*/;
+	const char *short_opt = "?hr:t:T!co:q:l:sM:Sf:F:QLbv:B:xPm:p:k:i:R:X" /*"I"*/;
 	do {
 		opt = getopt_long (argc, argv, short_opt, long_opt, NULL);
 		switch (opt) {
@@ -87,6 +112,9 @@ void parseArguments (int argc, char **argv)
 			case 'x':
 				optOverlap = true;
 				break;
+			case 'P':
+				optParallelFiles = true;
+				break;
 			case 'b':
 				optBzip = true;
 				break;
@@ -109,14 +137,19 @@ void parseArguments (int argc, char **argv)
 			case 'Q':
 				optNoQual = true;
 				break;
-			case 'M': {
-				char c = optarg[strlen(optarg) - 1];
-				optSortMemory = atol(optarg);
-				if (c == 'K') optSortMemory *= KB;	
-				if (c == 'M') optSortMemory *= MB;
-				if (c == 'G') optSortMemory *= GB;
+			case 'M':
+				optSortMemory = parseSize(optarg);
+				break;
+			case 'm':
+				optMaxMemory = parseSize(optarg);
+				if (!optMaxMemory)
+					throw DZException("Invalid memory limit %s", optarg);
+				break;
+			case 'p':
+				optPrefetch = atoi(optarg);
+				if (optPrefetch < 0)
+					throw DZException("Invalid prefetch depth %s", optarg);
 				break;
-			}
 			case '!':
 				optForce = true;
 				break;
@@ -151,6 +184,18 @@ void parseArguments (int argc, char **argv)
 			case 'f':
 				optFlag = atoi(optarg);
 				break;
+			case 'k':
+				optFields = FileDecompressor::parseFields(optarg);
+				break;
+			case 'i':
+				optSlice = parseSize(optarg);
+				break;
+			case 'R':
+				optRegions = optarg;
+				break;
+			case 'X':
+				optIndexRef = true;
+				break;
 			case -1:
 				break;
 			default: {
@@ -219,6 +264,33 @@ void compress (const vector<string> &in, const string &out)
 	}
 }
 
+// Reads the regions of a batch query, one per line: either a region (chr:start-end)
+// or a BED interval (0-based start, exclusive end)
+string readRegions (const string &path)
+{
+	FILE *fi = fopen(path.c_str(), "r");
+	if (fi == NULL)
+		throw DZException("Cannot open the file %s", path.c_str());
+	string regions;
+	char *line = NULL;
+	size_t lineSize = 0;
+	ssize_t len;
+	while ((len = getline(&line, &lineSize, fi)) != -1) {
+		string l(line, len);
+		while (l.size() && (l.back() == '\n' || l.back() == '\r'))
+			l.pop_back();
+		if (l == "" || l[0] == '#' || !l.compare(0, 5, "track") || !l.compare(0, 7, "browser"))
+			continue;
+		auto bed = split(l, '\t');
+		if (bed.size() >= 3)
+			l = S("%s:%lu-%lu", bed[0].c_str(), atol(bed[1].c_str()) + 1, atol(bed[2].c_str()));
+		regions += l + ";";
+	}
+	free(line);
+	fclose(fi);
+	return regions;
+}
+
 void decompress (const vector<string> &in, const string &out) 
 {
 	if (in.size() > 2)
@@ -252,6 +324,8 @@ void decompress (const vector<string> &in, const string &out)
 
 	if (version <= 0x11) {
 		LOG("Using legacy DeeZ file support (file version: 0x%x)", version);
+		if (optRegions != "")
+			throw DZException("Batch queries are not supported by DeeZ v1.1 files");
 		Legacy::v11::FileDecompressor sd(in[0], out, optRef, optBlock);
 		if (in.size() <= 1) {
 			sd.decompress(optFlag);
@@ -260,7 +334,9 @@ void decompress (const vector<string> &in, const string &out)
 		}
 	} else { // if version >= 0x20
 		FileDecompressor sd(in[0], out, optRef, optBlock);
-		if (in.size() <= 1) {
+		if (optRegions != "") {
+			sd.decompressBatch(readRegions(optRegions) + (in.size() > 1 ? in[1] : ""), optFlag);
+		} else if (in.size() <= 1) {
 			sd.decompress(optFlag);
 		} else {
 			sd.decompress(in[1], optFlag);
@@ -288,7 +364,7 @@ void test (vector<string> s)
 	system(cmd.c_str());
 }
 
-ctpl::thread_pool ThreadPool;
+Scheduler ThreadPool;
 #ifndef DEEZLIB
 int main (int argc, char **argv) 
 {
@@ -306,7 +382,10 @@ int main (int argc, char **argv)
     	for (int i = 0; i < optInput.size(); i++) if (!File::Exists(optInput[i].c_str()) && i != optInput.size() - 1)
 			throw DZException("File %s does not exist", optInput[i].c_str());
 		
-    	if (optSort) {
+    	if (optIndexRef) {
+    		for (auto &fasta: optInput)
+    			ReferenceCache::Build(fasta, optForce);
+    	} else if (optSort) {
     		sort(optOutput);
     	} else if (optStats) {
     		decompress(optInput, "");
@@ -336,6 +415,7 @@ int main (int argc, char **argv)
 	//#undef ZAMAN
 	#ifdef ZAMAN
 		LOG("\nTime usage:");
+		ThreadPool.reportStats();
 		ZAMAN_REPORT();
 	#endif
 	return 0;
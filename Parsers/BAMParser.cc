@@ -2,6 +2,7 @@
 #include "../Common.h"
 #include "Record.h"
 #include "BAMParser.h"
+#include "BGZFReader.h"
 
 #include <assert.h>
 #include <fcntl.h>
@@ -24,14 +25,21 @@ BAMParser::BAMParser (const string &filename):
 	file_size = ftell(fd);
 	fseek(fd, 0L, SEEK_SET);
 
-	input = gzdopen(fileno(fd), "rb");
-	if (input == Z_NULL)	
-		throw DZException("Cannot open the file %s", filename.c_str());
+	// BGZF blocks are inflated in parallel; other gzip files go through zlib
+	input = Z_NULL;
+	if (BGZFReader::IsBGZF(fd)) {
+		bgzf = make_shared<BGZFReader>(fd);
+	} else {
+		lseek(fileno(fd), 0L, SEEK_SET); // zlib reads the descriptor, not the stream buffer
+		input = gzdopen(fileno(fd), "rb");
+		if (input == Z_NULL)	
+			throw DZException("Cannot open the file %s", filename.c_str());
+	}
 
 	char magic[5] = {0};
-	if (gzread(input, magic, 4) != 4) {
+	if (read(magic, 4) != 4) {
 		int p;
-		ERROR("%s\n", gzerror(input, &p));
+		ERROR("%s\n", input ? gzerror(input, &p) : "Cannot read BAM header");
 	}
 	assert(!strcmp(magic, "BAM\x1"));
 }
@@ -44,24 +52,31 @@ BAMParser::~BAMParser (void)
 		chromosomes--;
 		free(chromosomes);
 	}
-	gzclose(input);
+	if (input != Z_NULL)
+		gzclose(input);
+	else if (bgzf) {
+		bgzf.reset();
+		if (!webFile)
+			fclose(fd);
+	}
+}
+
+inline size_t BAMParser::read (void *buffer, size_t size)
+{
+	if (bgzf)
+		return bgzf->read(buffer, size);
+	return gzread(input, buffer, size);
 }
 
 string BAMParser::readComment (void)  
 {
 	int32_t len;
-	gzread(input, &len, sizeof(int32_t));
+	read(&len, sizeof(int32_t));
 	char *c = (char*)calloc(len + 1, 1);
-	gzread(input, c, len);
-	currentRecord.line = (char*)malloc(len + 1);
-	strncpy(&currentRecord.line[0], c, len + 1);
+	read(c, len);
 	string s = c;
 	free(c);
 
-	// ugly; needs smarter way
-	currentRecord.line = (char*)realloc(currentRecord.line, 8 * MB);
-	currentRecord.lineSize = 8 * MB;
-
 	readChromosomeInformation();
 	readNext();
 
@@ -70,31 +85,59 @@ string BAMParser::readComment (void)
 
 void BAMParser::readChromosomeInformation (void) 
 {
-	gzread(input, &chromosomesCount, sizeof(int32_t));
+	read(&chromosomesCount, sizeof(int32_t));
 	chromosomes = (char**)malloc((chromosomesCount + 1) * sizeof(char*));
 	chromosomes[0] = (char*)"*";
 	chromosomes++;
 	for (int i = 0; i < chromosomesCount; i++) {
 		int32_t len, chrlen;
-		gzread(input, &len, sizeof(int32_t));
+		read(&len, sizeof(int32_t));
 		chromosomes[i] = (char*)calloc(len + 1, 1);
-		gzread(input, chromosomes[i], len);
-		gzread(input, &chrlen, sizeof(int32_t));
+		read(chromosomes[i], len);
+		read(&chrlen, sizeof(int32_t));
+	}
+}
+
+// Makes room for at least sz more characters after buf in the current record.
+// Buffer grows only when the record does not fit, so reused buffers are not reallocated
+inline char *BAMParser::reserve (char *buf, size_t sz)
+{
+	size_t used = buf - currentRecord.line;
+	if (used + sz + 1 > currentRecord.lineSize) {
+		currentRecord.lineSize = used + sz + 1;
+		currentRecord.line = (char*)realloc(currentRecord.line, currentRecord.lineSize);
+		if (!currentRecord.line)
+			throw DZException("Cannot allocate %'lu bytes for BAM record", currentRecord.lineSize);
 	}
+	return currentRecord.line + used;
+}
+
+static inline char *writeInt (char *buf, int64_t k)
+{
+	char tmp[24];
+	int i = 0;
+	if (k < 0) 
+		*buf++ = '-', k = -k;
+	do {
+		tmp[i++] = '0' + k % 10;
+		k /= 10;
+	} while (k);
+	while (i) 
+		*buf++ = tmp[--i];
+	return buf;
 }
 
 bool BAMParser::readNext (void) 
 {
 	int32_t bsize, cc;
-	char *buf = &currentRecord.line[0];
-	char *line = buf;
-	if (gzread(input, &bsize, 4) != 4) 
+	currentRecord.detach();
+	if (read(&bsize, 4) != 4) 
 		return false;
 
 	//assert(bsize < MAXLEN);
 	if (bsize > dataSize)
 		data = (char*)realloc(data, dataSize = bsize + KB);
-	gzread(input, data, bsize);
+	read(data, bsize);
 
 	int32_t *di = (int32_t*)data;
 
@@ -102,20 +145,33 @@ bool BAMParser::readNext (void)
 	int l_read_name = di[2] & 0xff;
 	int n_cigar_op = di[3] & 0xffff;
 	int l_seq = di[4];
+	const char *chr = chromosomes[di[0]];
+	const char *pe_chr = chromosomes[di[5]];
+	if (di[5] != -1 && di[5] == di[0])
+		pe_chr = "=";
+	size_t chrLen = strlen(chr) + 1, pe_chrLen = strlen(pe_chr) + 1;
+
+	int tagsPos = 8 * 4 + l_read_name + 4 * n_cigar_op + (l_seq + 1) / 2 + l_seq;
+
+	// Text is written straight into the record buffer. Fixed fields are reserved upfront 
+	// together with an estimate for the tags; tags that do not fit reserve more space later
+	char *buf = reserve(currentRecord.line, 
+		l_read_name + chrLen + 10 * n_cigar_op + 2 + pe_chrLen + 2 * (l_seq + 2) + 4 * max(0, bsize - tagsPos));
 
 	// rn
-	strncpy(buf, data + 8 * 4, l_read_name);
-	currentRecord.strFields[Record::RN] = buf - line;
+	memcpy(buf, data + 8 * 4, l_read_name);
+	currentRecord.strFields[Record::RN] = 0;
+	currentRecord.strSizes[Record::RN] = l_read_name - 1;
 	buf += l_read_name;
 
 	// flag
  	currentRecord.intFields[Record::MF] = di[3] >> 16;
 
  	// chr
- 	string chr = chromosomes[di[0]];
-	strncpy(buf, chr.c_str(), chr.size() + 1);
-	currentRecord.strFields[Record::CHR] = buf - line;
-	buf += chr.size() + 1;	 	
+	memcpy(buf, chr, chrLen);
+	currentRecord.strFields[Record::CHR] = buf - currentRecord.line;
+	currentRecord.strSizes[Record::CHR] = chrLen - 1;
+	buf += chrLen;	 	
 
  	// loc
  	currentRecord.intFields[Record::LOC] = di[1] ; // + 1;
@@ -125,23 +181,22 @@ bool BAMParser::readNext (void)
  	
  	// cigar
  	uint32_t *op = (uint32_t*)(data + 8 * 4 + l_read_name);
- 	cc = 0;
-	for (int i = 0; i < n_cigar_op; i++)
-		cc += sprintf(buf + cc, "%d%c", op[i] >> 4, "MIDNSHP=X"[op[i] & 0xf]);
+ 	currentRecord.strFields[Record::CIGAR] = buf - currentRecord.line;
+	for (int i = 0; i < n_cigar_op; i++) {
+		buf = writeInt(buf, op[i] >> 4);
+		*buf++ = "MIDNSHP=X"[op[i] & 0xf];
+	}
 	if (n_cigar_op == 0)
-		buf[cc++] = '*';
+		*buf++ = '*';
+	currentRecord.strSizes[Record::CIGAR] = buf - currentRecord.line - currentRecord.strFields[Record::CIGAR];
+	*buf++ = 0;
 	n_cigar_op *= 4;
-	buf[cc++] = 0;
- 	currentRecord.strFields[Record::CIGAR] = buf - line;
-	buf += cc;
 
  	// p_chr
- 	string pe_chr = chromosomes[di[5]];
- 	if (pe_chr != "*" && pe_chr == chr)
- 		pe_chr = "=";
- 	strncpy(buf, pe_chr.c_str(), pe_chr.size() + 1);
-	currentRecord.strFields[Record::P_CHR] = buf - line;
-	buf += pe_chr.size() + 1;
+	memcpy(buf, pe_chr, pe_chrLen);
+	currentRecord.strFields[Record::P_CHR] = buf - currentRecord.line;
+	currentRecord.strSizes[Record::P_CHR] = pe_chrLen - 1;
+	buf += pe_chrLen;
 
 	// p_loc
  	currentRecord.intFields[Record::P_LOC] = di[6] ; //+ 1;
@@ -151,55 +206,67 @@ bool BAMParser::readNext (void)
 
  	// seq
  	char *sq = data + 8 * 4 + l_read_name + n_cigar_op;
- 	cc = 0;
+ 	currentRecord.strFields[Record::SEQ] = buf - currentRecord.line;
  	for (int i = 0; i < l_seq; i++)
- 		buf[cc++] = "=ACMGRSVTWYHKDBN"[(sq[i / 2] >> ((1 - i % 2) * 4)) & 0xf];
+ 		*buf++ = "=ACMGRSVTWYHKDBN"[(sq[i / 2] >> ((1 - i % 2) * 4)) & 0xf];
  	if (l_seq == 0)
- 		buf[cc++] = '*';
- 	buf[cc++] = 0;
- 	currentRecord.strFields[Record::SEQ] = buf - line;
-	buf += cc;
+ 		*buf++ = '*';
+ 	currentRecord.strSizes[Record::SEQ] = buf - currentRecord.line - currentRecord.strFields[Record::SEQ];
+ 	*buf++ = 0;
  	
  	// qual
  	char *q = data + 8 * 4 + l_read_name + n_cigar_op + (l_seq + 1) / 2;
- 	cc = 0;
- 	for (int i = 0; i < l_seq; i++)
- 		buf[cc++] = q[i] + 33;
+ 	currentRecord.strFields[Record::QUAL] = buf - currentRecord.line;
+ 	if (l_seq && (uint8_t)q[0] == 0xff) // missing qualities
+ 		*buf++ = '*';
+ 	else for (int i = 0; i < l_seq; i++)
+ 		*buf++ = q[i] + 33;
  	if (l_seq == 0)
- 		buf[cc++] = '*';
- 	buf[cc++] = 0;
- 	currentRecord.strFields[Record::QUAL] = buf - line;
-	buf += cc;
+ 		*buf++ = '*';
+ 	currentRecord.strSizes[Record::QUAL] = buf - currentRecord.line - currentRecord.strFields[Record::QUAL];
+ 	*buf++ = 0;
 
-	currentRecord.strFields[Record::OPT] = buf - line;
+	currentRecord.strFields[Record::OPT] = buf - currentRecord.line;
 
  	// optional data ...
- 	int pos = 8 * 4 + l_read_name + n_cigar_op + (l_seq + 1) / 2 + l_seq;
+ 	int pos = tagsPos;
  	if (pos >= bsize)
  		buf[0] = 0;
  	else 
  		currentRecord.strFields[Record::OPT]++; // avoid \t
 	while (pos < bsize) {
-		*buf = 0, buf++;
 		char t = data[pos + 2]; 
-		buf += sprintf(buf, "%c%c:", data[pos], data[pos+1]); 
+		switch (t) { 
+			case 'Z': 
+			case 'H': 
+				buf = reserve(buf, 8 + strnlen(data + pos + 3, bsize - pos - 3)); 
+				break;
+			case 'B': 
+				buf = reserve(buf, 16 + 24 * (size_t)*(uint32_t*)(data + pos + 4)); 
+				break;
+			default:
+				buf = reserve(buf, 32);
+		}
+		*buf++ = '\t';
+		*buf++ = data[pos], *buf++ = data[pos + 1], *buf++ = ':';
 		pos += 3;
 		switch (t) {
-			case 'A': buf += sprintf(buf, "A:%c", data[pos]); pos++; break;
-			case 'c': buf += sprintf(buf, "i:%d", *(int8_t*)(data + pos)); pos += 1; break;
-			case 'C': buf += sprintf(buf, "i:%u", *(uint8_t*)(data + pos)); pos += 1; break;
-			case 's': buf += sprintf(buf, "i:%d", *(int16_t*)(data + pos)); pos += 2; break;
-			case 'S': buf += sprintf(buf, "i:%u", *(uint16_t*)(data + pos)); pos += 2; break;
-			case 'i': buf += sprintf(buf, "i:%d", *(int32_t*)(data + pos)); pos += 4; break;
-			case 'I': buf += sprintf(buf, "i:%u", *(uint32_t*)(data + pos)); pos += 4; break;
+			case 'A': *buf++ = 'A', *buf++ = ':', *buf++ = data[pos]; pos++; break;
+			case 'c': *buf++ = 'i', *buf++ = ':'; buf = writeInt(buf, *(int8_t*)(data + pos)); pos += 1; break;
+			case 'C': *buf++ = 'i', *buf++ = ':'; buf = writeInt(buf, *(uint8_t*)(data + pos)); pos += 1; break;
+			case 's': *buf++ = 'i', *buf++ = ':'; buf = writeInt(buf, *(int16_t*)(data + pos)); pos += 2; break;
+			case 'S': *buf++ = 'i', *buf++ = ':'; buf = writeInt(buf, *(uint16_t*)(data + pos)); pos += 2; break;
+			case 'i': *buf++ = 'i', *buf++ = ':'; buf = writeInt(buf, *(int32_t*)(data + pos)); pos += 4; break;
+			case 'I': *buf++ = 'i', *buf++ = ':'; buf = writeInt(buf, *(uint32_t*)(data + pos)); pos += 4; break;
 			case 'f': buf += sprintf(buf, "f:%g", *(float*)(data + pos)); pos += 4; break;
 			case 'd': buf += sprintf(buf, "d:%lg", *(double*)(data + pos)); pos += 8; break;
 			case 'Z': 
 			case 'H': {
-				buf += sprintf(buf, "%c:", t); 
-				while (data[pos]) 
-					buf += sprintf(buf, "%c", data[pos++]); 
-				pos++; 
+				*buf++ = t, *buf++ = ':';
+				size_t len = strlen(data + pos);
+				memcpy(buf, data + pos, len);
+				buf += len;
+				pos += len + 1; 
 				break;
 			}
 			case 'B': {
@@ -224,7 +291,7 @@ bool BAMParser::readNext (void)
 		}
 	}
 	*buf = 0;
-	currentRecord.lineSize = buf - currentRecord.line;
+	currentRecord.strSizes[Record::OPT] = buf - currentRecord.line - currentRecord.strFields[Record::OPT];
 	currentRecord.lineLength = buf - currentRecord.line;
 
 	// printf("%s\n", currentRecord.getFullRecord().c_str());
@@ -234,11 +301,13 @@ bool BAMParser::readNext (void)
 
 bool BAMParser::hasNext (void) 
 {
-	return !gzeof(input);
+	return bgzf ? !bgzf->eof() : !gzeof(input);
 }
 
 size_t BAMParser::fpos (void) 
 {
+	if (bgzf)
+		return bgzf->tell();
 	return lseek(fileno(fd), 0L, SEEK_CUR);
 }
 
@@ -247,13 +316,13 @@ size_t BAMParser::fsize (void)
 	return file_size;
 }
 
- Record BAMParser::next (void) 
+void BAMParser::next (Record &record) 
 {
-	return currentRecord;
+	swap(currentRecord, record);
 }
 
 string BAMParser::head (void) 
 {
-	return currentRecord.getChromosome();
+	return string(currentRecord.getChromosome(), currentRecord.getChromosomeSize());
 }
 
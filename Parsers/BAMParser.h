@@ -11,9 +11,12 @@
 #include "Parser.h"
 #include "Record.h"
 
+class BGZFReader;
+
 class BAMParser: public Parser {
 	gzFile input;
 	FILE *fd;
+	shared_ptr<BGZFReader> bgzf;
 	shared_ptr<File> webFile;
 
 	Record currentRecord;
@@ -31,6 +34,8 @@ public:
 
 private:
 	void readChromosomeInformation(void);
+	char *reserve (char *buf, size_t sz);
+	size_t read (void *buffer, size_t size);
 
 public:
 	std::string readComment (void);
@@ -42,7 +47,7 @@ public:
 
 public:
 	void parse (void);
-	Record next (void);
+	void next (Record &record);
 	std::string head (void);
 };
 
@@ -0,0 +1,207 @@
+#include "BGZFReader.h"
+
+#include <zlib.h>
+using namespace std;
+
+static const size_t BGZFHeaderSize = 18;
+static const size_t BGZFMaxBlockSize = 64 * KB;
+
+static inline bool isBGZFHeader (const uint8_t *h)
+{
+	// gzip magic, deflate, FEXTRA, XLEN >= 6, first subfield BC with SLEN 2
+	return h[0] == 31 && h[1] == 139 && h[2] == 8 && (h[3] & 4)
+		&& (h[10] | (h[11] << 8)) >= 6
+		&& h[12] == 'B' && h[13] == 'C' && h[14] == 2 && h[15] == 0;
+}
+
+bool BGZFReader::IsBGZF (FILE *fd)
+{
+	uint8_t h[BGZFHeaderSize];
+	bool result = fread(h, 1, BGZFHeaderSize, fd) == BGZFHeaderSize && isBGZFHeader(h);
+	fseek(fd, 0L, SEEK_SET);
+	return result;
+}
+
+BGZFReader::BGZFReader (FILE *fd):
+	fd(fd), filePos(0), filled(RingSize), empty(RingSize),
+	error(nullptr), isEOF(false), consumed(0),
+	inflatedBytes(0), compressedBytes(0), inflateTime(0)
+{
+	for (int i = 0; i < RingSize; i++) {
+		auto b = make_shared<Batch>();
+		b->compressed = Array<uint8_t>(BlocksPerBatch * BGZFMaxBlockSize, BGZFMaxBlockSize);
+		b->data = Array<uint8_t>(BlocksPerBatch * BGZFMaxBlockSize, BGZFMaxBlockSize);
+		b->blocks = Array<size_t>(BlocksPerBatch + 1);
+		b->dataOffsets = Array<size_t>(BlocksPerBatch + 1);
+		empty.push(b);
+	}
+	startTime = zaman();
+	readAhead = thread(&BGZFReader::readAheadLoop, this);
+}
+
+BGZFReader::~BGZFReader (void)
+{
+	empty.close();
+	filled.close();
+	readAhead.join();
+
+	double wall = (zaman() - startTime) / 1000000.0;
+	double cpu = inflateTime / 1000000.0;
+	double mb = inflatedBytes / (double)(MB);
+	LOG("BGZF: inflated %'.1lf MB from %'.1lf MB in %.1lfs (%.1lf MB/s, %.1lf MB/s per thread)",
+		mb, compressedBytes / (double)(MB), wall,
+		wall > 0 ? mb / wall : 0, cpu > 0 ? mb / cpu : 0);
+}
+
+// Appends the next block to the batch. Returns false at the end of file
+bool BGZFReader::readBlock (Batch &b)
+{
+	uint8_t h[BGZFHeaderSize];
+	size_t sz = fread(h, 1, BGZFHeaderSize, fd);
+	if (sz == 0)
+		return false;
+	if (sz != BGZFHeaderSize || !isBGZFHeader(h))
+		throw DZException("Invalid BGZF block at offset %'lu", filePos);
+
+	size_t blockSize = (h[16] | (h[17] << 8)) + 1;
+	if (blockSize < BGZFHeaderSize + 8)
+		throw DZException("Invalid BGZF block size at offset %'lu", filePos);
+
+	size_t start = b.compressed.size();
+	b.compressed.resize(start + blockSize);
+	memcpy(b.compressed.data() + start, h, BGZFHeaderSize);
+	if (fread(b.compressed.data() + start + BGZFHeaderSize, 1, blockSize - BGZFHeaderSize, fd) != blockSize - BGZFHeaderSize)
+		throw DZException("Truncated BGZF block at offset %'lu", filePos);
+	filePos += blockSize;
+
+	uint8_t *t = b.compressed.data() + start + blockSize - 4;
+	size_t inflatedSize = t[0] | (t[1] << 8) | (t[2] << 16) | ((size_t)t[3] << 24);
+	if (inflatedSize > BGZFMaxBlockSize)
+		throw DZException("Invalid BGZF block at offset %'lu", filePos - blockSize);
+
+	b.blocks.add(start + blockSize);
+	b.dataOffsets.add(b.dataOffsets[b.dataOffsets.size() - 1] + inflatedSize);
+	return true;
+}
+
+void BGZFReader::inflateBlock (Batch &b, int i)
+{
+	uint64_t start = zaman();
+
+	uint8_t *in = b.compressed.data() + b.blocks[i];
+	size_t inSize = b.blocks[i + 1] - b.blocks[i];
+	size_t xlen = in[10] | (in[11] << 8);
+	uint8_t *out = b.data.data() + b.dataOffsets[i];
+	size_t outSize = b.dataOffsets[i + 1] - b.dataOffsets[i];
+
+	z_stream stream;
+	stream.zalloc = Z_NULL;
+	stream.zfree = Z_NULL;
+	stream.opaque = Z_NULL;
+	stream.next_in = in + 12 + xlen;
+	stream.avail_in = inSize - 12 - xlen - 8;
+	stream.next_out = out;
+	stream.avail_out = outSize;
+	if (inflateInit2(&stream, -15) != Z_OK)
+		throw DZException("Cannot initialize inflate");
+	int s = inflate(&stream, Z_FINISH);
+	inflateEnd(&stream);
+	if (s != Z_STREAM_END || stream.total_out != outSize)
+		throw DZException("BGZF inflate failed");
+
+	uint8_t *t = in + inSize - 8;
+	uint32_t crc = t[0] | (t[1] << 8) | (t[2] << 16) | ((uint32_t)t[3] << 24);
+	if (crc32(crc32(0L, Z_NULL, 0), out, outSize) != crc)
+		throw DZException("BGZF block CRC mismatch");
+
+	inflatedBytes += outSize;
+	compressedBytes += inSize;
+	inflateTime += zaman() - start;
+}
+
+void BGZFReader::readAheadLoop (void)
+{
+	ZAMAN_THREAD_ROOT("Compress_");
+	try {
+		shared_ptr<Batch> b;
+		while (empty.pop(b)) {
+			ZAMAN_START(BGZF);
+			b->compressed.resize(0);
+			b->blocks.resize(0);
+			b->blocks.add(0);
+			b->dataOffsets.resize(0);
+			b->dataOffsets.add(0);
+			b->pos = 0;
+
+			ZAMAN_START(Read);
+			int n = 0;
+			while (n < BlocksPerBatch && readBlock(*b))
+				n++;
+			b->fileEnd = filePos;
+			ZAMAN_END(Read);
+			if (!n) {
+				ZAMAN_END(BGZF);
+				break;
+			}
+			b->data.resize(b->dataOffsets[n]);
+
+			ZAMAN_START(Inflate);
+			TaskGroup tasks;
+			int chunks = min(n, (int)ThreadPool.size());
+			for (int c = 0; c < chunks; c++) {
+				tasks.run([&, c]() {
+					for (int i = c * n / chunks; i < (c + 1) * n / chunks; i++)
+						inflateBlock(*b, i);
+				});
+			}
+			tasks.wait();
+			ZAMAN_END(Inflate);
+			ZAMAN_END(BGZF);
+
+			if (!filled.push(b))
+				break;
+		}
+	} catch (...) {
+		error = current_exception();
+	}
+	ZAMAN_THREAD_JOIN();
+	filled.close();
+}
+
+size_t BGZFReader::read (void *buffer, size_t size)
+{
+	uint8_t *out = (uint8_t*)buffer;
+	size_t got = 0;
+	while (got < size) {
+		if (current && current->pos < current->data.size()) {
+			size_t sz = min(size - got, current->data.size() - current->pos);
+			memcpy(out + got, current->data.data() + current->pos, sz);
+			current->pos += sz;
+			got += sz;
+			continue;
+		}
+		if (current) {
+			consumed = current->fileEnd;
+			empty.push(current);
+			current.reset();
+		}
+		if (!filled.pop(current)) {
+			current.reset();
+			if (error)
+				rethrow_exception(error);
+			isEOF = true;
+			break;
+		}
+	}
+	return got;
+}
+
+bool BGZFReader::eof (void)
+{
+	return isEOF;
+}
+
+size_t BGZFReader::tell (void)
+{
+	return consumed;
+}
@@ -0,0 +1,61 @@
+#ifndef BGZFReader_H
+#define BGZFReader_H
+
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <stdio.h>
+
+#include "../Common.h"
+#include "../BoundedQueue.h"
+
+// Reader for BGZF (blocked gzip) files.
+// A read-ahead thread scans block boundaries and inflates batches of blocks
+// on the scheduler workers; inflated batches are consumed in file order
+// from a fixed ring of reusable buffers.
+class BGZFReader {
+	static const int BlocksPerBatch = 64; // ~4MB of inflated data
+	static const int RingSize = 4;
+
+	struct Batch {
+		Array<uint8_t> compressed;
+		Array<size_t> blocks; // block starts in compressed, followed by its end
+		Array<uint8_t> data;
+		Array<size_t> dataOffsets;
+		size_t pos;
+		size_t fileEnd; // file offset after the last block of the batch
+	};
+
+	FILE *fd;
+	size_t filePos;
+
+	BoundedQueue<shared_ptr<Batch>> filled, empty;
+	shared_ptr<Batch> current;
+	std::thread readAhead;
+	std::exception_ptr error;
+	bool isEOF;
+	size_t consumed;
+
+	std::atomic<uint64_t> inflatedBytes, compressedBytes, inflateTime;
+	uint64_t startTime;
+
+public:
+	BGZFReader (FILE *fd);
+	~BGZFReader (void);
+
+public:
+	// Checks the header of the first block and rewinds the file
+	static bool IsBGZF (FILE *fd);
+
+public:
+	size_t read (void *buffer, size_t size);
+	bool eof (void);
+	size_t tell (void);
+
+private:
+	void readAheadLoop (void);
+	bool readBlock (Batch &b);
+	void inflateBlock (Batch &b, int i);
+};
+
+#endif // BGZFReader_H
@@ -20,7 +20,9 @@ public:
 	virtual size_t fpos (void) = 0;
 	virtual size_t fsize (void) = 0;
 	virtual std::string head (void) = 0;
-	virtual Record next (void) = 0;
+	// Hands the current record over to the caller. 
+	// Buffer previously held by record is reused for the next one
+	virtual void next (Record &record) = 0;
 	virtual bool readNext () = 0;
 
 };
@@ -9,8 +9,10 @@
 
 class Record {
 	char *line;
-	size_t lineLength, lineSize;
-	std::array<int32_t, 7> strFields;
+	size_t lineLength, lineSize; // used and allocated size of line
+	std::shared_ptr<void> buffer; // if set, line points into this shared buffer (e.g. mapped input) and is not owned
+	std::array<int32_t, 7> strFields; // offsets of the string fields within line
+	std::array<int32_t, 7> strSizes; // their sizes: fields are not necessarily terminated (e.g. mapped input)
 	std::array<int32_t, 5> intFields;
 
 private:
@@ -41,7 +43,7 @@ public:
 	}
 	~Record (void)
 	{
-		if (line) {
+		if (line && !buffer) {
 			free(line);
 			line = 0;
 		}
@@ -52,12 +54,13 @@ public:
 	   // LOG("Copying record of size %d %d", a.lineLength, a.lineSize);
 
 		strFields = a.strFields;
+		strSizes = a.strSizes;
 		intFields = a.intFields;
 		lineLength = a.lineLength;
-		lineSize = a.lineSize;
-		line = (char*)malloc(a.lineSize + 1);
-		std::copy(a.line, a.line + a.lineSize, line);
-		line[lineSize] = 0;
+		lineSize = a.line ? a.lineLength + 1 : 0; // copy is right-sized
+		line = a.line ? (char*)malloc(lineSize) : 0;
+		if (line)
+			std::copy(a.line, a.line + lineSize, line);
 
 		ZAMAN_END(Record_Copy);
 	}
@@ -79,10 +82,24 @@ public:
 		using std::swap;
 
 		swap(a.strFields, b.strFields);
+		swap(a.strSizes, b.strSizes);
 		swap(a.intFields, b.intFields);
 		swap(a.lineLength, b.lineLength);
 		swap(a.lineSize, b.lineSize);
 		swap(a.line, b.line);
+		swap(a.buffer, b.buffer);
+	}
+
+public:
+	// Drops the shared buffer, so that the parser can allocate the line again
+	// and the buffer (e.g. a chunk of mapped input) can be released
+	void detach (void)
+	{
+		if (buffer) {
+			line = 0;
+			lineLength = lineSize = 0;
+			buffer.reset();
+		}
 	}
 
 
@@ -100,48 +117,52 @@ public:
 	const char* getQuality() const { return &line[0] + strFields[QUAL]; }
 	const char* getOptional() const { return &line[0] + strFields[OPT]; }
 
-	size_t getReadNameSize() const { return strlen(getReadName()); }
-	size_t getSequenceSize() const { return strFields[QUAL] - strFields[SEQ] - 1; }
-	size_t getOptionalSize() const { return lineLength - strFields[OPT]; }
+	size_t getReadNameSize() const { return strSizes[RN]; }
+	size_t getChromosomeSize() const { return strSizes[CHR]; }
+	size_t getCigarSize() const { return strSizes[CIGAR]; }
+	size_t getPairChromosomeSize() const { return strSizes[P_CHR]; }
+	size_t getSequenceSize() const { return strSizes[SEQ]; }
+	size_t getQualitySize() const { return strSizes[QUAL]; }
+	size_t getOptionalSize() const { return strSizes[OPT]; }
 
 
 	std::string getFullRecord() const {
 		return S(
-			"%s\t%d\t%s\t%zu\t%d\t%s\t%s\t%zu\t%d\t%s\t%s\t%s",
-			getReadName(),
+			"%.*s\t%d\t%.*s\t%zu\t%d\t%.*s\t%.*s\t%zu\t%d\t%.*s\t%.*s\t%.*s",
+			(int)getReadNameSize(), getReadName(),
 			getMappingFlag(),
-			getChromosome(),
+			(int)getChromosomeSize(), getChromosome(),
 			getLocation(),
 			getMappingQuality(),
-			getCigar(),
-			getPairChromosome(),
+			(int)getCigarSize(), getCigar(),
+			(int)getPairChromosomeSize(), getPairChromosome(),
 			getPairLocation(),
 			getTemplateLenght(),
-			getSequence(),
-			getQuality(),
-			getOptional()
+			(int)getSequenceSize(), getSequence(),
+			(int)getQualitySize(), getQuality(),
+			(int)getOptionalSize(), getOptional()
 		);
 	}
 
 	void testRecords() const {
 		LOG(
-			"%s %d %s %zu %d %s %s %zu %d %s %s %s\n",
-			getReadName(),
+			"%.*s %d %.*s %zu %d %.*s %.*s %zu %d %.*s %.*s %.*s\n",
+			(int)getReadNameSize(), getReadName(),
 			getMappingFlag(),
-			getChromosome(),
+			(int)getChromosomeSize(), getChromosome(),
 			getLocation(),
 			getMappingQuality(),
-			getCigar(),
-			getPairChromosome(),
+			(int)getCigarSize(), getCigar(),
+			(int)getPairChromosomeSize(), getPairChromosome(),
 			getPairLocation(),
 			getTemplateLenght(),
-			getSequence(),
-			getQuality(),
-			getOptional()
+			(int)getSequenceSize(), getSequence(),
+			(int)getQualitySize(), getQuality(),
+			(int)getOptionalSize(), getOptional()
 		);
 	}
 
-	size_t getLineLength() { return lineLength; };
+	size_t getLineLength() const { return lineLength; };
 };
 template<>
 size_t sizeInMemory(Record t);
@@ -3,9 +3,37 @@
 #include "SAMParser.h"
 
 #include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <smmintrin.h>
 using namespace std;
 
-SAMParser::SAMParser (const string &filename)
+struct SAMParser::Mapping {
+	const char *data;
+	size_t size, mapped;
+	~Mapping (void)
+	{
+		munmap((void*)data, mapped);
+	}	
+};
+
+// Lines of one chunk; pages which belong only to the chunk are released
+// once all of its records are gone
+struct SAMParser::Chunk {
+	shared_ptr<Mapping> mapping;
+	size_t start, end;
+	~Chunk (void)
+	{
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t s = (start + page - 1) / page * page, e = end / page * page;
+		if (s < e)
+			madvise((void*)(mapping->data + s), e - s, MADV_DONTNEED);
+	}	
+};
+
+SAMParser::SAMParser (const string &filename):
+	mappingPos(0), chunkRecord(0), isEOF(false)
 {
 	Parser::fname = filename;
 
@@ -14,13 +42,32 @@ SAMParser::SAMParser (const string &filename)
 		input = (FILE*) webFile->handle();
 	} else {
 		input = fopen(filename.c_str(), "r");
-	}
+	}	
 	if (input == NULL)	
 		throw DZException("Cannot open the file %s", filename.c_str());
 
 	fseek(input, 0L, SEEK_END);
 	file_size = ftell(input);
 	fseek(input, 0L, SEEK_SET);
+
+	// Reserve at least one zeroed byte after the file, so that the numbers of the last line are always terminated.
+	// Mapping is shared and read-only: pages stay in the page cache and are never duplicated
+	struct stat st;
+	if (file_size && !fstat(fileno(input), &st) && S_ISREG(st.st_mode)) {
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t mapped = (file_size / page + 1) * page;
+		void *p = mmap(0, mapped, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p != MAP_FAILED) {
+			if (mmap(p, file_size, PROT_READ, MAP_SHARED | MAP_FIXED, fileno(input), 0) != MAP_FAILED) {
+				mapping = make_shared<Mapping>();
+				mapping->data = (const char*)p;
+				mapping->size = file_size;
+				mapping->mapped = mapped;
+			} else {
+				munmap(p, mapped);
+			}
+		}
+	}	
 }
 
 SAMParser::~SAMParser (void) 
@@ -31,6 +78,18 @@ SAMParser::~SAMParser (void)
 string SAMParser::readComment (void)  
 {
 	string s;
+	if (mapping) {
+		const char *data = mapping->data;
+		while (mappingPos < mapping->size && data[mappingPos] == '@') {
+			const char *e = (const char*)memchr(data + mappingPos, '\n', mapping->size - mappingPos);
+			size_t end = e ? e - data + 1 : mapping->size;
+			s.append(data + mappingPos, end - mappingPos);
+			mappingPos = end;
+		}
+		readNext();
+		return s;
+	}	
+
 	while ((currentRecord.lineLength = getline(&currentRecord.line, &currentRecord.lineSize, input)) != -1) {
 		if (currentRecord.line[0] != '@') {
 			parse(currentRecord);
@@ -38,27 +97,106 @@ string SAMParser::readComment (void)
 		} else {
 			s += currentRecord.line;
 		}
-	}
+	}	
 	return s;
 }
 
+// Finds the lines of the next chunk with SIMD and tokenizes them in parallel
+bool SAMParser::readChunk (void)
+{
+	if (mappingPos >= mapping->size)
+		return false;
+
+	ZAMAN_START(ReadChunk);
+	const char *data = mapping->data;
+	size_t start = mappingPos, end = min(mapping->size, start + ChunkSize);
+	if (end < mapping->size) {
+		const char *e = (const char*)memchr(data + end, '\n', mapping->size - end);
+		end = e ? e - data + 1 : mapping->size;
+	}	
+
+	lines.resize(0);
+	lines.add(start);
+	const __m128i nl = _mm_set1_epi8('\n');
+	size_t i = start;
+	for (; i + 16 <= end; i += 16) {
+		uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i)), nl));
+		while (mask) {
+			lines.add(i + __builtin_ctz(mask) + 1);
+			mask &= mask - 1;
+		}
+	}	
+	for (; i < end; i++)
+		if (data[i] == '\n')
+			lines.add(i + 1);
+	if (lines[lines.size() - 1] != end) // last line without newline
+		lines.add(end);
+
+	size_t count = lines.size() - 1;
+	if (chunkRecords.capacity() < count)
+		chunkRecords = Array<Record>(count);
+	chunkRecords.resize(count);
+	chunkRecord = 0;
+
+	auto chunk = make_shared<Chunk>();
+	chunk->mapping = mapping;
+	chunk->start = start;
+	chunk->end = end;
+
+	TaskGroup tasks;
+	size_t threads = ThreadPool.size(), threadSz = count / threads + 1;
+	for (size_t t = 0; t < threads; t++) {
+		size_t s = t * threadSz, e = min(count, (t + 1) * threadSz);
+		tasks.run([&, s, e]() {
+			for (size_t i = s; i < e; i++) {
+				Record &r = chunkRecords[i];
+				if (r.line && !r.buffer)
+					free(r.line);
+				r.buffer = chunk;
+				r.line = (char*)data + lines[i];
+				r.lineSize = 0;
+				tokenize(r, lines[i + 1] - lines[i]);
+			}
+		});
+	}	
+	tasks.wait();
+	mappingPos = end;
+	ZAMAN_END(ReadChunk);
+	return true;
+}
+
 bool SAMParser::readNext ()  
 {
+	if (mapping) {
+		if (chunkRecord == chunkRecords.size() && !readChunk()) {
+			isEOF = true;
+			return false;
+		}
+		swap(currentRecord, chunkRecords[chunkRecord++]);
+		assert(currentRecord.line[0] != '@');
+		return true;
+	}	
+
+	currentRecord.detach();
 	if ((currentRecord.lineLength = getline(&currentRecord.line, &currentRecord.lineSize, input)) != -1) {
 		assert(currentRecord.line[0] != '@');
 		parse(currentRecord);
 		return true;
-	}
+	}	
 	return false;
 }
 
 bool SAMParser::hasNext (void) 
 {
+	if (mapping)
+		return !isEOF;
 	return !feof(input);
 }
 
 size_t SAMParser::fpos (void) 
 {
+	if (mapping)
+		return chunkRecord < lines.size() ? lines[chunkRecord] : mappingPos;
 	return ftell(input);
 }
 
@@ -69,47 +207,72 @@ size_t SAMParser::fsize (void)
 
 void SAMParser::parse (Record &record) 
 {
-	char *line = &record.line[0];
-	int l = strlen(line) - 1;
-	while (l && (line[l] == '\r' || line[l] == '\n'))
-		line[l--] = 0;
+	tokenize(record, strlen(record.line));
+}
+
+// Sets the size of the field which ends at given position, if it is a string field
+void SAMParser::endField (Record &record, int field, size_t end)
+{
+	static const int stringField[12] = { 
+		Record::RN, -1, Record::CHR, -1, -1, Record::CIGAR, Record::P_CHR, -1, -1, Record::SEQ, Record::QUAL, Record::OPT 
+	};
+	int sf = stringField[field];
+	if (sf != -1)
+		record.strSizes[sf] = end - record.strFields[sf];
+}
+
+// Splits the line of given length (including the newline) into fields.
+// Tabs are located 16 bytes at a time; the line itself is not modified,
+// only the offsets and the sizes of the fields are set
+void SAMParser::tokenize (Record &record, size_t length)
+{
+	const char *line = record.line;
+	size_t l = length;
+	while (l > 1 && (line[l - 1] == '\r' || line[l - 1] == '\n'))
+		l--;
+	record.lineLength = length;
 	record.strFields[0] = 0;
-	char *c = line;
+
+	const __m128i tab = _mm_set1_epi8('\t');
 	int f = 1, sfc = 1, ifc = 0;
-	while (*c) {
-		if (*c == '\t') {
+	for (size_t i = 0; i < l && f < 12; i += 16) {
+		uint32_t mask = 0;
+		if (i + 16 <= l) {
+			mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(line + i)), tab));
+		} else for (size_t j = i; j < l; j++) {
+			if (line[j] == '\t')
+				mask |= 1 << (j - i);
+		}
+		while (mask && f < 12) {
+			const char *c = line + i + __builtin_ctz(mask);
+			mask &= mask - 1;
+			endField(record, f - 1, c - line);
 			if (f == 1 || f == 3 || f == 4 || f == 7 || f == 8)
 				record.intFields[ifc++] = atoi(c + 1);
 			else
 				record.strFields[sfc++] = (c + 1) - line;
 			f++;
-			*c = 0;
-			if (f == 12) {
-				c++;
-				while (*c) {
-					if (*c == '\t') *c = 0;
-					c++;
-				}
-				break;
-			}
 		}
-		c++;
 	}	
-	if (f == 11)
-		record.strFields[sfc++] = c - line + 1;
-	
+	endField(record, f - 1, l); // last field ends with the line (tabs within the optional fields are their separators)
+	if (f == 11) { // no optional fields
+		record.strFields[sfc] = l;
+		record.strSizes[sfc++] = 0;
+		record.lineLength = l;
+	}	
+
 	record.intFields[Record::IntField::LOC]--;
 	record.intFields[Record::IntField::P_LOC]--;
 }
 
-Record SAMParser::next (void) 
+void SAMParser::next (Record &record) 
 {
-	return std::move(currentRecord);
+	swap(currentRecord, record);
 }
 
 string SAMParser::head (void) 
 {
-	return currentRecord.getChromosome();
+	return string(currentRecord.getChromosome(), currentRecord.getChromosomeSize());
 }
 
 template<>
@@ -118,3 +281,4 @@ size_t sizeInMemory(Record t) {
 }
 
 
+
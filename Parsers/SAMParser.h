@@ -11,13 +11,26 @@
 #include "Record.h"
 
 class SAMParser: public Parser {
+	// Local files are mapped read-only and tokenized without copying:
+	// records point into the mapping, one chunk of lines at a time
+	static const size_t ChunkSize = 16 * MB;
+	struct Mapping;
+	struct Chunk;
+
 	FILE *input;
 	shared_ptr<File> webFile;
-	
+
     size_t file_size;
 
     Record currentRecord;
 
+	shared_ptr<Mapping> mapping;
+	size_t mappingPos;
+	Array<size_t> lines; // line starts of the current chunk, followed by the chunk end
+	Array<Record> chunkRecords;
+	size_t chunkRecord;
+	bool isEOF;
+
 public:
 	SAMParser (const std::string &filename);
 	~SAMParser (void);
@@ -32,7 +45,12 @@ public:
 public:
 	void parse (Record &line);
 	std::string head (void);
-	Record next (void) ;
+	void next (Record &record);
+
+private:
+	bool readChunk (void);
+	static void tokenize (Record &record, size_t length);
+	static void endField (Record &record, int field, size_t end);
 };
 
 #endif
@@ -1,5 +1,9 @@
 #include "Reference.h"
+#include <algorithm>
 #include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 using namespace std;
 
@@ -14,8 +18,26 @@ using namespace std;
 //	SQ, if exists
 //  No file
 
+Reference::Mapping::Mapping (File &file):
+	data(0), size(file.size())
+{
+	if (!size)
+		return;
+	void *p = mmap(0, size, PROT_READ, MAP_SHARED, fileno((FILE*)file.handle()), 0);
+	if (p != MAP_FAILED)
+		data = (const char*)p;
+}
+
+Reference::Mapping::~Mapping (void)
+{
+	if (data)
+		munmap((void*)data, size);
+}
+
 Reference::Reference (const string &fn):
-	input(nullptr), bufferStart(0), bufferEnd(0)
+	input(nullptr), inputPos(0), bufferStart(0), bufferEnd(0), currentPos(0),
+	mapped(0), mappedLen(0), lineBases(0), lineBytes(0),
+	packed(0), packedBases(0), exceptionsFirst(0), exceptionsLast(0)
 {
 	chromosomes["*"] = {"*", "", "", 0, 0};
 
@@ -34,15 +56,54 @@ Reference::Reference (const string &fn):
 		LOG("Using web directory %s for searching chromosome FASTA files", directory.c_str());
 		return;
 	}
-	loadFromFASTA(fn);
+	source = Source::Get(fn);
+	input = source->input;
+	for (auto &chr: source->chromosomes)
+		chromosomes.insert(chr);
+	filename = source->filename;
+	currentWebFile = source->webFile;
 }
 
 Reference::~Reference (void) 
 {
 }
 
-void Reference::loadFromFASTA (const string &fn)
+shared_ptr<Reference::Source> Reference::Source::Get (const string &fn)
+{
+	static mutex sourcesMutex;
+	static map<string, weak_ptr<Source>> sources;
+
+	lock_guard<mutex> lock(sourcesMutex);
+	string key = File::IsWeb(fn) ? fn : File::FullPath(fn);
+	auto s = sources[key].lock();
+	if (!s) {
+		s = make_shared<Source>(fn);
+		sources[key] = s;
+	} else {
+		DEBUG("Using the loaded reference %s", fn.c_str());
+	}
+	return s;
+}
+
+Reference::Source::Source (const string &fn):
+	stopping(false)
 {
+	char c;
+	try {
+		cache = ReferenceCache::Open(fn);
+	} catch (DZException &e) {
+		WARN("%s, using the FASTA file instead", e.what());
+	}
+	if (cache) {
+		for (size_t i = 0; i < cache->size(); i++) {
+			const char *chr = cache->name((*cache)[i]);
+			chromosomes[chr] = {chr, cache->md5((*cache)[i]), fn, (*cache)[i].len, 0};
+		}
+		LOG("Loaded reference cache %s", ReferenceCache::Path(fn).c_str());
+		filename = File::FullPath(fn);
+		return;
+	}
+
 	input = File::Open(fn, "rb");
 	LOG("Loaded reference file %s", fn.c_str());
 
@@ -56,16 +117,16 @@ void Reference::loadFromFASTA (const string &fn)
 		}
 		if (fastaidx == nullptr)
 			throw DZException("Cannot open FASTA index %s", faidx.c_str());
-		char chr[50];
-		size_t len, loc;
-		while (fscanf((FILE*) fastaidx->handle(), "%s %lu %lu %*lu %*lu", chr, &len, &loc) != EOF) 
-			chromosomes[chr] = {chr, "", fn, len, loc};
+		char chr[1024];
+		size_t len, loc, lineBases, lineBytes;
+		while (fscanf((FILE*) fastaidx->handle(), "%1023s %lu %lu %lu %lu", chr, &len, &loc, &lineBases, &lineBytes) == 5) 
+			chromosomes[chr] = {chr, "", fn, len, loc, lineBases, lineBytes};
 		LOG("Loaded reference index %s", faidx.c_str());
 	} catch (DZException &e) {
 		FILE *fastaidx = 0;
 		if (File::IsWeb(fn)) {
 			input = WebFile::Download(fn, true);
-			currentWebFile = fn;
+			webFile = fn;
 		} else {
 			LOG("FASTA index for %s not found, creating one ...", fn.c_str());
 			fastaidx = fopen(string(fn + ".fai").c_str(), "wb");
@@ -73,17 +134,42 @@ void Reference::loadFromFASTA (const string &fn)
 				WARN("Cannot create reference index for %s", fn.c_str());
 		}
 
+		// Line geometry is kept only if all lines but the last have the same length (as in samtools faidx)
 		string chr = "";
-		size_t cnt = 0, cntfull = 0, pos;
+		size_t cnt = 0, pos = 0;
+		size_t lineBases = 0, lineBytes = 0, curBases = 0, curBytes = 0;
+		bool uniform = true, lastLine = false;
+		auto endLine = [&](void) {
+			if (!curBases) // blank lines may only end the chromosome
+				lastLine = true, uniform = uniform && lineBytes;
+			else if (lastLine || (lineBytes && (curBases > lineBases || curBytes - curBases != lineBytes - lineBases)))
+				uniform = false;
+			else if (!lineBytes)
+				lineBases = curBases, lineBytes = curBytes;
+			else if (curBases < lineBases)
+				lastLine = true;
+			curBases = curBytes = 0;
+		};
+		auto endChromosome = [&](void) {
+			if (curBytes) { // last line without newline
+				curBytes++;
+				endLine();
+			}
+			if (!uniform || !lineBases)
+				lineBases = lineBytes = 0;
+			if (fastaidx) fprintf(fastaidx, "%s\t%lu\t%lu\t%lu\t%lu\n", chr.c_str(), cnt, pos, lineBases, lineBytes);
+			chromosomes[chr].len = cnt;
+			chromosomes[chr].lineBases = lineBases;
+			chromosomes[chr].lineBytes = lineBytes;
+		};
 		while ((c = input->getc()) != EOF) {
 			if (c == '>') {
-				if (chr != "") {
-					if (fastaidx) fprintf(fastaidx, "%s\t%lu\t%lu\t%lu\t%lu\t\n", chr.c_str(), cnt, pos, cnt, cntfull);
-					chromosomes[chr].len = cnt;
-				}
+				if (chr != "") 
+					endChromosome();
 
 				chr = "";
-				cnt = cntfull = 0;
+				cnt = curBases = curBytes = lineBases = lineBytes = 0;
+				uniform = true, lastLine = false;
 				
 				c = input->getc();
 				while (!isspace(c) && c != EOF) 
@@ -96,21 +182,152 @@ void Reference::loadFromFASTA (const string &fn)
 				chromosomes[chr] = {chr, "", filename, 0, pos};
 				continue;
 			}
+			curBytes++;
 			if (!isspace(c)) 
-				cnt++;
-			cntfull++;
-		}
-		if (chr != "") {
-			if (fastaidx) fprintf(fastaidx, "%s\t%lu\t%lu\t%lu\t%lu\n", chr.c_str(), cnt, pos, cnt, cntfull);
-			chromosomes[chr].len = cnt;
+				cnt++, curBases++;
+			if (c == '\n')
+				endLine();
 		}
+		if (chr != "") 
+			endChromosome();
 		if (fastaidx) fclose(fastaidx);
 		input->seek(0);
 	}
 
+	if (!File::IsWeb(fn)) {
+		mapping = make_shared<Mapping>(*input);
+		if (!mapping->data) {
+			WARN("Cannot map reference file %s, reading it instead", fn.c_str());
+			mapping = nullptr;
+		}
+	}
+	for (auto &chr: chromosomes)
+		starts.push_back(chr.second.loc);
+	sort(starts.begin(), starts.end());
 	filename = File::FullPath(fn);
 }
 
+Reference::Source::~Source (void)
+{
+	if (prefetchThread.joinable()) {
+		{
+			lock_guard<mutex> lock(prefetchMutex);
+			stopping = true;
+		}
+		prefetchReady.notify_one();
+		prefetchThread.join();
+	}
+}
+
+void Reference::Source::prefetch (const string &chr)
+{
+	lock_guard<mutex> lock(prefetchMutex);
+	if (!prefetched.insert(chr).second)
+		return;
+	prefetchQueue.push_back(chr);
+	if (!prefetchThread.joinable())
+		prefetchThread = thread(&Source::prefetchLoop, this);
+	prefetchReady.notify_one();
+}
+
+void Reference::Source::prefetchLoop (void)
+{
+	while (1) {
+		string chr;
+		{
+			unique_lock<mutex> lock(prefetchMutex);
+			prefetchReady.wait(lock, [&] { return stopping || prefetchQueue.size(); });
+			if (stopping)
+				return;
+			chr = prefetchQueue.front();
+			prefetchQueue.pop_front();
+		}
+		warm(chr);
+	}
+}
+
+void Reference::Source::verify (const ReferenceCache::Chromosome &c)
+{
+	lock_guard<mutex> lock(verifyMutex);
+	if (verified.count(&c))
+		return;
+	if (!cache->verify(c))
+		throw DZException("Chromosome %s of the reference cache %s does not match its MD5 (rebuild it with deez --index-ref %s)",
+			cache->name(c), ReferenceCache::Path(filename).c_str(), filename.c_str());
+	verified.insert(&c);
+}
+
+// Brings the chromosome into the page cache: the mapped part is touched page by page
+// (so that the readers do not fault), the buffered part is only advised to the kernel
+void Reference::Source::warm (const string &chr)
+{
+	auto it = chromosomes.find(chr);
+	if (it == chromosomes.end())
+		return;
+	int64_t t = zaman();
+	const char *begin = 0, *end = 0;
+	if (cache) {
+		auto c = cache->find(chr);
+		if (!c)
+			return;
+		begin = (const char*)cache->bases(*c);
+		end = (const char*)(cache->exceptions(*c) + c->exceptionCount);
+	} else {
+		const Chromosome &c = it->second;
+		size_t last = upper_bound(starts.begin(), starts.end(), c.loc) == starts.end() 
+			? input->size() : *upper_bound(starts.begin(), starts.end(), c.loc);
+		if (c.lineBases && c.len)
+			last = min(last, c.loc + (c.len - 1) / c.lineBases * c.lineBytes + (c.len - 1) % c.lineBases + 1);
+		if (last <= c.loc)
+			return;
+		if (!mapping) {
+			if (!File::IsWeb(filename))
+				posix_fadvise(fileno((FILE*)input->handle()), c.loc, last - c.loc, POSIX_FADV_WILLNEED);
+			return;
+		}
+		begin = mapping->data + min(c.loc, mapping->size);
+		end = mapping->data + min(last, mapping->size);
+	}
+	size_t page = sysconf(_SC_PAGESIZE);
+	const char *first = (const char*)((size_t)begin / page * page);
+	madvise((void*)first, end - first, MADV_WILLNEED);
+	volatile char sink = 0;
+	for (const char *p = first; p < end && !stopping; p += page)
+		sink += *p;
+	DEBUG("Prefetched chromosome %s (%'lu bytes) in %.2lfs", chr.c_str(), end - begin, (zaman() - t) / 1e6);
+}
+
+bool Reference::mapChromosome (const Chromosome &chr)
+{
+	if (!source || !source->mapping)
+		return false;
+	const Mapping *mapping = source->mapping.get();
+	if (chr.len) {
+		if (!chr.lineBases || chr.lineBytes < chr.lineBases || chr.lineBytes > chr.lineBases + 2)
+			return false;
+		// Earlier DeeZ versions wrote the bases and the bytes of the whole chromosome
+		// in place of the line geometry (e.g. "a 90 3 90 92" for 60 + 30 bases)
+		if (chr.len == chr.lineBases && chr.lineBytes > chr.len + 1)
+			return false;
+		size_t last = chr.loc + (chr.len - 1) / chr.lineBases * chr.lineBytes + (chr.len - 1) % chr.lineBases;
+		if (last >= mapping->size || isspace(mapping->data[last]) || mapping->data[last] == '>')
+			return false;
+		if (chr.len > chr.lineBases) {
+			if (!isspace(mapping->data[chr.loc + chr.lineBases]))
+				return false;
+		} else if (last + 1 < mapping->size && mapping->data[last + 1] != '\n' && mapping->data[last + 1] != '\r') {
+			// single line: it has to end right after the last base
+			return false;
+		}
+	} else if (chr.loc > mapping->size) {
+		return false;
+	}
+	mapped = mapping->data + chr.loc;
+	mappedLen = chr.len;
+	lineBases = chr.lineBases, lineBytes = chr.lineBytes;
+	return true;
+}
+
 string Reference::getChromosomeName (void) const 
 {
 	return currentChr;
@@ -130,16 +347,32 @@ std::string Reference::scanChromosome (const string &s, const SAMComment &samCom
 {
 	buffer = "";
 	bufferStart = bufferEnd = currentPos = 0;
+	mapped = 0;
+	packed = 0;
 
 	if (s == "*")
 		return currentChr = s;
 
+	// not caught below: a corrupted cache must not be replaced by the missing reference
+	const ReferenceCache::Chromosome *cached;
+	if (source && source->cache && (cached = source->cache->find(s)))
+		source->verify(*cached);
 	try {
 		if (directory == "") {
 			auto it = chromosomes.find(s);
-			if (it == chromosomes.end()) 
+			if (it == chromosomes.end() || (source->cache && !(packed = source->cache->find(s)))) 
 				throw DZException("Chromosome %s not found in the reference", s.c_str());
-			input->seek(it->second.loc);
+			if (packed) {
+				packedBases = source->cache->bases(*packed);
+				selectExceptions();
+				it->second.filename = filename;
+				return currentChr = s;
+			}
+			if (mapChromosome(it->second)) {
+				it->second.filename = filename;
+				return currentChr = s;
+			}
+			inputPos = it->second.loc;
 		} else {
 			string fn = directory + "/" + s + ".fa";
 			if (directory.size() && directory[directory.size() - 1] == '/')
@@ -150,6 +383,7 @@ std::string Reference::scanChromosome (const string &s, const SAMComment &samCom
 			} else {
 				input = File::Open(fn, "rb");
 			}
+			inputPos = 0;
 			LOG("Loaded reference file %s for chromosome %s", fn.c_str(), s.c_str());
 			filename = File::FullPath(fn);
 		}
@@ -164,6 +398,7 @@ std::string Reference::scanChromosome (const string &s, const SAMComment &samCom
 			if (jt != it->second.end() && File::IsWeb(jt->second) && currentWebFile != jt->second) {
 				LOG("Loaded reference file %s for chromosome %s via @SQ:UR field", jt->second.c_str(), s.c_str());
 				input = WebFile::Download(currentWebFile = jt->second, true);
+				inputPos = 0;
 				filename = File::FullPath(jt->second);
 			} else {
 				throw DZException("Cannot find reference in @SQ:UR");
@@ -177,6 +412,7 @@ std::string Reference::scanChromosome (const string &s, const SAMComment &samCom
 	}
 	
 	currentChr = s;
+	auto lock = lockInput();
 	c = input->getc();
 	if (c == '>') {
 		currentChr = "";
@@ -191,7 +427,7 @@ std::string Reference::scanChromosome (const string &s, const SAMComment &samCom
 	}
 	chromosomes[currentChr].chr = currentChr;
 	chromosomes[currentChr].filename = filename;
-	chromosomes[currentChr].loc = input->tell();
+	chromosomes[currentChr].loc = inputPos = input->tell();
 	if (chromosomes[currentChr].loc) 
 		chromosomes[currentChr].loc--;
 
@@ -233,6 +469,23 @@ void Reference::loadIntoBuffer(size_t end)
 	assert(currentPos == bufferEnd);
 	if (end < bufferEnd) return;
 
+	if (packed) {
+		bufferEnd = currentPos = end;
+		selectExceptions();
+		return;
+	}
+	if (mapped) { // only hint the kernel to read ahead
+		size_t from = min(bufferEnd, mappedLen), to = min(end, mappedLen);
+		if (from < to) {
+			size_t page = sysconf(_SC_PAGESIZE);
+			size_t start = (size_t)(mapped + from / lineBases * lineBytes) / page * page;
+			size_t stop = (size_t)(mapped + (to - 1) / lineBases * lineBytes + lineBytes);
+			madvise((void*)start, stop - start, MADV_WILLNEED);
+		}
+		bufferEnd = currentPos = end;
+		return;
+	}
+
 	DEBUG("Loading to %'lu", end);
 	
 	buffer.reserve(buffer.size() + (end - bufferEnd + 1));
@@ -240,6 +493,7 @@ void Reference::loadIntoBuffer(size_t end)
 
 	auto it = chromosomes.find(currentChr);
 	if (it != chromosomes.end() && it->second.len > 0) {
+		auto lock = lockInput();
 		while (currentPos < bufferEnd) {
 			buffer += toupper(c);
 			
@@ -250,9 +504,11 @@ void Reference::loadIntoBuffer(size_t end)
 				break;
 			currentPos++;
 		}
+		inputPos = input->tell();
 	}
-	while (currentPos < bufferEnd) 
-		buffer += 'N', currentPos++;
+	// past the end of the chromosome
+	buffer.append(bufferEnd - currentPos, 'N');
+	currentPos = bufferEnd;
 }
 
 // Assumes that everything is loaded
@@ -261,6 +517,10 @@ char Reference::operator[](size_t pos) const
 	assert(pos >= bufferStart); // Access is sequential
 	assert(pos < bufferEnd);
 
+	if (packed)
+		return pos < packed->len ? ReferenceCache::base(packedBases, exceptionsFirst, exceptionsLast, pos) : 'N';
+	if (mapped)
+		return pos < mappedLen ? toupper(mapped[pos / lineBases * lineBytes + pos % lineBases]) : 'N';
 	// LOG("%d [%d] -> %c", pos, bufferStart, buffer[pos - bufferStart]);
 	return buffer[pos - bufferStart];
 }
@@ -268,6 +528,16 @@ char Reference::operator[](size_t pos) const
 string Reference::copy(size_t start, size_t end)
 {
 	assert(start >= bufferStart);
+	if (mapped || packed) {
+		if (end > bufferEnd) {
+			bufferEnd = currentPos = end;
+			if (packed)
+				selectExceptions();
+		}
+		string result(end - start, 'N');
+		fill(start, end, &result[0]);
+		return result;
+	}
 	if (end >= bufferEnd) 
 		loadIntoBuffer(end + 10 * MB);
 	assert(end < bufferEnd);
@@ -275,8 +545,64 @@ string Reference::copy(size_t start, size_t end)
 	return buffer.substr(start - bufferStart, end - start);
 }
 
+const char *Reference::bases(size_t pos, size_t len, char *out) const
+{
+	assert(pos >= bufferStart && pos + len <= bufferEnd);
+	if (!mapped && !packed)
+		return buffer.data() + (pos - bufferStart);
+	fill(pos, pos + len, out);
+	return out;
+}
+
+void Reference::fill(size_t start, size_t end, char *out) const
+{
+	if (packed) {
+		size_t last = min(end, (size_t)packed->len);
+		if (start < last)
+			ReferenceCache::copy(packedBases, exceptionsFirst, exceptionsLast, start, last, out);
+	} else {
+		for (size_t pos = start; pos < min(end, mappedLen); ) {
+			size_t n = min(lineBases - pos % lineBases, min(end, mappedLen) - pos);
+			const char *line = mapped + pos / lineBases * lineBytes + pos % lineBases;
+			transform(line, line + n, out + (pos - start), ::toupper);
+			pos += n;
+		}
+	}
+	// past the end of the chromosome
+	size_t len = max(start, min(end, packed ? (size_t)packed->len : mappedLen));
+	memset(out + (len - start), 'N', end - len);
+}
+
+// Copies [start, end) of the loaded part of r, so that it can be read after r moves on
+void Reference::copyLoaded(const Reference &r, size_t start, size_t end) 
+{
+	source = r.source;
+	mapped = r.mapped;
+	mappedLen = r.mappedLen, lineBases = r.lineBases, lineBytes = r.lineBytes;
+	packed = r.packed, packedBases = r.packedBases;
+	if (mapped || packed || start >= end) {
+		buffer = "";
+		bufferStart = start;
+		bufferEnd = currentPos = max(start, end);
+		if (packed)
+			selectExceptions();
+		return;
+	}
+	assert(start >= r.bufferStart && end <= r.bufferEnd);
+	buffer.assign(r.buffer, start - r.bufferStart, end - start);
+	bufferStart = start;
+	bufferEnd = currentPos = end;
+}
+
 void Reference::trim(size_t start) 
 {
+	if (mapped || packed) {
+		bufferStart = start;
+		bufferEnd = currentPos = max(bufferEnd, start);
+		if (packed)
+			selectExceptions();
+		return;
+	}
 	if (start >= bufferEnd) {
 		buffer = "";
 		bufferStart = bufferEnd = currentPos;
@@ -285,3 +611,27 @@ void Reference::trim(size_t start)
 		bufferStart = start;
 	}
 }
+
+void Reference::selectExceptions (void)
+{
+	const ReferenceCache::Exception *first = source->cache->exceptions(*packed), *last = first + packed->exceptionCount;
+	exceptionsFirst = upper_bound(first, last, bufferStart,
+		[](size_t p, const ReferenceCache::Exception &e) { return p < e.start + e.len; });
+	exceptionsLast = lower_bound(exceptionsFirst, last, bufferEnd,
+		[](const ReferenceCache::Exception &e, size_t p) { return e.start < p; });
+}
+
+void Reference::prefetch (const string &chr) const
+{
+	if (chr != "" && source && directory == "")
+		source->prefetch(chr);
+}
+
+unique_lock<mutex> Reference::lockInput (void)
+{
+	unique_lock<mutex> lock;
+	if (source && input == source->input)
+		lock = unique_lock<mutex>(source->inputMutex);
+	input->seek(inputPos);
+	return lock;
+}
@@ -2,6 +2,12 @@
 #define Reference_H
 
 #include <map>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
 #include <string>
 #include <vector>
 #include <unordered_map>
@@ -10,10 +16,17 @@
 
 #include "Common.h"
 #include "FileIO.h"
+#include "ReferenceCache.h"
 #include "Fields/SAMComment.h"
 
 class Stats;
 
+// Reference sequence of the current chromosome.
+// Chromosomes are read from the packed reference cache (see ReferenceCache) if there is one,
+// otherwise chromosomes of a local FASTA file with a valid .fai are read directly from the mapped file;
+// others (web files, directories, files without proper line geometry) are read into a buffer.
+// The index, mapping and cache of a FASTA file are loaded once per process and shared by all of its
+// references (see Reference::Source); each reference keeps its own position and buffer.
 class Reference {
 	friend class Stats;
 
@@ -24,10 +37,60 @@ public:
 		std::string filename;
 		size_t len;
 		size_t loc;
+		size_t lineBases, lineBytes; // FASTA line geometry from .fai (0 if unknown)
 	};
 
 private:
+	// Read-only mapping of a local FASTA file
+	struct Mapping {
+		const char *data;
+		size_t size;
+
+		Mapping (File &file);
+		~Mapping (void);
+	};
+
+	// FASTA file with its index, mapping and cache, shared by all the references to it.
+	// Only the input (for the buffered chromosomes) is not read-only; 
+	// it is locked while a reference reads from it at its own position.
+	struct Source {
+		std::string filename, webFile; // webFile: downloaded web FASTA file without index
+		std::unordered_map<std::string, Chromosome> chromosomes;
+		shared_ptr<File> input;
+		std::mutex inputMutex;
+		shared_ptr<Mapping> mapping;
+		shared_ptr<ReferenceCache> cache;
+		std::vector<size_t> starts; // sorted locations of the chromosomes in the FASTA file
+
+		// Chromosomes to be read ahead by the prefetch thread (started by the first request)
+		std::deque<std::string> prefetchQueue;
+		std::set<std::string> prefetched;
+		std::thread prefetchThread;
+		std::mutex prefetchMutex;
+		std::condition_variable prefetchReady;
+		std::atomic<bool> stopping;
+
+		// Chromosomes of the cache which match their MD5
+		std::set<const ReferenceCache::Chromosome*> verified;
+		std::mutex verifyMutex;
+
+		Source (const std::string &fn);
+		~Source (void);
+		// Source of the FASTA file, loaded unless some reference already uses it
+		static shared_ptr<Source> Get (const std::string &fn);
+
+		// Reads the chromosome ahead in the background (once per source)
+		void prefetch (const std::string &chr);
+		void prefetchLoop (void);
+		void warm (const std::string &chr);
+		// Checks the chromosome of the cache once per source; throws DZException if it is corrupted
+		void verify (const ReferenceCache::Chromosome &c);
+	};
+
+private:
+	shared_ptr<Source> source;
 	shared_ptr<File> input;
+	size_t inputPos; // position of the next character after c
 	std::string directory, filename;
 	std::string currentChr;
 	std::unordered_map<std::string, Chromosome> 
@@ -38,6 +101,16 @@ private:
 	std::string buffer;
 	size_t bufferStart, bufferEnd, currentPos;
 	char c;
+
+	// Current chromosome within the mapping (null if it is read into the buffer):
+	// base i is at mapped[i / lineBases * lineBytes + i % lineBases]
+	const char *mapped;
+	size_t mappedLen, lineBases, lineBytes;
+	// Current chromosome within the cache (null if it is not packed),
+	// with its exceptions which overlap the loaded part [bufferStart, bufferEnd)
+	const ReferenceCache::Chromosome *packed;
+	const uint8_t *packedBases;
+	const ReferenceCache::Exception *exceptionsFirst, *exceptionsLast;
 	
 public:
 	Reference (const std::string &filename);
@@ -55,19 +128,29 @@ public:
 
 	void loadIntoBuffer(size_t end);
 	char operator[](size_t pos) const;
+	// Loaded bases [pos, pos + len): points to the buffer if they are there, otherwise copies them to out
+	const char *bases(size_t pos, size_t len, char *out) const;
 	std::string copy(size_t start, size_t end);
 	void trim(size_t from);
+	void copyLoaded(const Reference &r, size_t start, size_t end);
+	// Warms the chromosome which is about to be scanned (by this or any other reference to the same file)
+	void prefetch(const std::string &chr) const;
 
-	size_t currentMemoryUsage() {
-		size_t sz = 
-			sizeInMemory(directory) + sizeInMemory(filename) + sizeInMemory(currentWebFile) +
-			sizeInMemory(currentChr) + sizeof(size_t) * 3 + sizeInMemory(buffer);
-		return sz; // Ignore chromosome size
+	// Loaded part of the chromosome (mapped chromosomes stay in the page cache); constant time
+	size_t currentMemoryUsage() const {
+		return sizeof(Reference) + buffer.capacity(); // Ignore chromosome size
 	}
 
 
 private:
-	void loadFromFASTA (const std::string &fn);
+	// Input positioned at inputPos (locked if it is shared)
+	std::unique_lock<std::mutex> lockInput (void);
+	// Serves the chromosome from the mapping if its .fai geometry matches the file
+	bool mapChromosome (const Chromosome &chr);
+	// Copies the bases [start, end) of the mapped or packed chromosome
+	void fill (size_t start, size_t end, char *out) const;
+	// Selects the exceptions of the packed chromosome within the loaded part
+	void selectExceptions (void);
 
 };
 
@@ -0,0 +1,334 @@
+#include "ReferenceCache.h"
+
+#include <vector>
+#include <numeric>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef OPENSSL
+#include <openssl/evp.h>
+#endif
+using namespace std;
+
+static const char MAGIC_CACHE[] = "DZREFIDX";
+
+static bool isCache (const string &path)
+{
+	FILE *fi = fopen(path.c_str(), "rb");
+	if (!fi)
+		return false;
+	char magic[8];
+	bool result = fread(magic, 1, 8, fi) == 8 && !memcmp(magic, MAGIC_CACHE, 8);
+	fclose(fi);
+	return result;
+}
+
+// Modification time in nanoseconds
+static uint64_t modified (const struct stat &s)
+{
+	return s.st_mtim.tv_sec * 1000000000ull + s.st_mtim.tv_nsec;
+}
+
+static void pad8 (FILE *out)
+{
+	static const char zeros[8] = { 0 };
+	size_t pos = ftell(out);
+	fwrite(zeros, 1, ((pos + 7) & ~size_t(7)) - pos, out);
+}
+
+ReferenceCache::ReferenceCache (const string &fasta):
+	mapping(0), mappingSize(0)
+{
+	ZAMAN_START_P(MapReference);
+	string path = Path(fasta);
+	struct stat fs, st;
+	if (stat(fasta.c_str(), &fs))
+		throw DZException("Cannot open FASTA file %s", fasta.c_str());
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1 || fstat(fd, &st)) {
+		if (fd != -1) close(fd);
+		throw DZException("Cannot open reference cache %s", path.c_str());
+	}
+	mappingSize = st.st_size;
+	if (mappingSize < 8 + sizeof(Trailer)) {
+		close(fd);
+		throw DZException("Reference cache %s is corrupted", path.c_str());
+	}
+	mapping = mmap(0, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		mapping = 0;
+		throw DZException("Cannot map reference cache %s", path.c_str());
+	}
+
+	auto fail = [&](const char *error) {
+		munmap(mapping, mappingSize);
+		mapping = 0;
+		throw DZException(error, path.c_str(), fasta.c_str());
+	};
+	const uint8_t *data = (const uint8_t*)mapping;
+	Trailer trailer;
+	memcpy(&trailer, data + mappingSize - sizeof(Trailer), sizeof(Trailer));
+	if (memcmp(data, MAGIC_CACHE, 8) || trailer.table % 8 || trailer.table < 8 + trailer.namesSize
+			|| trailer.table + trailer.chromosomes * sizeof(Chromosome) + sizeof(Trailer) != mappingSize)
+		fail("Reference cache %s is corrupted");
+	if (trailer.fastaSize != fs.st_size || trailer.fastaTime != modified(fs))
+		fail("Reference cache %s is out of date (rebuild it with deez --index-ref %s)");
+
+	chromosomes = (const Chromosome*)(data + trailer.table);
+	chromosomeCount = trailer.chromosomes;
+	names = (const char*)data + trailer.table - trailer.namesSize;
+	size_t namesStart = trailer.table - trailer.namesSize;
+	if (trailer.namesSize && names[trailer.namesSize - 1])
+		fail("Reference cache %s is corrupted");
+	for (size_t i = 0; i < chromosomeCount; i++) {
+		const Chromosome &c = chromosomes[i];
+		if (c.name >= trailer.namesSize || c.bases + (c.len + 3) / 4 > namesStart || c.exceptions % 8
+				|| c.exceptions + c.exceptionCount * sizeof(Exception) > namesStart)
+			fail("Reference cache %s is corrupted");
+	}
+	ZAMAN_END_P(MapReference);
+}
+
+ReferenceCache::~ReferenceCache (void)
+{
+	if (mapping)
+		munmap(mapping, mappingSize);
+}
+
+shared_ptr<ReferenceCache> ReferenceCache::Open (const string &fasta)
+{
+	if (File::IsWeb(fasta))
+		return nullptr;
+	if (!File::Exists(Path(fasta).c_str()))
+		return nullptr;
+	if (!isCache(Path(fasta))) {
+		DEBUG("Ignoring %s as it is not a reference cache", Path(fasta).c_str());
+		return nullptr;
+	}
+	return make_shared<ReferenceCache>(fasta);
+}
+
+const ReferenceCache::Chromosome *ReferenceCache::find (const string &chr) const
+{
+	auto it = lower_bound(chromosomes, chromosomes + chromosomeCount, chr,
+		[&](const Chromosome &c, const string &s) { return strcmp(names + c.name, s.c_str()) < 0; });
+	if (it == chromosomes + chromosomeCount || chr != names + it->name)
+		return nullptr;
+	return it;
+}
+
+string ReferenceCache::md5 (const Chromosome &c) const
+{
+	string result;
+	for (int i = 0; i < 16; i++)
+		result += S("%02x", c.md5[i]);
+	return result;
+}
+
+bool ReferenceCache::verify (const Chromosome &c) const
+{
+	#ifdef OPENSSL
+	ZAMAN_START_P(VerifyReference);
+	unique_ptr<EVP_MD_CTX, void (*)(EVP_MD_CTX*)> ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+	EVP_DigestInit_ex(ctx.get(), EVP_md5(), NULL);
+	const Exception *first = exceptions(c), *last = first + c.exceptionCount;
+	string chunk(MB, 0);
+	for (size_t start = 0; start < c.len; start += MB) {
+		size_t end = min(c.len, (uint64_t)(start + MB));
+		copy(bases(c), first, last, start, end, &chunk[0]);
+		EVP_DigestUpdate(ctx.get(), chunk.c_str(), end - start);
+	}
+	uint8_t md5[16];
+	EVP_DigestFinal_ex(ctx.get(), md5, NULL);
+	ZAMAN_END_P(VerifyReference);
+	return !memcmp(md5, c.md5, 16);
+	#else
+	return true;
+	#endif
+}
+
+void ReferenceCache::copy (const uint8_t *bases, const Exception *first, const Exception *last,
+	size_t start, size_t end, char *out)
+{
+	for (size_t pos = start; pos < end; pos++)
+		out[pos - start] = "ACGT"[(bases[pos / 4] >> (2 * (pos % 4))) & 3];
+	const Exception *e = upper_bound(first, last, start,
+		[](size_t p, const Exception &e) { return p < e.start; });
+	if (e != first)
+		e--;
+	for (; e != last && e->start < end; e++) {
+		size_t from = max(start, (size_t)e->start), to = min(end, (size_t)(e->start + e->len));
+		if (from < to)
+			memset(out + from - start, e->base, to - from);
+	}
+}
+
+// Writes the cache of the FASTA file fi (of size fs) to fo; returns the number of chromosomes
+static size_t writeCache (FILE *fi, const struct stat &fs, const string &fasta, FILE *fo)
+{
+	typedef ReferenceCache::Chromosome Chromosome;
+	typedef ReferenceCache::Exception Exception;
+	fwrite(MAGIC_CACHE, 1, 8, fo);
+
+	vector<Chromosome> chromosomes;
+	vector<string> chrNames;
+	map<string, size_t> seen;
+	vector<uint8_t> packed;
+	vector<Exception> exceptions;
+	string bases; // upper-cased bases for the MD5
+	size_t len = 0;
+	bool inChromosome = false;
+	#ifdef OPENSSL
+	unique_ptr<EVP_MD_CTX, void (*)(EVP_MD_CTX*)> ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+	#endif
+
+	auto flushBases = [&](void) {
+		#ifdef OPENSSL
+		EVP_DigestUpdate(ctx.get(), bases.c_str(), bases.size());
+		#endif
+		bases.clear();
+	};
+	auto endChromosome = [&](void) {
+		if (!inChromosome)
+			return;
+		Chromosome c;
+		memset(&c, 0, sizeof(Chromosome));
+		c.len = len;
+		pad8(fo);
+		c.bases = ftell(fo);
+		fwrite(packed.data(), 1, packed.size(), fo);
+		pad8(fo);
+		c.exceptions = ftell(fo);
+		c.exceptionCount = exceptions.size();
+		fwrite(exceptions.data(), sizeof(Exception), exceptions.size(), fo);
+		flushBases();
+		#ifdef OPENSSL
+		EVP_DigestFinal_ex(ctx.get(), c.md5, NULL);
+		#endif
+		chromosomes.push_back(c);
+		LOG("Packed %s: %'lu bases, %'lu exceptions", chrNames.back().c_str(), len, exceptions.size());
+	};
+
+	int ch;
+	while ((ch = getc_unlocked(fi)) != EOF) {
+		if (ch == '>') {
+			endChromosome();
+			string chr;
+			while ((ch = getc_unlocked(fi)) != EOF && !isspace(ch))
+				chr += ch;
+			while (ch != '\n' && ch != EOF)
+				ch = getc_unlocked(fi);
+			if (!seen.insert(make_pair(chr, chrNames.size())).second)
+				throw DZException("Chromosome %s appears twice in %s", chr.c_str(), fasta.c_str());
+			chrNames.push_back(chr);
+			packed.clear();
+			exceptions.clear();
+			len = 0;
+			inChromosome = true;
+			#ifdef OPENSSL
+			EVP_DigestInit_ex(ctx.get(), EVP_md5(), NULL);
+			#endif
+			continue;
+		}
+		if (isspace(ch) || !inChromosome)
+			continue;
+		ch = toupper(ch);
+		int code = (ch == 'A' ? 0 : (ch == 'C' ? 1 : (ch == 'G' ? 2 : (ch == 'T' ? 3 : -1))));
+		if (len % 4 == 0)
+			packed.push_back(0);
+		if (code != -1) {
+			packed.back() |= code << (2 * (len % 4));
+		} else if (exceptions.size() && exceptions.back().base == ch
+				&& exceptions.back().start + exceptions.back().len == len && exceptions.back().len < UINT32_MAX) {
+			exceptions.back().len++;
+		} else {
+			Exception e;
+			memset(&e, 0, sizeof(Exception));
+			e.start = len, e.len = 1, e.base = ch;
+			exceptions.push_back(e);
+		}
+		bases += ch;
+		if (bases.size() >= MB)
+			flushBases();
+		len++;
+	}
+	endChromosome();
+	if (ferror(fi))
+		throw DZException("Cannot read FASTA file %s", fasta.c_str());
+
+	vector<size_t> order(chromosomes.size());
+	iota(order.begin(), order.end(), 0);
+	sort(order.begin(), order.end(), [&](size_t a, size_t b) { return chrNames[a] < chrNames[b]; });
+	string names;
+	vector<Chromosome> table;
+	for (size_t i: order) {
+		table.push_back(chromosomes[i]);
+		table.back().name = names.size();
+		names += chrNames[i];
+		names += '\0';
+	}
+	// names end at the (aligned) table
+	size_t pos = ftell(fo) + names.size();
+	static const char zeros[8] = { 0 };
+	fwrite(zeros, 1, ((pos + 7) & ~size_t(7)) - pos, fo);
+	fwrite(names.c_str(), 1, names.size(), fo);
+	ReferenceCache::Trailer trailer = { (uint64_t)fs.st_size, modified(fs), table.size(), names.size(), (uint64_t)ftell(fo) };
+	fwrite(table.data(), sizeof(Chromosome), table.size(), fo);
+	fwrite(&trailer, sizeof(trailer), 1, fo);
+	return table.size();
+}
+
+void ReferenceCache::Build (const string &fasta, bool overwrite)
+{
+	ZAMAN_START_P(IndexReference);
+	if (File::IsWeb(fasta))
+		throw DZException("Web locations are not supported for the reference cache");
+	string path = Path(fasta);
+	if (File::Exists(path.c_str()) && !isCache(path)) {
+		if (!overwrite)
+			throw DZException("File %s already exists and is not a reference cache. Use -! to overwrite", path.c_str());
+		WARN("File %s is not a reference cache. Overwriting it.", path.c_str());
+	}
+	struct stat fs;
+	FILE *fi = fopen(fasta.c_str(), "rb");
+	if (!fi || fstat(fileno(fi), &fs)) {
+		if (fi) fclose(fi);
+		throw DZException("Cannot open FASTA file %s", fasta.c_str());
+	}
+	// The cache is written next to the old one and renamed over it once complete,
+	// so the processes which map the old cache keep reading it intact
+	string temp = path + ".XXXXXX";
+	int fd = mkstemp(&temp[0]);
+	FILE *fo = (fd == -1) ? 0 : fdopen(fd, "wb");
+	if (!fo) {
+		if (fd != -1) close(fd), unlink(temp.c_str());
+		fclose(fi);
+		throw DZException("Cannot create reference cache %s", path.c_str());
+	}
+	mode_t mask = umask(0);
+	umask(mask);
+	fchmod(fd, 0666 & ~mask);
+
+	LOG("Building reference cache %s ...", path.c_str());
+	size_t chromosomes;
+	try {
+		chromosomes = writeCache(fi, fs, fasta, fo);
+		if (ferror(fo) || fflush(fo) || fsync(fd))
+			throw DZException("Cannot write reference cache %s", path.c_str());
+	} catch (...) {
+		fclose(fi);
+		fclose(fo);
+		unlink(temp.c_str());
+		throw;
+	}
+	fclose(fi);
+	bool failed = fclose(fo) != 0;
+	if (failed || rename(temp.c_str(), path.c_str())) {
+		unlink(temp.c_str());
+		throw DZException("Cannot write reference cache %s", path.c_str());
+	}
+	LOG("Written reference cache %s (%'lu chromosomes)", path.c_str(), chromosomes);
+	ZAMAN_END_P(IndexReference);
+}
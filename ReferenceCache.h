@@ -0,0 +1,87 @@
+#ifndef ReferenceCache_H
+#define ReferenceCache_H
+
+#include "Common.h"
+
+#include <algorithm>
+#include <string>
+
+// Packed reference (<FASTA>.dzrefidx), built by deez --index-ref and mapped by the later runs.
+// Bases are stored upper-cased, as they are read from the FASTA file:
+//		magic DZREFIDX
+//		for each chromosome (aligned to 8 bytes):
+//			bases packed 2 bits each (A, C, G, T = 0-3; base i in the bits 2 * (i % 4) of byte i / 4)
+//			Exception[] runs of all the other bases (N, IUPAC codes, ...) sorted by start
+//		chromosome names
+//		Chromosome[chromosomes] sorted by name
+//		Trailer
+// Cache is ignored once the FASTA file changes (its size or modification time differs);
+// each chromosome is checked against its MD5 before it is first used.
+class ReferenceCache {
+public:
+	struct Chromosome {
+		uint64_t name; // offset within the names
+		uint64_t len;
+		uint64_t bases, exceptions, exceptionCount; // offsets within the file
+		uint8_t md5[16]; // MD5 of the upper-cased bases (as in @SQ:M5)
+	};
+	struct Exception {
+		uint64_t start;
+		uint32_t len;
+		char base;
+		char padding[3];
+	};
+	struct Trailer {
+		uint64_t fastaSize, fastaTime;
+		uint64_t chromosomes, namesSize, table;
+	};
+
+private:
+	void *mapping;
+	size_t mappingSize;
+	const Chromosome *chromosomes;
+	const char *names;
+	size_t chromosomeCount;
+
+public:
+	// Maps the cache of the FASTA file.
+	// Throws DZException if the cache is corrupted or older than the FASTA file
+	ReferenceCache (const std::string &fasta);
+	~ReferenceCache (void);
+
+	// Returns null if there is no cache file (or if it is a file of earlier DeeZ versions)
+	static shared_ptr<ReferenceCache> Open (const std::string &fasta);
+	// Writes the cache of the FASTA file.
+	// Throws DZException if that would replace a file of earlier DeeZ versions, unless overwrite is set
+	static void Build (const std::string &fasta, bool overwrite);
+	static std::string Path (const std::string &fasta) { return fasta + ".dzrefidx"; }
+
+public:
+	size_t size (void) const { return chromosomeCount; }
+	const Chromosome &operator[] (size_t i) const { return chromosomes[i]; }
+	// Returns null if there is no such chromosome
+	const Chromosome *find (const std::string &chr) const;
+	const char *name (const Chromosome &c) const { return names + c.name; }
+	std::string md5 (const Chromosome &c) const;
+	// Checks the bases of the chromosome against their MD5 (always passes without OpenSSL)
+	bool verify (const Chromosome &c) const;
+	const uint8_t *bases (const Chromosome &c) const { return (const uint8_t*)mapping + c.bases; }
+	const Exception *exceptions (const Chromosome &c) const { return (const Exception*)((const uint8_t*)mapping + c.exceptions); }
+
+	// Base at pos (pos < len) given the exceptions which may cover it
+	static char base (const uint8_t *bases, const Exception *first, const Exception *last, size_t pos)
+	{
+		if (first != last) {
+			const Exception *e = std::upper_bound(first, last, pos,
+				[](size_t p, const Exception &e) { return p < e.start; });
+			if (e != first && pos < (e - 1)->start + (e - 1)->len)
+				return (e - 1)->base;
+		}
+		return "ACGT"[(bases[pos / 4] >> (2 * (pos % 4))) & 3];
+	}
+	// Unpacks the bases [start, end) (end <= len) into out
+	static void copy (const uint8_t *bases, const Exception *first, const Exception *last,
+		size_t start, size_t end, char *out);
+};
+
+#endif // ReferenceCache_H
@@ -0,0 +1,213 @@
+#include "Common.h"
+#include "Scheduler.h"
+using namespace std;
+
+thread_local int Scheduler::currentWorker = -1;
+
+Scheduler::Scheduler (void):
+	queued(0), nextWorker(0), stopping(false)
+{
+#ifdef ZAMAN
+	statTasks = statSteals = statHelped = statDepthSum = statMaxDepth = 0;
+#endif
+}
+
+Scheduler::~Scheduler (void)
+{
+	{
+		unique_lock<mutex> lock(sleepMutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (auto &t: threads)
+		t.join();
+	for (auto &w: workers)
+		for (auto t: w->tasks)
+			delete t;
+}
+
+void Scheduler::start (void)
+{
+	call_once(started, [&]() {
+		int n = max(1, optThreads);
+		for (int i = 0; i < n; i++)
+			workers.push_back(unique_ptr<Worker>(new Worker()));
+		for (int i = 0; i < n; i++)
+			threads.push_back(thread(&Scheduler::workerLoop, this, i));
+	});
+}
+
+size_t Scheduler::size (void)
+{
+	start();
+	return workers.size();
+}
+
+void Scheduler::submit (Task *t, int affinity)
+{
+	start();
+	size_t w;
+	if (affinity >= 0)
+		w = affinity % workers.size();
+	else if (currentWorker != -1) // keep spawned tasks local to the spawning worker
+		w = currentWorker;
+	else
+		w = nextWorker++ % workers.size();
+	{
+		unique_lock<mutex> lock(workers[w]->mtx);
+		workers[w]->tasks.push_back(t);
+	}
+	size_t depth = ++queued;
+#ifdef ZAMAN
+	statTasks++;
+	statDepthSum += depth;
+	for (uint64_t m = statMaxDepth; depth > m && !statMaxDepth.compare_exchange_weak(m, depth); );
+#endif
+	{
+		unique_lock<mutex> lock(sleepMutex);
+	}
+	wake.notify_one();
+}
+
+bool Scheduler::take (int worker, Task *&t)
+{
+	// Own queue first (FIFO), then steal the newest task of the others
+	size_t n = workers.size();
+	size_t self = (worker == -1) ? 0 : worker;
+	for (size_t i = 0; i < n; i++) {
+		Worker &w = *workers[(self + i) % n];
+		unique_lock<mutex> lock(w.mtx);
+		if (!w.tasks.size())
+			continue;
+		if (i == 0 && worker != -1) {
+			t = w.tasks.front();
+			w.tasks.pop_front();
+		} else {
+			t = w.tasks.back();
+			w.tasks.pop_back();
+		#ifdef ZAMAN
+			if (worker != -1) statSteals++;
+		#endif
+		}
+		queued--;
+		return true;
+	}
+	return false;
+}
+
+bool Scheduler::runOne (void)
+{
+	start();
+	Task *t;
+	if (!take(currentWorker, t))
+		return false;
+#ifdef ZAMAN
+	if (currentWorker == -1) statHelped++;
+#endif
+	execute(t, currentWorker);
+	return true;
+}
+
+void Scheduler::execute (Task *t, int worker)
+{
+#ifdef ZAMAN
+	// Task may run on a thread which is in the middle of its own timing (see TaskGroup::wait)
+	__zaman__ saved;
+	swap(saved, __zaman_thread__);
+	__zaman_thread__.root = t->root;
+#endif
+	exception_ptr e = nullptr;
+	try {
+		t->fn();
+	} catch (...) {
+		e = current_exception();
+	}
+#ifdef ZAMAN
+	ZAMAN_THREAD_JOIN();
+	swap(saved, __zaman_thread__);
+#endif
+	TaskGroup *g = t->group;
+	delete t;
+	g->finish(e);
+}
+
+void Scheduler::workerLoop (int worker)
+{
+	currentWorker = worker;
+	while (1) {
+		Task *t;
+		if (take(worker, t)) {
+			execute(t, worker);
+			continue;
+		}
+		unique_lock<mutex> lock(sleepMutex);
+		wake.wait(lock, [&] { return stopping || queued > 0; });
+		if (stopping && !queued)
+			break;
+	}
+}
+
+void Scheduler::reportStats (void)
+{
+#ifdef ZAMAN
+	ZAMAN_COUNT("Scheduler_Threads", workers.size());
+	ZAMAN_COUNT("Scheduler_Tasks", statTasks);
+	ZAMAN_COUNT("Scheduler_Steals", statSteals);
+	ZAMAN_COUNT("Scheduler_Helped", statHelped);
+	ZAMAN_COUNT("Scheduler_QueueDepthMax", statMaxDepth);
+	ZAMAN_COUNT("Scheduler_QueueDepthAvg", statTasks ? statDepthSum / statTasks : 0);
+#endif
+}
+
+TaskGroup::~TaskGroup (void)
+{
+	try { // only reached without wait() when unwinding
+		wait();
+	} catch (...) {
+	}
+}
+
+void TaskGroup::run (function<void(void)> fn, int affinity)
+{
+	auto t = new Scheduler::Task();
+	t->fn = fn;
+	t->group = this;
+#ifdef ZAMAN
+	t->root = __zaman_thread__.root;
+#endif
+	{
+		unique_lock<mutex> lock(mtx);
+		pending++;
+	}
+	scheduler.submit(t, affinity);
+}
+
+bool TaskGroup::finished (void)
+{
+	unique_lock<mutex> lock(mtx);
+	return !pending;
+}
+
+void TaskGroup::wait (void)
+{
+	while (!finished()) {
+		if (scheduler.runOne())
+			continue;
+		unique_lock<mutex> lock(mtx);
+		done.wait_for(lock, chrono::milliseconds(1), [&] { return !pending; });
+	}
+	if (error) {
+		auto e = error;
+		error = nullptr;
+		rethrow_exception(e);
+	}
+}
+
+void TaskGroup::finish (exception_ptr e)
+{
+	unique_lock<mutex> lock(mtx);
+	if (e && !error)
+		error = e;
+	if (!--pending)
+		done.notify_all();
+}
@@ -0,0 +1,99 @@
+#ifndef Scheduler_H
+#define Scheduler_H
+
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <exception>
+#include <functional>
+#include <condition_variable>
+
+#include <string>
+
+class TaskGroup;
+
+// Process-wide pool of long-lived workers.
+// Each worker owns a task queue; idle workers steal from the others.
+// Tasks are submitted through a TaskGroup and may carry an affinity hint
+// (e.g. a field index), which places them into the queue of a particular worker.
+class Scheduler {
+	struct Task {
+		std::function<void(void)> fn;
+		TaskGroup *group;
+	#ifdef ZAMAN
+		std::string root;
+	#endif
+	};
+	struct Worker {
+		std::mutex mtx;
+		std::deque<Task*> tasks;
+	};
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::vector<std::thread> threads;
+	std::once_flag started;
+
+	std::mutex sleepMutex;
+	std::condition_variable wake;
+	std::atomic<size_t> queued;
+	std::atomic<size_t> nextWorker;
+	bool stopping;
+
+	static thread_local int currentWorker;
+
+#ifdef ZAMAN
+	std::atomic<uint64_t> statTasks, statSteals, statHelped, statDepthSum, statMaxDepth;
+#endif
+
+public:
+	Scheduler (void);
+	~Scheduler (void);
+
+public:
+	// Starts optThreads workers if not already started
+	void start (void);
+	size_t size (void);
+	void reportStats (void);
+
+private:
+	void submit (Task *t, int affinity);
+	bool take (int worker, Task *&t);
+	bool runOne (void);
+	void execute (Task *t, int worker);
+	void workerLoop (int worker);
+
+	friend class TaskGroup;
+};
+
+extern Scheduler ThreadPool;
+
+// Set of tasks which can be waited for together.
+// Waiting thread helps with the queued tasks instead of sleeping.
+// The first exception thrown by a task is re-thrown by wait().
+class TaskGroup {
+	Scheduler &scheduler;
+	size_t pending;
+	std::mutex mtx;
+	std::condition_variable done;
+	std::exception_ptr error;
+
+public:
+	TaskGroup (Scheduler &s = ThreadPool):
+		scheduler(s), pending(0), error(nullptr) {}
+	~TaskGroup (void);
+
+public:
+	void run (std::function<void(void)> fn, int affinity = -1);
+	void wait (void);
+
+private:
+	bool finished (void);
+	void finish (std::exception_ptr e);
+
+	friend class Scheduler;
+};
+
+#endif // Scheduler_H
@@ -93,8 +93,8 @@ public:
 		decompressArray(freqComp, source, freqData);
 		source_sz -= source - prevSource;
 
-		if (!stats.size()) 
-			stats.resize(AS, vector<rANSCoder::Stat>(AS + 1));
+		// Frequencies are complete for each block: blocks are decoded without the previous ones
+		stats.assign(AS, vector<rANSCoder::Stat>(AS + 1));
 		for (size_t i = 0; i < freqData.size(); ) {
 			uint16_t c = *(uint16_t*)(freqData.data() + i); i += sizeof(uint16_t);
 			uint8_t fMin = freqData[i++];
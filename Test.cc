@@ -0,0 +1,78 @@
+// Microbenchmark of the MD/NM computation: scalar path against the SIMD kernels.
+// Build with make test; run as ./deeztest [reads] [mismatch rate] [read length]
+// Each kernel is timed as the best of three runs.
+#include "Common.h"
+#include "Fields/MDKernel.h"
+
+#include <random>
+#include <vector>
+using namespace std;
+
+int main (int argc, char **argv)
+{
+	size_t reads = argc > 1 ? atol(argv[1]) : 1000000;
+	double rate = argc > 2 ? atof(argv[2]) : 0.01;
+	const size_t readLength = argc > 3 ? atol(argv[3]) : 150;
+
+	initCache();
+	mt19937 rng(786);
+	string ref(4 * MB, 'A');
+	for (auto &c: ref)
+		c = "ACGT"[rng() % 4];
+	vector<size_t> pos(reads);
+	string seqs(reads * readLength, 'A');
+	uniform_real_distribution<double> coin(0, 1);
+	for (size_t r = 0; r < reads; r++) {
+		pos[r] = rng() % (ref.size() - readLength);
+		for (size_t i = 0; i < readLength; i++) {
+			char c = ref[pos[r] + i];
+			seqs[r * readLength + i] = coin(rng) < rate ? "ACGTN"[(c == 'A') + rng() % 4] : c;
+		}
+	}
+
+	struct { const char *name; MDKernel::Kernel kernel; } kernels[] = {
+		{ "scalar", 0 },
+		{ "scalar mask", MDKernel::scalar },
+		{ "sse4.1", MDKernel::sse41 },
+		{ "avx2", __builtin_cpu_supports("avx2") ? MDKernel::avx2 : 0 },
+	};
+	vector<string> expected(reads);
+	double base = 0;
+	for (auto &k: kernels) {
+		if (!k.kernel && strcmp(k.name, "scalar"))
+			continue;
+		string MD;
+		size_t mismatches = 0, bad = 0;
+		auto run = [&](void) {
+			mismatches = bad = 0;
+			int64_t t = zaman();
+			for (size_t r = 0; r < reads; r++) {
+				size_t mdOperLen = 0;
+				int NM = 0;
+				MD.clear();
+				const char *seq = seqs.c_str() + r * readLength;
+				if (k.kernel)
+					MDKernel::alignedRun(k.kernel, ref.c_str() + pos[r], seq, readLength, mdOperLen, MD, NM);
+				else
+					MDKernel::alignedRunScalar(ref.c_str() + pos[r], seq, readLength, mdOperLen, MD, NM);
+				inttostr(mdOperLen, MD);
+				mismatches += NM;
+				if (!k.kernel)
+					expected[r] = MD;
+				else if (MD != expected[r])
+					bad++;
+			}
+			return (zaman() - t) / 1e6;
+		};
+		double s = run();
+		for (int i = 1; i < 3; i++)
+			s = min(s, run());
+		if (!k.kernel)
+			base = s;
+		printf("%-12s %8.3lfs %6.2lf ns/base %5.2lfx  %lu mismatches, %lu wrong MD\n", k.name, s,
+			s * 1e9 / (reads * readLength), base / s, mismatches, bad);
+		if (bad)
+			return 1;
+	}
+	return 0;
+}
@@ -5,7 +5,7 @@
 #define MB  KB * 1024LL
 #define GB  MB * 1024LL
 
-#define VERSION	0x20 // 0x10
+#define VERSION	0x21 // 0x10
 #define MAGIC 	(0x07445A00ll | VERSION)
 
 extern int  optLogLevel;
@@ -51,9 +51,11 @@ inline uint64_t zaman()
 	public:
 		std::map<std::string, uint64_t> times;
 		std::string prefix;
+		std::string root; // if set, used instead of prefix_global when joining
 
 	public:
 		static std::map<std::string, uint64_t> times_global;
+		static std::map<std::string, uint64_t> counts_global;
 		static std::string prefix_global;
 		static std::mutex mtx;
 	};
@@ -69,16 +71,30 @@ inline uint64_t zaman()
 		__zaman_thread__.prefix = __zaman_thread__.prefix.substr(0, __zaman_thread__.prefix.size() - 1 - strlen(#s)); 
 	#define ZAMAN_THREAD_JOIN() \
 		{ 	std::lock_guard<std::mutex> __l__(__zaman__::mtx); \
+			const std::string &__p__ = __zaman_thread__.root.size() ? __zaman_thread__.root : __zaman__::prefix_global; \
 			for (auto &s: __zaman_thread__.times) \
-				__zaman__::times_global[__zaman__::prefix_global + s.first] += s.second; \
+				__zaman__::times_global[__p__ + s.first] += s.second; \
 			__zaman_thread__.times.clear(); \
 		}
+	// Pipeline stages run next to the main thread; make their joins independent of its prefix
+	#define ZAMAN_THREAD_ROOT(s) \
+		__zaman_thread__.root = s;
+	// Non-time statistics (e.g. scheduler counters), reported after the timings
+	#define ZAMAN_COUNT(s, v) \
+		{ 	std::lock_guard<std::mutex> __l__(__zaman__::mtx); \
+			__zaman__::counts_global[s] = (v); }
+	// Threads with their own root (e.g. per-file parsing threads) extend the root instead of the global prefix
+	#define ZAMAN_PREFIX_P() \
+		(__zaman_thread__.root.size() ? __zaman_thread__.root : __zaman__::prefix_global)
 	#define ZAMAN_START_P(s) \
 		int64_t ZAMAN_VAR(s) = zaman(); \
-		__zaman__::prefix_global += std::string(#s) + "_"; 
+		{ 	std::lock_guard<std::mutex> __l__(__zaman__::mtx); \
+			ZAMAN_PREFIX_P() += std::string(#s) + "_"; }
 	#define ZAMAN_END_P(s) \
-		__zaman__::times_global[__zaman__::prefix_global] += (zaman() - ZAMAN_VAR(s)); \
-		__zaman__::prefix_global = __zaman__::prefix_global.substr(0, __zaman__::prefix_global.size() - 1 - strlen(#s)); \
+		{ 	std::lock_guard<std::mutex> __l__(__zaman__::mtx); \
+			std::string &__p__ = ZAMAN_PREFIX_P(); \
+			__zaman__::times_global[__p__] += (zaman() - ZAMAN_VAR(s)); \
+			__p__ = __p__.substr(0, __p__.size() - 1 - strlen(#s)); }
 
 	inline void ZAMAN_REPORT() 
 	{ 
@@ -98,12 +114,16 @@ inline uint64_t zaman()
 			p = f;
 			LOG("  %-40s: %'8.1lfs", s.c_str(), tt.second/1000000.0);
 		}
+		for (auto &tt: __zaman__::counts_global)
+			LOG("  %-40s: %'8lu", tt.first.c_str(), tt.second);
 	}
 #else
 	#define ZAMAN_VAR(s)	
 	#define ZAMAN_START(s) 
 	#define ZAMAN_END(s)
 	#define ZAMAN_THREAD_JOIN()
+	#define ZAMAN_THREAD_ROOT(s)
+	#define ZAMAN_COUNT(s, v)
 	#define ZAMAN_START_P(s)
 	#define ZAMAN_END_P(s)
 	#define ZAMAN_REPORT()
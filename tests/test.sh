@@ -54,6 +54,26 @@ function test {
 	fi;
 }
 
+# Decompresses an archive written by an earlier DeeZ version (kept gzipped)
+function testdz {
+	sam=$1;
+	ref="-r $2";
+
+	echo -ne "${sam}\t${ref}\n\tDecompressing ... " >&2 ;
+	gzip -dc ${sam%.sam}.dz.gz > ${out}/${sam%.sam}.dz
+	cmdd="${deez} -h ${ref} ${out}/${sam%.sam}.dz -! -o ${out}/dz_${sam}.sam";
+	`${cmdd} 2>${log}/d_${sam}`;
+
+	echo -ne "\tTesting ... " >&2 ;
+	if `cmp ${sam} ${out}/dz_${sam}.sam 2>/dev/null` ;
+	then 
+		echo "OK" >&2
+	else
+		echo -ne "FAIL\n\t\tDC: ${cmdd}\n" >&2 
+		exit
+	fi;
+}
+
 # function testra {
 # 	sam=$1;
 # 	ref="";
@@ -112,6 +132,14 @@ function test {
 
 # TODO: test random access, noqual, filtering
 
+echo -ne "========================================================================\n"
+echo -ne "### Batch legacy\n" >&2 ;
+echo -ne "========================================================================\n"
+# fai.fa.fai has the chromosome lengths in place of the line geometry, as written by DeeZ 1.9
+cd staden
+testdz "fai#twoline.sam" "fai.fa"
+cd ..
+
 echo -ne "========================================================================\n"
 echo -ne "### Batch BASIC\n" >&2 ;
 echo -ne "========================================================================\n"